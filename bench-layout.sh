@@ -0,0 +1,28 @@
+#!/bin/sh
+
+# Compares the allocation policies on a directory tree: builds an image of
+# it with each one and prints the --layout-report of the images, that is,
+# how many seeks, and how far, reading the whole tree directory by
+# directory takes.
+#
+# usage: bench-layout.sh directory [genext2fs options]
+# for instance: sh bench-layout.sh /usr/lib -b 2000000 -N 200000
+
+set -e
+
+if [ $# -lt 1 ] ; then
+	echo "usage: $0 directory [genext2fs options]" >&2
+	exit 1
+fi
+
+dir=$1
+shift
+img=t_bench_layout.img
+genext2fs=${GENEXT2FS:-./genext2fs}
+
+for policy in spread orlov ; do
+	printf '%-8s' $policy
+	$genext2fs -d $dir -f -q --sort=name --alloc-policy=$policy \
+		--layout-report "$@" $img
+done
+rm -f $img
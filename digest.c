@@ -0,0 +1,209 @@
+/* Message digests: MD5 (RFC 1321) and SHA-256 (FIPS 180-4), used for
+   the checksum of the finished image */
+
+#include <string.h>
+
+#include "digest.h"
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+md5_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[16], a = h[0], b = h[1], c = h[2], d = h[3], f, t;
+	int i, g;
+
+	for (i = 0; i < 16; i++)
+		w[i] = p[i * 4] | (p[i * 4 + 1] << 8) |
+		       (p[i * 4 + 2] << 16) | ((uint32_t) p[i * 4 + 3] << 24);
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+		}
+		t = d;
+		d = c;
+		c = b;
+		b += ROL(a + f + md5_k[i] + w[g], md5_r[i]);
+		a = t;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+#define S0(x)	(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)	(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define G0(x)	(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define G1(x)	(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+// one round, with the working variables rotated by the caller
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i) do { \
+	uint32_t t = h + S1(e) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i]; \
+	d += t; \
+	h = t + S0(a) + ((a & b) ^ (a & c) ^ (b & c)); \
+} while (0)
+
+static void
+sha256_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t) p[i * 4] << 24) | (p[i * 4 + 1] << 16) |
+		       (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] + G0(w[i - 15]) + G1(w[i - 2]);
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i += 8) {
+		SHA256_ROUND(a, b, c, d, e, f, g, k, i);
+		SHA256_ROUND(k, a, b, c, d, e, f, g, i + 1);
+		SHA256_ROUND(g, k, a, b, c, d, e, f, i + 2);
+		SHA256_ROUND(f, g, k, a, b, c, d, e, i + 3);
+		SHA256_ROUND(e, f, g, k, a, b, c, d, i + 4);
+		SHA256_ROUND(d, e, f, g, k, a, b, c, i + 5);
+		SHA256_ROUND(c, d, e, f, g, k, a, b, i + 6);
+		SHA256_ROUND(b, c, d, e, f, g, k, a, i + 7);
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+digest_block(digest_ctx *c, const uint8_t *p)
+{
+	if (c->alg == DIGEST_MD5)
+		md5_block(c->h, p);
+	else
+		sha256_block(c->h, p);
+}
+
+void
+digest_init(digest_ctx *c, int alg)
+{
+	static const uint32_t md5_h[4] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+	};
+	static const uint32_t sha256_h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memset(c, 0, sizeof(*c));
+	c->alg = alg;
+	if (alg == DIGEST_MD5)
+		memcpy(c->h, md5_h, sizeof(md5_h));
+	else
+		memcpy(c->h, sha256_h, sizeof(sha256_h));
+}
+
+void
+digest_update(digest_ctx *c, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = c->len % 64, n;
+
+	c->len += len;
+	if (used) {
+		n = 64 - used;
+		if (n > len)
+			n = len;
+		memcpy(c->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		digest_block(c, c->buf);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		digest_block(c, p);
+	memcpy(c->buf, p, len);
+}
+
+void
+digest_final(digest_ctx *c, uint8_t *out)
+{
+	uint64_t bits = c->len * 8;
+	size_t used = c->len % 64;
+	int i;
+
+	c->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(c->buf + used, 0, 64 - used);
+		digest_block(c, c->buf);
+		used = 0;
+	}
+	memset(c->buf + used, 0, 56 - used);
+	// the length in bits: little endian for MD5, big endian for SHA-256
+	for (i = 0; i < 8; i++)
+		c->buf[c->alg == DIGEST_MD5 ? 56 + i : 63 - i] = bits >> (8 * i);
+	digest_block(c, c->buf);
+	for (i = 0; i < (int) digest_size(c->alg); i++)
+		out[i] = (c->alg == DIGEST_MD5) ?
+			 c->h[i / 4] >> (8 * (i % 4)) :
+			 c->h[i / 4] >> (8 * (3 - i % 4));
+}
+
+size_t
+digest_size(int alg)
+{
+	return (alg == DIGEST_MD5) ? 16 : 32;
+}
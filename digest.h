@@ -0,0 +1,28 @@
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Message digests (MD5 and SHA-256) for the image checksums */
+
+#define DIGEST_MD5	1
+#define DIGEST_SHA256	2
+
+#define DIGEST_MAX_SIZE	32
+
+typedef struct
+{
+    int alg;
+    uint32_t h[8];
+    uint64_t len;	/* bytes taken in */
+    uint8_t buf[64];	/* partial block */
+} digest_ctx;
+
+void digest_init(digest_ctx *c, int alg);
+void digest_update(digest_ctx *c, const void *data, size_t len);
+/* Write the digest (digest_size bytes) to out */
+void digest_final(digest_ctx *c, uint8_t *out);
+size_t digest_size(int alg);
+
+#endif /* __DIGEST_H__ */
@@ -148,11 +148,51 @@
 # include <limits.h>
 #endif
 
+#if HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+
+#if HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+#if HAVE_ZSTD_H
+# include <zstd.h>
+#endif
+
+#if HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+#if HAVE_SYS_IOCTL_H
+# include <sys/ioctl.h>
+#endif
+
+#if HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
+#if HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
 #include "cache.h"
+#include "digest.h"
 
 struct stats {
 	unsigned long nblocks;
 	unsigned long ninodes;
+	// files that may be hard links, counted each time (see stats_links)
+	struct stats_link *links;
+	unsigned long nlinks;
+	// bytes used in the root directory while it hasn't been sized
+	unsigned long root_used;
 };
 
 // block size
@@ -299,7 +339,8 @@ static int blocksize = 1024;
 	( (nod) - GRP_GROUP_OF_INODE((fs),(nod))*(fs)->sb->s_inodes_per_group )
 
 // Given a block number find the group it belongs to
-#define GRP_GROUP_OF_BLOCK(fs,blk) ( ((blk)-1) / (fs)->sb->s_blocks_per_group)
+#define GRP_GROUP_OF_BLOCK(fs,blk) \
+	( ((blk)-(fs)->sb->s_first_data_block) / (fs)->sb->s_blocks_per_group )
 	
 //Given a block number get/put the block bitmap that covers it
 #define GRP_GET_BLOCK_BITMAP(fs,blk,bi,gi)				\
@@ -309,7 +350,7 @@ static int blocksize = 1024;
 
 //Given a block number find its offset within the block bitmap that covers it
 #define GRP_BBM_OFFSET(fs,blk) \
-	( (blk) - GRP_GROUP_OF_BLOCK((fs),(blk))*(fs)->sb->s_blocks_per_group )
+	( ((blk)-(fs)->sb->s_first_data_block) % (fs)->sb->s_blocks_per_group + 1 )
 
 
 // used types
@@ -320,6 +361,7 @@ typedef signed short int16;
 typedef unsigned short uint16;
 typedef signed int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 
 // the GNU C library has a wonderful scanf("%as", string) which will
@@ -653,10 +695,34 @@ struct hdlinks_s
 	struct hdlink_s *hdl;
 };
 
+/* Positional I/O on the image.  Each implementation returns what
+   pread/pwrite would, the io_* wrappers handle short transfers and
+   errors. */
+typedef struct io_backend
+{
+	ssize_t (*read_at)(struct io_backend *io, void *buf, size_t len, off_t off);
+	ssize_t (*write_at)(struct io_backend *io, const void *buf, size_t len, off_t off);
+	ssize_t (*writev_at)(struct io_backend *io, const struct iovec *iov, int iovcnt, off_t off);
+	int (*truncate)(struct io_backend *io, off_t len);
+	int (*punch)(struct io_backend *io, off_t off, off_t len);
+	void (*close)(struct io_backend *io);
+	int fd;
+	int stream;	// pipe or tty: offsets must be increasing
+	off_t pos;	// current position of a stream
+} io_backend;
+
+#define IO_FILE		0	// pread/pwrite
+#define IO_DIRECT	1	// O_DIRECT with aligned bounce buffers
+#define IO_COUNT	2	// pread/pwrite, reporting the number of calls
+
+struct writeback;
+struct layout;
+
 /* Filesystem structure that support groups */
 typedef struct
 {
-	FILE *f;
+	io_backend *io;
+	struct writeback *wb;	// asynchronous writes to io, if any
 	superblock *sb;
 	int swapit;
 	int32 hdlink_cnt;
@@ -664,6 +730,34 @@ typedef struct
 
 	int holes;
 
+	// Blocks written since the image was created, one bitmap per
+	// BLOCKSIZE * 8 blocks, allocated on first write.  Only kept
+	// for freshly created images, where every other block is zero.
+	uint8 **written;
+	uint32 nwritten;
+	// the cached blocks have been written already (see write_blks)
+	int blks_clean;
+	// source of the file data being added, for a planned image:
+	// data_buf holds the source's contents from offset data_off
+	int data_src;
+	off_t data_off;
+	uint8 *data_buf;
+	// what the free blocks hold once filled (see fill_free_blks), or
+	// -1 if they may have stale data
+	int free_fill;
+	// placement of a previous image to follow, if any (see layout_open)
+	struct layout *layout;
+	// allocate the blocks and inodes one after the other, from the
+	// first free ones after next_blk and next_nod (see add2fs_order)
+	int sequential;
+	uint32 next_blk;
+	uint32 next_nod;
+	// the blocks of this inode go one after the other from next_blk
+	// (see align_file)
+	uint32 align_nod;
+	// the inode the last block was allocated for
+	uint32 last_nod;
+
 	listcache blks;
 	listcache gds;
 	listcache inodes;
@@ -816,2279 +910,7628 @@ xstrdup(const char *s)
 	return t;
 }
 
-int
-is_hardlink(filesystem *fs, ino_t inode)
+// image I/O backend used by io_open, one of IO_FILE, IO_DIRECT, IO_COUNT
+static int io_type = IO_FILE;
+
+static ssize_t
+file_read_at(io_backend *io, void *buf, size_t len, off_t off)
 {
-	int i;
+	return pread(io->fd, buf, len, off);
+}
 
-	for(i = 0; i < fs->hdlinks.count; i++) {
-		if(fs->hdlinks.hdl[i].src_inode == inode)
-			return i;
+static ssize_t
+file_write_at(io_backend *io, const void *buf, size_t len, off_t off)
+{
+	return pwrite(io->fd, buf, len, off);
+}
+
+static ssize_t
+file_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
+{
+#if HAVE_PWRITEV
+	return pwritev(io->fd, iov, iovcnt, off);
+#else
+	ssize_t r, done = 0;
+
+	// one write each, up to the first short one
+	for (; iovcnt; iov++, iovcnt--) {
+		r = pwrite(io->fd, iov->iov_base, iov->iov_len, off + done);
+		if (r < 0)
+			return done ? done : r;
+		done += r;
+		if ((size_t) r < iov->iov_len)
+			break;
 	}
-	return -1;
+	return done;
+#endif
 }
 
-// printf helper macro
-#define plural(a) (a), ((a) == 1) ? "" : "s"
+static int
+file_truncate(io_backend *io, off_t len)
+{
+	return ftruncate(io->fd, len);
+}
 
-// temporary working block
-static inline uint8 *
-get_workblk(void)
+// deallocate a range without changing the file size; it reads as zeros
+static int
+file_punch(io_backend *io, off_t off, off_t len)
 {
-	unsigned char* b=calloc(1,BLOCKSIZE);
-	if (!b)
-		error_msg_and_die("get_workblk() failed, out of memory");
-	return b;
+#if HAVE_FALLOCATE && defined(FALLOC_FL_PUNCH_HOLE)
+	return fallocate(io->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			 off, len);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
 }
-static inline void
-free_workblk(block b)
+
+static void
+file_close(io_backend *io)
 {
-	free(b);
+	if (close(io->fd))
+		perror_msg_and_die("close image");
+	free(io);
 }
 
-/* Rounds qty upto a multiple of siz. siz should be a power of 2 */
-static inline uint32
-rndup(uint32 qty, uint32 siz)
+// Wrap an open file descriptor, which is closed along with the backend.
+static io_backend *
+io_open_fd(int fd)
 {
-	return (qty + (siz - 1)) & ~(siz - 1);
+	io_backend *io = calloc(1, sizeof(*io));
+
+	if (!io)
+		error_msg_and_die(memory_exhausted);
+	io->read_at = file_read_at;
+	io->write_at = file_write_at;
+	io->writev_at = file_writev_at;
+	io->truncate = file_truncate;
+	io->punch = file_punch;
+	io->close = file_close;
+	io->fd = fd;
+	return io;
 }
 
-// check if something is allocated in the bitmap
-static inline uint32
-allocated(block b, uint32 item)
+static ssize_t
+stream_read_at(io_backend *io, void *buf, size_t len, off_t off)
 {
-	return b[(item-1) / 8] & (1 << ((item-1) % 8));
+	ssize_t r;
+
+	if (off != io->pos)
+		error_msg_and_die("Internal error: out of order stream read");
+	if ((r = read(io->fd, buf, len)) > 0)
+		io->pos += r;
+	return r;
 }
 
-// Used by get_blk/put_blk to hold information about a block owned
-// by the user.
-typedef struct
+static ssize_t
+stream_write_at(io_backend *io, const void *buf, size_t len, off_t off)
 {
-	cache_link link;
+	static const uint8 zeros[4096];
+	ssize_t r;
+
+	if (off < io->pos)
+		error_msg_and_die("Internal error: out of order stream write");
+	// skipped ranges (holes) are written out as zeros
+	while (off > io->pos) {
+		r = write(io->fd, zeros, (off - io->pos > (off_t) sizeof(zeros))
+				? sizeof(zeros) : off - io->pos);
+		if (r < 0)
+			return r;
+		io->pos += r;
+	}
+	if ((r = write(io->fd, buf, len)) > 0)
+		io->pos += r;
+	return r;
+}
 
-	filesystem *fs;
-	uint32 blk;
-	uint8 *b;
-	uint32 usecount;
-} blk_info;
+static ssize_t
+stream_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return stream_write_at(io, iov->iov_base, iov->iov_len, off);
+}
 
-#define MAX_FREE_CACHE_BLOCKS 100
+static int
+stream_truncate(io_backend *io, off_t len)
+{
+	errno = ESPIPE;
+	return -1;
+}
 
-static uint32
-blk_elem_val(cache_link *elem)
+static int
+stream_punch(io_backend *io, off_t off, off_t len)
 {
-	blk_info *bi = container_of(elem, blk_info, link);
-	return bi->blk;
+	errno = ESPIPE;
+	return -1;
 }
 
 static void
-blk_freed(cache_link *elem)
+stream_close(io_backend *io)
 {
-	blk_info *bi = container_of(elem, blk_info, link);
-
-	if (fseeko(bi->fs->f, ((off_t) bi->blk) * BLOCKSIZE, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (fwrite(bi->b, BLOCKSIZE, 1, bi->fs->f) != 1)
-		perror_msg_and_die("get_blk: write");
-	free(bi->b);
-	free(bi);
+	free(io);
 }
 
-// Return a given block from a filesystem.  Make sure to call
-// put_blk when you are done with it.
-static inline uint8 *
-get_blk(filesystem *fs, uint32 blk, blk_info **rbi)
+// Wrap stdin/stdout or a pipe.  Reads and writes must come in order,
+// and the descriptor is left open when the backend is closed.
+static io_backend *
+io_open_stream(int fd)
 {
-	cache_link *curr;
-	blk_info *bi;
+	io_backend *io = io_open_fd(fd);
+
+	io->read_at = stream_read_at;
+	io->write_at = stream_write_at;
+	io->writev_at = stream_writev_at;
+	io->truncate = stream_truncate;
+	io->punch = stream_punch;
+	io->close = stream_close;
+	io->stream = 1;
+	return io;
+}
 
-	if (blk >= fs->sb->s_blocks_count)
-		error_msg_and_die("Internal error, block out of range");
+#ifdef O_DIRECT
+#define DIRECT_ALIGN	4096
+#define DIRECT_BUFSIZE	(1024 * 1024)
 
-	curr = cache_find(&fs->blks, blk);
-	if (curr) {
-		bi = container_of(curr, blk_info, link);
-		bi->usecount++;
-		goto out;
-	}
+// O_DIRECT needs aligned buffers, offsets and sizes, so everything goes
+// through an aligned bounce buffer; partial blocks at either end of a
+// write are read in first.
+typedef struct
+{
+	io_backend io;
+	uint8 *buf;
+	off_t size;	// size set by truncate, writes may round past it
+} io_direct;
 
-	bi = malloc(sizeof(*bi));
-	if (!bi)
-		error_msg_and_die("get_blk: out of memory");
-	bi->fs = fs;
-	bi->blk = blk;
-	bi->usecount = 1;
-	bi->b = malloc(BLOCKSIZE);
-	if (!bi->b)
-		error_msg_and_die("get_blk: out of memory");
-	cache_add(&fs->blks, &bi->link);
-	if (fseeko(fs->f, ((off_t) blk) * BLOCKSIZE, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (fread(bi->b, BLOCKSIZE, 1, fs->f) != 1) {
-		if (ferror(fs->f))
-			perror_msg_and_die("fread");
-		memset(bi->b, 0, BLOCKSIZE);
+static ssize_t
+direct_fill(io_backend *io, uint8 *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = pread(io->fd, buf + done, len - done, off + done);
+		if (r < 0)
+			return r;
+		if (r == 0) {
+			memset(buf + done, 0, len - done);
+			break;
+		}
+		done += r;
 	}
-
-out:
-	*rbi = bi;
-	return bi->b;
+	return done;
 }
 
-static inline void
-put_blk(blk_info *bi)
+static ssize_t
+direct_read_at(io_backend *io, void *buf, size_t len, off_t off)
 {
-	if (bi->usecount == 0)
-		error_msg_and_die("Internal error: put_blk usecount zero");
-	bi->usecount--;
-	if (bi->usecount == 0)
-		/* Free happens in the cache code */
-		cache_item_set_unused(&bi->fs->blks, &bi->link);
+	io_direct *d = container_of(io, io_direct, io);
+	off_t start = off & ~((off_t) DIRECT_ALIGN - 1);
+	size_t head = off - start;
+	size_t span;
+	ssize_t r;
+
+	if (len > DIRECT_BUFSIZE - head)
+		len = DIRECT_BUFSIZE - head;
+	if (off >= d->size)
+		return 0;
+	if (off + (off_t) len > d->size)
+		len = d->size - off;
+	span = (head + len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+	if ((r = direct_fill(io, d->buf, span, start)) < 0)
+		return r;
+	memcpy(buf, d->buf + head, len);
+	return len;
 }
 
-typedef struct
+// as many of the iovecs as fit in the bounce buffer go in a single write
+static ssize_t
+direct_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
 {
-	cache_link link;
+	io_direct *d = container_of(io, io_direct, io);
+	off_t start = off & ~((off_t) DIRECT_ALIGN - 1);
+	size_t head = off - start;
+	size_t span, done, len = 0, n;
+	ssize_t r;
+	int i;
 
-	filesystem *fs;
-	int gds;
-	blk_info *bi;
-	groupdescriptor *gd;
-	uint32 usecount;
-} gd_info;
+	for (i = 0; i < iovcnt && len < DIRECT_BUFSIZE - head; i++)
+		len += iov[i].iov_len;
+	if (len > DIRECT_BUFSIZE - head)
+		len = DIRECT_BUFSIZE - head;
+	span = (head + len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+	if (head && direct_fill(io, d->buf, DIRECT_ALIGN, start) < 0)
+		return -1;
+	if ((head + len) % DIRECT_ALIGN && (span > DIRECT_ALIGN || !head) &&
+	    direct_fill(io, d->buf + span - DIRECT_ALIGN, DIRECT_ALIGN,
+			start + span - DIRECT_ALIGN) < 0)
+		return -1;
+	for (i = 0, done = 0; done < len; i++, done += n) {
+		n = iov[i].iov_len;
+		if (n > len - done)
+			n = len - done;
+		memcpy(d->buf + head + done, iov[i].iov_base, n);
+	}
+	for (done = 0; done < span; done += r)
+		if ((r = pwrite(io->fd, d->buf + done, span - done, start + done)) <= 0)
+			return -1;
+	if (off + (off_t) len > d->size)
+		d->size = off + len;
+	return len;
+}
 
-#define MAX_FREE_CACHE_GDS 100
+static ssize_t
+direct_write_at(io_backend *io, const void *buf, size_t len, off_t off)
+{
+	struct iovec iov;
 
-static uint32
-gd_elem_val(cache_link *elem)
+	iov.iov_base = (void *) buf;
+	iov.iov_len = len;
+	return direct_writev_at(io, &iov, 1, off);
+}
+
+static int
+direct_truncate(io_backend *io, off_t len)
 {
-	gd_info *gi = container_of(elem, gd_info, link);
-	return gi->gds;
+	io_direct *d = container_of(io, io_direct, io);
+
+	d->size = len;
+	return ftruncate(io->fd, len);
 }
 
 static void
-gd_freed(cache_link *elem)
+direct_close(io_backend *io)
 {
-	gd_info *gi = container_of(elem, gd_info, link);
+	io_direct *d = container_of(io, io_direct, io);
 
-	if (gi->fs->swapit)
-		swap_gd(gi->gd);
-	put_blk(gi->bi);
-	free(gi);
+	// the last write may have been rounded up past the end
+	if (ftruncate(io->fd, d->size))
+		perror_msg_and_die("close image: ftruncate");
+	free(d->buf);
+	file_close(io);
 }
 
-#define GDS_START ((SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE + BLOCKSIZE - 1) / BLOCKSIZE)
-#define GDS_PER_BLOCK (BLOCKSIZE / sizeof(groupdescriptor))
-// the group descriptors are aligned on the block size
-static inline groupdescriptor *
-get_gd(filesystem *fs, uint32 no, gd_info **rgi)
+static io_backend *
+io_open_direct(const char *fname, int flags)
 {
-	uint32 gdblk;
-	uint32 offset;
-	gd_info *gi;
-	cache_link *curr;
+	io_direct *d;
+	struct stat st;
+	int fd;
 
-	curr = cache_find(&fs->gds, no);
-	if (curr) {
-		gi = container_of(curr, gd_info, link);
-		gi->usecount++;
-		goto out;
-	}
+	if ((fd = open(fname, flags | O_DIRECT, 0666)) < 0)
+		return NULL;
+	if (!(d = calloc(1, sizeof(*d))))
+		error_msg_and_die(memory_exhausted);
+	if (posix_memalign((void **) &d->buf, DIRECT_ALIGN, DIRECT_BUFSIZE))
+		error_msg_and_die(memory_exhausted);
+	d->io.read_at = direct_read_at;
+	d->io.write_at = direct_write_at;
+	d->io.writev_at = direct_writev_at;
+	d->io.truncate = direct_truncate;
+	d->io.punch = file_punch;
+	d->io.close = direct_close;
+	d->io.fd = fd;
+	if (!fstat(fd, &st))
+		d->size = st.st_size;
+	return &d->io;
+}
+#endif /* O_DIRECT */
 
-	gi = malloc(sizeof(*gi));
-	if (!gi)
-		error_msg_and_die("get_gd: out of memory");
-	gi->fs = fs;
-	gi->gds = no;
-	gi->usecount = 1;
-	gdblk = GDS_START + (no / GDS_PER_BLOCK);
-	offset = no % GDS_PER_BLOCK;
-	gi->gd = ((groupdescriptor *) get_blk(fs, gdblk, &gi->bi)) + offset;
-	cache_add(&fs->gds, &gi->link);
-	if (fs->swapit)
-		swap_gd(gi->gd);
- out:
-	*rgi = gi;
+// Counts the calls made to the backend below, for testing.
+typedef struct
+{
+	io_backend io;
+	io_backend *lower;
+	unsigned long long reads, rbytes, writes, wbytes;
+} io_count;
 
-	return gi->gd;
+static ssize_t
+count_read_at(io_backend *io, void *buf, size_t len, off_t off)
+{
+	io_count *c = container_of(io, io_count, io);
+	ssize_t r = c->lower->read_at(c->lower, buf, len, off);
+
+	c->reads++;
+	if (r > 0)
+		c->rbytes += r;
+	return r;
 }
 
-static inline void
-put_gd(gd_info *gi)
+static ssize_t
+count_write_at(io_backend *io, const void *buf, size_t len, off_t off)
 {
-	if (gi->usecount == 0)
-		error_msg_and_die("Internal error: put_gd usecount zero");
+	io_count *c = container_of(io, io_count, io);
+	ssize_t r = c->lower->write_at(c->lower, buf, len, off);
 
-	gi->usecount--;
-	if (gi->usecount == 0)
-		/* Free happens in the cache code */
-		cache_item_set_unused(&gi->fs->gds, &gi->link);
+	c->writes++;
+	if (r > 0)
+		c->wbytes += r;
+	return r;
 }
 
-// Used by get_blkmap/put_blkmap to hold information about an block map
-// owned by the user.
-typedef struct
+static ssize_t
+count_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
 {
-	cache_link link;
+	io_count *c = container_of(io, io_count, io);
+	ssize_t r = c->lower->writev_at(c->lower, iov, iovcnt, off);
 
-	filesystem *fs;
-	uint32 blk;
-	uint8 *b;
-	blk_info *bi;
-	uint32 usecount;
-} blkmap_info;
+	c->writes++;
+	if (r > 0)
+		c->wbytes += r;
+	return r;
+}
 
-#define MAX_FREE_CACHE_BLOCKMAPS 100
+static int
+count_truncate(io_backend *io, off_t len)
+{
+	io_count *c = container_of(io, io_count, io);
+	return c->lower->truncate(c->lower, len);
+}
 
-static uint32
-blkmap_elem_val(cache_link *elem)
+static int
+count_punch(io_backend *io, off_t off, off_t len)
 {
-	blkmap_info *bmi = container_of(elem, blkmap_info, link);
-	return bmi->blk;
+	io_count *c = container_of(io, io_count, io);
+	return c->lower->punch(c->lower, off, len);
 }
 
 static void
-blkmap_freed(cache_link *elem)
+count_close(io_backend *io)
 {
-	blkmap_info *bmi = container_of(elem, blkmap_info, link);
+	io_count *c = container_of(io, io_count, io);
 
-	if (bmi->fs->swapit)
-		swap_block(bmi->b);
-	put_blk(bmi->bi);
-	free(bmi);
+	fprintf(stderr, "image I/O: %llu reads (%llu bytes), "
+		"%llu writes (%llu bytes)\n",
+		c->reads, c->rbytes, c->writes, c->wbytes);
+	c->lower->close(c->lower);
+	free(c);
 }
 
-// Return a given block map from a filesystem.  Make sure to call
-// put_blkmap when you are done with it.
-static inline uint32 *
-get_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi)
+static io_backend *
+io_open_count(io_backend *lower)
 {
-	blkmap_info *bmi;
-	cache_link *curr;
+	io_count *c = calloc(1, sizeof(*c));
 
-	curr = cache_find(&fs->blkmaps, blk);
-	if (curr) {
-		bmi = container_of(curr, blkmap_info, link);
-		bmi->usecount++;
-		goto out;
+	if (!c)
+		error_msg_and_die(memory_exhausted);
+	c->io = *lower;
+	c->io.read_at = count_read_at;
+	c->io.write_at = count_write_at;
+	c->io.writev_at = count_writev_at;
+	c->io.truncate = count_truncate;
+	c->io.punch = count_punch;
+	c->io.close = count_close;
+	c->lower = lower;
+	return &c->io;
+}
+
+// Open the image with the backend selected by io_type.  A NULL
+// fname opens an anonymous temporary file.
+static io_backend *
+io_open(const char *fname, int flags)
+{
+	io_backend *io = NULL;
+	FILE *tmp;
+	int fd;
+
+#ifdef O_DIRECT
+	if (io_type == IO_DIRECT && fname) {
+		io = io_open_direct(fname, flags);
+		// not every filesystem supports O_DIRECT
+		if (!io && errno != EINVAL)
+			perror_msg_and_die("opening %s", fname);
+		if (!io)
+			error_msg("%s: O_DIRECT not supported, using buffered I/O", fname);
+	}
+#endif
+	if (!io) {
+		if (fname)
+			fd = open(fname, flags, 0666);
+		else if ((tmp = tmpfile())) {
+			fd = dup(fileno(tmp));
+			fclose(tmp);
+		} else
+			fd = -1;
+		if (fd < 0)
+			perror_msg_and_die("opening %s", fname ? fname : "temporary file");
+		io = io_open_fd(fd);
 	}
+	if (io_type == IO_COUNT)
+		io = io_open_count(io);
+	return io;
+}
 
-	bmi = malloc(sizeof(*bmi));
-	if (!bmi)
-		error_msg_and_die("get_blkmap: out of memory");
-	bmi->fs = fs;
-	bmi->blk = blk;
-	bmi->b = get_blk(fs, blk, &bmi->bi);
-	bmi->usecount = 1;
-	cache_add(&fs->blkmaps, &bmi->link);
+// Read up to len bytes at off, returning how many bytes were there.
+// Anything past the end of the image reads as zeros.
+static size_t
+io_read(io_backend *io, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	ssize_t r;
 
-	if (fs->swapit)
-		swap_block(bmi->b);
- out:
-	*rbmi = bmi;
-	return (uint32 *) bmi->b;
+	while (done < len) {
+		r = io->read_at(io, (uint8 *) buf + done, len - done, off + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			perror_msg_and_die("read image");
+		if (r == 0) {
+			memset((uint8 *) buf + done, 0, len - done);
+			break;
+		}
+		done += r;
+	}
+	return done;
 }
 
-static inline void
-put_blkmap(blkmap_info *bmi)
+static void
+io_write(io_backend *io, const void *buf, size_t len, off_t off)
 {
-	if (bmi->usecount == 0)
-		error_msg_and_die("Internal error: put_blkmap usecount zero");
+	ssize_t r;
 
-	bmi->usecount--;
-	if (bmi->usecount == 0)
-		/* Free happens in the cache code */
-		cache_item_set_unused(&bmi->fs->blkmaps, &bmi->link);
+	while (len) {
+		r = io->write_at(io, buf, len, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			perror_msg_and_die("write image");
+		buf = (const uint8 *) buf + r;
+		len -= r;
+		off += r;
+	}
 }
 
-// Used by get_nod/put_nod to hold information about an inode owned
-// by the user.
-typedef struct
+// Write a scatter list, which io_writev modifies, at off.
+static void
+io_writev(io_backend *io, struct iovec *iov, int iovcnt, off_t off)
 {
-	cache_link link;
+	ssize_t r;
 
-	filesystem *fs;
-	uint32 nod;
-	uint8 *b;
-	blk_info *bi;
-	inode *itab;
-	uint32 usecount;
-} nod_info;
+	while (iovcnt) {
+		r = io->writev_at(io, iov, iovcnt, off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			perror_msg_and_die("write image");
+		off += r;
+		while (iovcnt && (size_t) r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8 *) iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
 
-#define MAX_FREE_CACHE_INODES 100
+/* Planned image for --streaming.  Nothing is written while the
+   filesystem is built: metadata blocks are kept in memory, and the
+   blocks of regular files are recorded as references to their source
+   file.  When everything is in place the image is emitted in block
+   order, with the file data read straight from the sources, so no
+   temporary copy of the image is needed. */
 
-static uint32
-inode_elem_val(cache_link *elem)
+#define PLAN_CHUNK	1024	// blocks per second level map
+#define PLAN_BUFSIZE	(1024 * 1024)
+
+// a run of blocks whose data is in a source file
+typedef struct
 {
-	nod_info *ni = container_of(elem, nod_info, link);
-	return ni->nod;
-}
+	uint32 blk;
+	uint32 count;
+	uint32 src;	// index in io_plan.srcs
+	off_t off;	// offset of the first block in the source
+} plan_ext;
 
-static void
-inode_freed(cache_link *elem)
+typedef struct
 {
-	nod_info *ni = container_of(elem, nod_info, link);
+	io_backend io;
+	uint8 ***map;	// per block: its data, NULL for zeros, or PLAN_REF
+	uint32 nchunks;
+	off_t size;
+	uint8 *uniform[256];	// shared blocks with all bytes the same
+	plan_ext *ext;
+	uint32 next, maxext;
+	int sorted;
+	char **srcs;	// source file paths
+	uint32 nsrcs;
+	int srcfd;	// open source file
+	uint32 srcfd_idx;
+} io_plan;
 
-	if (ni->fs->swapit)
-		swap_nod(ni->itab);
-	put_blk(ni->bi);
-	free(ni);
-}
+// marks a block whose data is in a source file
+static uint8 plan_ref_mark;
+#define PLAN_REF	(&plan_ref_mark)
 
-#define INODES_PER_BLOCK (BLOCKSIZE / sizeof(inode))
+static ssize_t plan_read_at(io_backend *io, void *buf, size_t len, off_t off);
 
-// Return a given inode from a filesystem.  Make sure to call
-// put_nod when you are done with it.
-static inline inode *
-get_nod(filesystem *fs, uint32 nod, nod_info **rni)
-{
-	uint32 grp, boffset, offset;
-	cache_link *curr;
-	groupdescriptor *gd;
-	gd_info *gi;
-	nod_info *ni;
+// build a planned image (--streaming)
+static int streaming;
 
-	curr = cache_find(&fs->inodes, nod);
-	if (curr) {
-		ni = container_of(curr, nod_info, link);
-		ni->usecount++;
-		goto out;
-	}
+#define FMT_RAW		0	// the image as it is
+#define FMT_SIMG	1	// Android sparse image
 
-	ni = malloc(sizeof(*ni));
-	if (!ni)
-		error_msg_and_die("get_nod: out of memory");
-	ni->fs = fs;
-	ni->nod = nod;
-	ni->usecount = 1;
-	cache_add(&fs->inodes, &ni->link);
+// format of the output, set by --output-format
+static int output_format = FMT_RAW;
 
-	offset = GRP_IBM_OFFSET(fs,nod) - 1;
-	boffset = offset / INODES_PER_BLOCK;
-	offset %= INODES_PER_BLOCK;
-	grp = GRP_GROUP_OF_INODE(fs,nod);
-	gd = get_gd(fs, grp, &gi);
-	ni->b = get_blk(fs, gd->bg_inode_table + boffset, &ni->bi);
-	ni->itab = ((inode *) ni->b) + offset;
-	if (fs->swapit)
-		swap_nod(ni->itab);
-	put_gd(gi);
- out:
-	*rni = ni;
-	return ni->itab;
-}
+static int compress_method;
 
-static inline void
-put_nod(nod_info *ni)
-{
-	if (ni->usecount == 0)
-		error_msg_and_die("Internal error: put_nod usecount zero");
+// the output is produced from the image at the end, not built in place
+#define OUTPUT_SEPARATE	(output_format != FMT_RAW || compress_method)
 
-	ni->usecount--;
-	if (ni->usecount == 0)
-		/* Free happens in the cache code */
-		cache_item_set_unused(&ni->fs->inodes, &ni->link);
+static inline int
+io_is_plan(io_backend *io)
+{
+	return io->read_at == plan_read_at;
 }
 
-// Used to hold state information while walking a directory inode.
-typedef struct
+static uint8 **
+plan_slot(io_plan *o, uint32 blk, int alloc)
 {
-	directory d;
-	filesystem *fs;
-	uint32 nod;
-	uint8 *last_d;
-	uint8 *b;
-	blk_info *bi;
-	int need_flush;
-} dirwalker;
+	uint32 c = blk / PLAN_CHUNK;
+
+	if (c >= o->nchunks) {
+		if (!alloc)
+			return NULL;
+		o->map = realloc(o->map, (c + 1) * sizeof(*o->map));
+		if (!o->map)
+			error_msg_and_die("plan: out of memory");
+		memset(o->map + o->nchunks, 0,
+		       (c + 1 - o->nchunks) * sizeof(*o->map));
+		o->nchunks = c + 1;
+	}
+	if (!o->map[c]) {
+		if (!alloc)
+			return NULL;
+		if (!(o->map[c] = calloc(PLAN_CHUNK, sizeof(**o->map))))
+			error_msg_and_die("plan: out of memory");
+	}
+	return &o->map[c][blk % PLAN_CHUNK];
+}
 
-// Start a directory walk on the given inode.  You must pass in a
-// dirwalker structure, then use that dirwalker for future operations.
-// Call put_dir when you are done walking the directory.
-// After put_dir, do not use the old pointer returned by get_dir or next_dir.
-static inline directory *
-get_dir(filesystem *fs, uint32 nod, dirwalker *dw)
+// drop what a slot holds, if it owns it
+static void
+plan_release(io_plan *o, uint8 **slot)
 {
-	dw->fs = fs;
-	dw->b = get_blk(fs, nod, &dw->bi);
-	dw->nod = nod;
-	dw->last_d = dw->b;
-	dw->need_flush = 1;
+	uint8 *p = *slot;
 
-	memcpy(&dw->d, dw->last_d, sizeof(directory));
-	if (fs->swapit)
-		swap_dir(&dw->d);
-	return &dw->d;
+	if (p && p != PLAN_REF && p != o->uniform[p[0]])
+		free(p);
+	*slot = NULL;
 }
 
-// Move to the next directory.
-static inline directory *
-next_dir(dirwalker *dw)
+static int
+plan_ext_cmp(const void *a, const void *b)
 {
-	uint8 *next_d = dw->last_d + dw->d.d_rec_len;
+	uint32 ba = ((const plan_ext *) a)->blk, bb = ((const plan_ext *) b)->blk;
+	return (ba > bb) - (ba < bb);
+}
 
-	if (dw->need_flush) {
-		if (dw->fs->swapit)
-			swap_dir(&dw->d);
-		memcpy(dw->last_d, &dw->d, sizeof(directory));
-	}
+static plan_ext *
+plan_find_ext(io_plan *o, uint32 blk)
+{
+	uint32 lo = 0, hi, mid;
 
-	if (next_d - dw->b >= BLOCKSIZE) {
-		// no more directories in block b
-		dw->need_flush = 0;
-		return NULL;
+	if (!o->sorted) {
+		qsort(o->ext, o->next, sizeof(*o->ext), plan_ext_cmp);
+		o->sorted = 1;
 	}
-
-	dw->last_d = next_d;
-	memcpy(&dw->d, next_d, sizeof(directory));
-	if (dw->fs->swapit)
-		swap_dir(&dw->d);
-	return &dw->d;
+	// last extent starting at or before blk
+	for (hi = o->next; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (o->ext[mid].blk <= blk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || blk >= o->ext[lo - 1].blk + o->ext[lo - 1].count)
+		error_msg_and_die("Internal error: planned block %u has no source", blk);
+	return &o->ext[lo - 1];
 }
 
-// Call then when you are done with the directory walk.
-static inline void
-put_dir(dirwalker *dw)
+// read count blocks of an extent, starting at blk
+static void
+plan_read_ext(io_plan *o, plan_ext *e, uint32 blk, uint32 count, uint8 *buf)
 {
-	if (dw->need_flush) {
-		// walk ended before reaching the end of block b
-		if (dw->fs->swapit)
-			swap_dir(&dw->d);
-		memcpy(dw->last_d, &dw->d, sizeof(directory));
+	size_t len = (size_t) count * BLOCKSIZE, done = 0;
+	off_t off = e->off + ((off_t) blk - e->blk) * BLOCKSIZE;
+	ssize_t r;
+
+	if (o->srcfd < 0 || o->srcfd_idx != e->src) {
+		if (o->srcfd >= 0)
+			close(o->srcfd);
+		if ((o->srcfd = open(o->srcs[e->src], O_RDONLY)) < 0)
+			perror_msg_and_die("%s", o->srcs[e->src]);
+		o->srcfd_idx = e->src;
+	}
+	while (done < len) {
+		r = pread(o->srcfd, buf + done, len - done, off + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			perror_msg_and_die("%s", o->srcs[e->src]);
+		if (!r)
+			break;
+		done += r;
 	}
+	// the tail of the last block, or a file that shrank
+	memset(buf + done, 0, len - done);
+}
 
-	if (dw->nod == 0)
-		free_workblk(dw->b);
+static void
+plan_read_blk(io_plan *o, uint32 blk, uint8 *buf)
+{
+	uint8 **slot = plan_slot(o, blk, 0);
+
+	if (!slot || !*slot)
+		memset(buf, 0, BLOCKSIZE);
+	else if (*slot == PLAN_REF)
+		plan_read_ext(o, plan_find_ext(o, blk), blk, 1, buf);
 	else
-		put_blk(dw->bi);
+		memcpy(buf, *slot, BLOCKSIZE);
 }
 
-// Create a new directory block with the given inode as it's destination
-// and append it to the current dirwalker.
-static directory *
-new_dir(filesystem *fs, uint32 dnod, const char *name, int nlen, dirwalker *dw)
+static ssize_t
+plan_read_at(io_backend *io, void *buf, size_t len, off_t off)
 {
-	directory *d;
+	io_plan *o = container_of(io, io_plan, io);
+	uint8 *b, *out = buf;
+	size_t done = 0, n;
+	uint32 blk;
 
-	dw->fs = fs;
-	dw->b = get_workblk();
-	dw->nod = 0;
-	dw->last_d = dw->b;
-	dw->need_flush = 1;
-	d = &dw->d;
-	d->d_inode = dnod;
-	d->d_rec_len = BLOCKSIZE;
-	d->d_name_len = nlen;
-	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
-	return d;
+	if (off >= o->size)
+		return 0;
+	if ((off_t) len > o->size - off)
+		len = o->size - off;
+	if (!(b = malloc(BLOCKSIZE)))
+		error_msg_and_die("plan: out of memory");
+	while (done < len) {
+		blk = (off + done) / BLOCKSIZE;
+		n = BLOCKSIZE - (off + done) % BLOCKSIZE;
+		if (n > len - done)
+			n = len - done;
+		plan_read_blk(o, blk, b);
+		memcpy(out + done, b + (off + done) % BLOCKSIZE, n);
+		done += n;
+	}
+	free(b);
+	return done;
 }
 
-// Shrink the current directory entry, make a new one with the free
-// space, and return the new directory entry (making it current).
-static inline directory *
-shrink_dir(dirwalker *dw, uint32 nod, const char *name, int nlen)
+// store a whole block; blocks of a single repeated byte are shared
+static void
+plan_store(io_plan *o, uint32 blk, const uint8 *b)
 {
-	int reclen, preclen;
-	directory *d = &dw->d;
+	uint8 **slot = plan_slot(o, blk, 1);
+	uint32 i;
 
-	reclen = d->d_rec_len;
-	d->d_rec_len = sizeof(directory) + rndup(d->d_name_len, 4);
-	preclen = d->d_rec_len;
-	reclen -= preclen;
-	if (dw->fs->swapit)
-		swap_dir(&dw->d);
-	memcpy(dw->last_d, &dw->d, sizeof(directory));
+	for (i = 1; i < BLOCKSIZE && b[i] == b[0]; i++)
+		;
+	if (i == BLOCKSIZE) {
+		plan_release(o, slot);
+		if (b[0] && !o->uniform[b[0]]) {
+			if (!(o->uniform[b[0]] = malloc(BLOCKSIZE)))
+				error_msg_and_die("plan: out of memory");
+			memset(o->uniform[b[0]], b[0], BLOCKSIZE);
+		}
+		*slot = o->uniform[b[0]];
+		return;
+	}
+	if (!*slot || *slot == PLAN_REF || *slot == o->uniform[(*slot)[0]]) {
+		*slot = NULL;
+		if (!(*slot = malloc(BLOCKSIZE)))
+			error_msg_and_die("plan: out of memory");
+	}
+	memcpy(*slot, b, BLOCKSIZE);
+}
 
-	dw->last_d = dw->last_d + preclen;
-	d->d_rec_len = reclen;
-	d->d_inode = nod;
-	d->d_name_len = nlen;
-	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+static ssize_t
+plan_write_at(io_backend *io, const void *buf, size_t len, off_t off)
+{
+	io_plan *o = container_of(io, io_plan, io);
+	const uint8 *in = buf;
+	size_t done = 0, n;
+	uint32 blk;
+	uint8 *b = NULL;
+
+	while (done < len) {
+		blk = (off + done) / BLOCKSIZE;
+		n = BLOCKSIZE - (off + done) % BLOCKSIZE;
+		if (n > len - done)
+			n = len - done;
+		if (n == BLOCKSIZE)
+			plan_store(o, blk, in + done);
+		else {
+			if (!b && !(b = malloc(BLOCKSIZE)))
+				error_msg_and_die("plan: out of memory");
+			plan_read_blk(o, blk, b);
+			memcpy(b + (off + done) % BLOCKSIZE, in + done, n);
+			plan_store(o, blk, b);
+		}
+		done += n;
+	}
+	free(b);
+	if (off + (off_t) len > o->size)
+		o->size = off + len;
+	return len;
+}
 
-	return d;
+static ssize_t
+plan_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return plan_write_at(io, iov->iov_base, iov->iov_len, off);
 }
 
-// Return the current block the directory is walking
-static inline uint8 *
-dir_data(dirwalker *dw)
+static int
+plan_truncate(io_backend *io, off_t len)
 {
-	return dw->b;
+	io_plan *o = container_of(io, io_plan, io);
+	uint32 blk, end = (o->size + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint8 **slot;
+
+	for (blk = (len + BLOCKSIZE - 1) / BLOCKSIZE; blk < end; blk++)
+		if ((slot = plan_slot(o, blk, 0)))
+			plan_release(o, slot);
+	if (len % BLOCKSIZE && len < o->size) {
+		uint8 *b = malloc(BLOCKSIZE);
+		if (!b)
+			error_msg_and_die("plan: out of memory");
+		plan_read_blk(o, len / BLOCKSIZE, b);
+		memset(b + len % BLOCKSIZE, 0, BLOCKSIZE - len % BLOCKSIZE);
+		plan_store(o, len / BLOCKSIZE, b);
+		free(b);
+	}
+	o->size = len;
+	return 0;
 }
 
-// Return the pointer to the name for the current directory
-static inline char *
-dir_name(dirwalker *dw)
+static int
+plan_punch(io_backend *io, off_t off, off_t len)
 {
-	return ((char *) dw->last_d) + sizeof(directory);
+	io_plan *o = container_of(io, io_plan, io);
+	uint32 blk = (off + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint32 end = (off + len) / BLOCKSIZE;
+	uint8 **slot;
+
+	// partial blocks don't occur: holes are punched for whole blocks
+	for (; blk < end; blk++)
+		if ((slot = plan_slot(o, blk, 0)))
+			plan_release(o, slot);
+	return 0;
 }
 
-// Set the name for the current directory.  Note that this doesn't
-// verify that there is space for the directory name, you must do
-// that yourself.
 static void
-dir_set_name(dirwalker *dw, const char *name, int nlen)
+plan_close(io_backend *io)
 {
-	dw->d.d_name_len = nlen;
-	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+	io_plan *o = container_of(io, io_plan, io);
+	uint32 i, j;
+
+	for (i = 0; i < o->nchunks; i++) {
+		if (!o->map[i])
+			continue;
+		for (j = 0; j < PLAN_CHUNK; j++)
+			plan_release(o, &o->map[i][j]);
+		free(o->map[i]);
+	}
+	free(o->map);
+	for (i = 0; i < 256; i++)
+		free(o->uniform[i]);
+	for (i = 0; i < o->nsrcs; i++)
+		free(o->srcs[i]);
+	free(o->srcs);
+	free(o->ext);
+	if (o->srcfd >= 0)
+		close(o->srcfd);
+	free(o);
 }
 
-// allocate a given block/inode in the bitmap
-// allocate first free if item == 0
-static uint32
-allocate(block b, uint32 item)
+static io_backend *
+io_open_plan(void)
 {
-	if(!item)
-	{
-		int i;
-		uint8 bits;
-		for(i = 0; i < BLOCKSIZE; i++)
-			if((bits = b[i]) != (uint8)-1)
-			{
-				int j;
-				for(j = 0; j < 8; j++)
-					if(!(bits & (1 << j)))
-						break;
-				item = i * 8 + j + 1;
-				break;
-			}
-		if(i == BLOCKSIZE)
-			return 0;
+	io_plan *o = calloc(1, sizeof(*o));
+
+	if (!o)
+		error_msg_and_die(memory_exhausted);
+	o->io.read_at = plan_read_at;
+	o->io.write_at = plan_write_at;
+	o->io.writev_at = plan_writev_at;
+	o->io.truncate = plan_truncate;
+	o->io.punch = plan_punch;
+	o->io.close = plan_close;
+	o->io.fd = -1;
+	o->srcfd = -1;
+	o->sorted = 1;
+	return &o->io;
+}
+
+// Register an open file as a source of data blocks.  Returns its index,
+// or -1 if it can't be opened again by name, in which case its data has
+// to be stored like any other block.
+static int
+plan_add_source(io_backend *io, int fd)
+{
+	io_plan *o = container_of(io, io_plan, io);
+	char link[64], path[PATH_MAX];
+	struct stat st;
+	ssize_t r;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return -1;
+	SNPRINTF(link, sizeof(link), "/proc/self/fd/%d", fd);
+	if ((r = readlink(link, path, sizeof(path) - 1)) <= 0 || path[0] != '/')
+		return -1;
+	path[r] = 0;
+	o->srcs = realloc(o->srcs, (o->nsrcs + 1) * sizeof(*o->srcs));
+	if (!o->srcs)
+		error_msg_and_die("plan: out of memory");
+	o->srcs[o->nsrcs] = xstrdup(path);
+	return o->nsrcs++;
+}
+
+// the count blocks from blk on are the data of source src at off
+static void
+plan_add_ref(io_backend *io, uint32 blk, uint32 count, int src, off_t off)
+{
+	io_plan *o = container_of(io, io_plan, io);
+	plan_ext *e = o->next ? &o->ext[o->next - 1] : NULL;
+	uint32 i;
+
+	for (i = 0; i < count; i++) {
+		uint8 **slot = plan_slot(o, blk + i, 1);
+		plan_release(o, slot);
+		*slot = PLAN_REF;
 	}
-	b[(item-1) / 8] |= (1 << ((item-1) % 8));
-	return item;
+	if (e && e->src == (uint32) src && e->blk + e->count == blk &&
+	    e->off + ((off_t) e->count) * BLOCKSIZE == off) {
+		e->count += count;
+		return;
+	}
+	if (o->next == o->maxext) {
+		o->maxext = o->maxext ? o->maxext * 2 : 256;
+		o->ext = realloc(o->ext, o->maxext * sizeof(*o->ext));
+		if (!o->ext)
+			error_msg_and_die("plan: out of memory");
+	}
+	if (e && e->blk > blk)
+		o->sorted = 0;
+	e = &o->ext[o->next++];
+	e->blk = blk;
+	e->count = count;
+	e->src = src;
+	e->off = off;
+	if (((off_t) blk + count) * BLOCKSIZE > o->size)
+		o->size = ((off_t) blk + count) * BLOCKSIZE;
 }
 
-// deallocate a given block/inode
+// Write the planned image to out in block order; zero blocks are left
+// as holes, or written as zeros to a stream.
 static void
-deallocate(block b, uint32 item)
+plan_emit(io_backend *io, io_backend *out)
 {
-	b[(item-1) / 8] &= ~(1 << ((item-1) % 8));
+	io_plan *o = container_of(io, io_plan, io);
+	uint32 blk, nblocks = (o->size + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint32 first = 0, cnt = 0, max = PLAN_BUFSIZE / BLOCKSIZE, n;
+	uint8 *buf, **slot;
+	plan_ext *e;
+
+	if (!out->stream && out->truncate(out, o->size))
+		perror_msg_and_die("plan: ftruncate");
+	if (!(buf = malloc(PLAN_BUFSIZE)))
+		error_msg_and_die("plan: out of memory");
+	for (blk = 0; blk <= nblocks; blk++) {
+		slot = (blk < nblocks) ? plan_slot(o, blk, 0) : NULL;
+		if (cnt && (!slot || !*slot || cnt == max)) {
+			io_write(out, buf, (size_t) cnt * BLOCKSIZE,
+				 ((off_t) first) * BLOCKSIZE);
+			cnt = 0;
+		}
+		if (!slot || !*slot)
+			continue;
+		if (!cnt)
+			first = blk;
+		if (*slot == PLAN_REF) {
+			// as much of the extent as fits
+			e = plan_find_ext(o, blk);
+			for (n = 1; n < max - cnt && blk + n < e->blk + e->count; n++) {
+				slot = plan_slot(o, blk + n, 0);
+				if (*slot != PLAN_REF)
+					break;
+			}
+			plan_read_ext(o, e, blk, n, buf + (size_t) cnt * BLOCKSIZE);
+			cnt += n;
+			blk += n - 1;
+		} else
+			memcpy(buf + (size_t) cnt++ * BLOCKSIZE, *slot, BLOCKSIZE);
+	}
+	if (out->stream && out->write_at(out, "", 0, o->size) < 0)
+		perror_msg_and_die("write image");
+	free(buf);
 }
 
-// allocate a block
-static uint32
-alloc_blk(filesystem *fs, uint32 nod)
+/* Asynchronous writeback.  Evicted blocks and file data are handed to
+   a queue of at most WB_DEPTH writes in flight, served by io_uring if
+   the kernel has it or by a few threads doing pwrite otherwise, so
+   building the filesystem doesn't wait for the disk.  The queue owns
+   the buffers and frees them when the write completes.  A read, or a
+   write, that overlaps a pending write waits for it first. */
+
+#define WB_SYNC		0	// no queue, write immediately
+#define WB_AUTO		1	// io_uring if possible, else threads
+#define WB_URING	2
+#define WB_THREADS	3
+
+#define WB_DEPTH	64
+#define WB_THREADS_MAX	4
+
+// requested writeback mode, set from the command line
+static int wb_mode = WB_AUTO;
+
+#define WB_FREE		0
+#define WB_QUEUED	1	// waiting for a worker thread
+#define WB_RUNNING	2
+
+typedef struct
 {
-	uint32 bk=0;
-	uint32 grp,nbgroups;
-	blk_info *bi;
-	groupdescriptor *gd;
-	gd_info *gi;
+	int state;
+	uint8 *buf;
+	size_t len;
+	off_t off;
+	struct iovec iov;
+} wb_req;
 
-	grp = GRP_GROUP_OF_INODE(fs,nod);
-	nbgroups = GRP_NBGROUPS(fs);
-	gd = get_gd(fs, grp, &gi);
-	bk = allocate(GRP_GET_GROUP_BBM(fs, gd, &bi), 0);
-	GRP_PUT_GROUP_BBM(bi);
-	put_gd(gi);
-	if (!bk) {
-		for (grp=0; grp<nbgroups && !bk; grp++) {
-			gd = get_gd(fs, grp, &gi);
-			bk = allocate(GRP_GET_GROUP_BBM(fs, gd, &bi), 0);
-			GRP_PUT_GROUP_BBM(bi);
-			put_gd(gi);
-		}
-		grp--;
+typedef struct writeback
+{
+	io_backend *io;
+	int mode;
+	uint32 inflight;
+	wb_req reqs[WB_DEPTH];
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t work;	// a request was queued
+	pthread_cond_t done;	// a request completed
+	pthread_t threads[WB_THREADS_MAX];
+	int nthreads;
+	int quit;
+	uint32 queue[WB_DEPTH];	// FIFO of queued request numbers
+	uint32 qhead, qtail;
+#endif
+#if HAVE_LINUX_IO_URING_H
+	int ring;
+	uint8 *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+} writeback;
+
+static inline int
+wb_overlaps(wb_req *r, off_t off, size_t len)
+{
+	return r->state != WB_FREE && r->off < off + (off_t) len &&
+		off < r->off + (off_t) r->len;
+}
+
+#if HAVE_PTHREAD_H
+static void *
+wb_thread(void *arg)
+{
+	writeback *wb = arg;
+	wb_req *r;
+
+	pthread_mutex_lock(&wb->lock);
+	for (;;) {
+		while (wb->qhead == wb->qtail && !wb->quit)
+			pthread_cond_wait(&wb->work, &wb->lock);
+		if (wb->qhead == wb->qtail)
+			break;
+		r = &wb->reqs[wb->queue[wb->qhead++ % WB_DEPTH]];
+		r->state = WB_RUNNING;
+		pthread_mutex_unlock(&wb->lock);
+		io_write(wb->io, r->buf, r->len, r->off);
+		free(r->buf);
+		pthread_mutex_lock(&wb->lock);
+		r->state = WB_FREE;
+		wb->inflight--;
+		pthread_cond_broadcast(&wb->done);
 	}
-	if (!bk)
-		error_msg_and_die("couldn't allocate a block (no free space)");
-	gd = get_gd(fs, grp, &gi);
-	if(!(gd->bg_free_blocks_count--))
-		error_msg_and_die("group descr %d. free blocks count == 0 (corrupted fs?)",grp);
-	put_gd(gi);
-	if(!(fs->sb->s_free_blocks_count--))
-		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
-	return fs->sb->s_first_data_block + fs->sb->s_blocks_per_group*grp + (bk-1);
+	pthread_mutex_unlock(&wb->lock);
+	return NULL;
 }
 
-// free a block
+static int
+wb_threads_init(writeback *wb)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		n = 1;
+	if (n > WB_THREADS_MAX)
+		n = WB_THREADS_MAX;
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->work, NULL);
+	pthread_cond_init(&wb->done, NULL);
+	for (wb->nthreads = 0; wb->nthreads < n; wb->nthreads++)
+		if (pthread_create(&wb->threads[wb->nthreads], NULL,
+				   wb_thread, wb))
+			break;
+	return wb->nthreads ? 0 : -1;
+}
+#endif /* HAVE_PTHREAD_H */
+
+#if HAVE_LINUX_IO_URING_H
+static int
+wb_uring_init(writeback *wb)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	wb->ring = syscall(__NR_io_uring_setup, WB_DEPTH, &p);
+	if (wb->ring < 0)
+		return -1;
+	wb->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	wb->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	wb->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	wb->sq_ptr = mmap(NULL, wb->sq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, wb->ring, IORING_OFF_SQ_RING);
+	wb->cq_ptr = mmap(NULL, wb->cq_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, wb->ring, IORING_OFF_CQ_RING);
+	wb->sqes = mmap(NULL, wb->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, wb->ring, IORING_OFF_SQES);
+	if (wb->sq_ptr == MAP_FAILED || wb->cq_ptr == MAP_FAILED ||
+	    wb->sqes == MAP_FAILED) {
+		close(wb->ring);
+		return -1;
+	}
+	wb->sq_head = (unsigned *) (wb->sq_ptr + p.sq_off.head);
+	wb->sq_tail = (unsigned *) (wb->sq_ptr + p.sq_off.tail);
+	wb->sq_mask = (unsigned *) (wb->sq_ptr + p.sq_off.ring_mask);
+	wb->sq_array = (unsigned *) (wb->sq_ptr + p.sq_off.array);
+	wb->cq_head = (unsigned *) (wb->cq_ptr + p.cq_off.head);
+	wb->cq_tail = (unsigned *) (wb->cq_ptr + p.cq_off.tail);
+	wb->cq_mask = (unsigned *) (wb->cq_ptr + p.cq_off.ring_mask);
+	wb->cqes = (struct io_uring_cqe *) (wb->cq_ptr + p.cq_off.cqes);
+	return 0;
+}
+
+// Reap completed writes, waiting for at least one if wait is set
 static void
-free_blk(filesystem *fs, uint32 bk)
+wb_uring_reap(writeback *wb, int wait)
 {
-	uint32 grp;
-	blk_info *bi;
-	gd_info *gi;
-	groupdescriptor *gd;
+	unsigned head, tail;
+	struct io_uring_cqe *cqe;
+	wb_req *r;
+
+	if (wait && syscall(__NR_io_uring_enter, wb->ring, 0, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+		perror_msg_and_die("io_uring_enter");
+	head = *wb->cq_head;
+	tail = __atomic_load_n(wb->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		cqe = &wb->cqes[head & *wb->cq_mask];
+		r = &wb->reqs[cqe->user_data];
+		if (cqe->res < 0) {
+			errno = -cqe->res;
+			perror_msg_and_die("write image");
+		}
+		// finish a short write by hand
+		if ((size_t) cqe->res < r->len)
+			io_write(wb->io, r->buf + cqe->res, r->len - cqe->res,
+				 r->off + cqe->res);
+		free(r->buf);
+		r->state = WB_FREE;
+		wb->inflight--;
+	}
+	__atomic_store_n(wb->cq_head, head, __ATOMIC_RELEASE);
+}
 
-	grp = bk / fs->sb->s_blocks_per_group;
-	bk %= fs->sb->s_blocks_per_group;
-	gd = get_gd(fs, grp, &gi);
-	deallocate(GRP_GET_GROUP_BBM(fs, gd, &bi), bk);
-	GRP_PUT_GROUP_BBM(bi);
-	gd->bg_free_blocks_count++;
-	put_gd(gi);
-	fs->sb->s_free_blocks_count++;
+static void
+wb_uring_submit(writeback *wb, uint32 n)
+{
+	wb_req *r = &wb->reqs[n];
+	unsigned tail = *wb->sq_tail, idx = tail & *wb->sq_mask;
+	struct io_uring_sqe *sqe = &wb->sqes[idx];
+
+	r->iov.iov_base = r->buf;
+	r->iov.iov_len = r->len;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = wb->io->fd;
+	sqe->addr = (unsigned long) &r->iov;
+	sqe->len = 1;
+	sqe->off = r->off;
+	sqe->user_data = n;
+	wb->sq_array[idx] = idx;
+	__atomic_store_n(wb->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	while (syscall(__NR_io_uring_enter, wb->ring, 1, 0, 0, NULL, 0) < 0)
+		if (errno != EINTR)
+			perror_msg_and_die("io_uring_enter");
 }
+#endif /* HAVE_LINUX_IO_URING_H */
 
-// allocate an inode
-static uint32
-alloc_nod(filesystem *fs)
+// Start asynchronous writeback on io.  Returns NULL if writes should
+// just be done synchronously.
+static writeback *
+wb_init(io_backend *io)
 {
-	uint32 nod,best_group=0;
-	uint32 grp,nbgroups,avefreei;
-	blk_info *bi;
-	gd_info *gi, *bestgi;
-	groupdescriptor *gd, *bestgd;
+	writeback *wb;
 
-	nbgroups = GRP_NBGROUPS(fs);
+	// the queue bypasses the backend's own buffering, so only plain
+	// files qualify
+	if (wb_mode == WB_SYNC || io->stream || io->read_at != file_read_at)
+		return NULL;
+	if (!(wb = calloc(1, sizeof(*wb))))
+		error_msg_and_die(memory_exhausted);
+	wb->io = io;
+#if HAVE_LINUX_IO_URING_H
+	if ((wb_mode == WB_AUTO || wb_mode == WB_URING) && !wb_uring_init(wb)) {
+		wb->mode = WB_URING;
+		return wb;
+	}
+#endif
+#if HAVE_PTHREAD_H
+	if ((wb_mode == WB_AUTO || wb_mode == WB_THREADS) && !wb_threads_init(wb)) {
+		wb->mode = WB_THREADS;
+		return wb;
+	}
+#endif
+	if (wb_mode != WB_AUTO)
+		error_msg("requested writeback mode unavailable, writing synchronously");
+	free(wb);
+	return NULL;
+}
 
-	/* Distribute inodes amongst all the blocks                           */
-	/* For every block group with more than average number of free inodes */
-	/* find the one with the most free blocks and allocate node there     */
-	/* Idea from find_group_dir in fs/ext2/ialloc.c in 2.4.19 kernel      */
-	/* We do it for all inodes.                                           */
-	avefreei  =  fs->sb->s_free_inodes_count / nbgroups;
-	bestgd = get_gd(fs, best_group, &bestgi);
-	for(grp=0; grp<nbgroups; grp++) {
-		gd = get_gd(fs, grp, &gi);
-		if (gd->bg_free_inodes_count < avefreei ||
-		    gd->bg_free_inodes_count == 0) {
-			put_gd(gi);
+// Wait until the given request is complete.  Called with the lock held
+// in thread mode.
+static void
+wb_wait_req(writeback *wb, wb_req *r)
+{
+	while (r->state != WB_FREE) {
+#if HAVE_LINUX_IO_URING_H
+		if (wb->mode == WB_URING) {
+			wb_uring_reap(wb, 1);
 			continue;
 		}
-		if (!best_group || gd->bg_free_blocks_count > bestgd->bg_free_blocks_count) {
-			put_gd(bestgi);
-			best_group = grp;
-			bestgd = gd;
-			bestgi = gi;
-		} else
-			put_gd(gi);
+#endif
+#if HAVE_PTHREAD_H
+		pthread_cond_wait(&wb->done, &wb->lock);
+#endif
 	}
-	if (!(nod = allocate(GRP_GET_GROUP_IBM(fs, bestgd, &bi), 0)))
-		error_msg_and_die("couldn't allocate an inode (no free inode)");
-	GRP_PUT_GROUP_IBM(bi);
-	if(!(bestgd->bg_free_inodes_count--))
-		error_msg_and_die("group descr. free blocks count == 0 (corrupted fs?)");
-	put_gd(bestgi);
-	if(!(fs->sb->s_free_inodes_count--))
-		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
-	return fs->sb->s_inodes_per_group*best_group+nod;
 }
 
-// print a bitmap allocation
+static inline void
+wb_lock(writeback *wb)
+{
+#if HAVE_PTHREAD_H
+	if (wb->mode == WB_THREADS)
+		pthread_mutex_lock(&wb->lock);
+#endif
+}
+
+static inline void
+wb_unlock(writeback *wb)
+{
+#if HAVE_PTHREAD_H
+	if (wb->mode == WB_THREADS)
+		pthread_mutex_unlock(&wb->lock);
+#endif
+}
+
+// Wait for the pending writes that overlap the given range
 static void
-print_bm(block b, uint32 max)
+wb_wait_range(writeback *wb, off_t off, size_t len)
 {
 	uint32 i;
-	printf("----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8----+----9----+----0\n");
-	for(i=1; i <= max; i++)
-	{
-		putchar(allocated(b, i) ? '*' : '.');
-		if(!(i % 100))
-			printf("\n");
-	}
-	if((i-1) % 100)
-		printf("\n");
+
+	if (!wb)
+		return;
+	wb_lock(wb);
+	for (i = 0; wb->inflight && i < WB_DEPTH; i++)
+		if (wb_overlaps(&wb->reqs[i], off, len))
+			wb_wait_req(wb, &wb->reqs[i]);
+	wb_unlock(wb);
 }
 
-// initalize a blockwalker (iterator for blocks list)
-static inline void
-init_bw(blockwalker *bw)
+// Wait for all pending writes
+static void
+wb_barrier(writeback *wb)
 {
-	bw->bnum = 0;
-	bw->bpdir = EXT2_INIT_BLOCK;
+	wb_wait_range(wb, 0, (size_t) -1 >> 1);
 }
 
-// return next block of inode (WALK_END for end)
-// if *create>0, append a newly allocated block at the end
-// if *create<0, free the block - warning, the metadata blocks contents is
-//				  used after being freed, so once you start
-//				  freeing blocks don't stop until the end of
-//				  the file. moreover, i_blocks isn't updated.
-// if hole!=0, create a hole in the file
-static uint32
-walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
+// Write len bytes of buf at off.  If owned, buf was allocated with
+// malloc and is freed once written, otherwise it's copied first.
+static void
+wb_write(writeback *wb, io_backend *io, uint8 *buf, size_t len, off_t off, int owned)
 {
-	uint32 *bkref = 0;
-	uint32 bk = 0;
-	blkmap_info *bmi1 = NULL, *bmi2 = NULL, *bmi3 = NULL;
-	uint32 *b;
-	int extend = 0, reduce = 0;
-	inode *inod;
-	nod_info *ni;
-	uint32 *iblk;
+	uint32 i, n = WB_DEPTH;
+	uint8 *copy;
 
-	if(create && (*create) < 0)
-		reduce = 1;
-	inod = get_nod(fs, nod, &ni);
-	if(bw->bnum >= inod->i_blocks / INOBLK)
-	{
-		if(create && (*create) > 0)
-		{
-			(*create)--;
-			extend = 1;
-		}
-		else
-		{
-			put_nod(ni);
-			return WALK_END;
-		}
+	if (!wb) {
+		io_write(io, buf, len, off);
+		if (owned)
+			free(buf);
+		return;
 	}
-	iblk = inod->i_block;
-	// first direct block
-	if(bw->bpdir == EXT2_INIT_BLOCK)
-	{
-		bkref = &iblk[bw->bpdir = 0];
-		if(extend) // allocate first block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
+	if (!owned) {
+		if (!(copy = malloc(len)))
+			error_msg_and_die(memory_exhausted);
+		buf = memcpy(copy, buf, len);
 	}
-	// direct block
-	else if(bw->bpdir < EXT2_NDIR_BLOCKS)
-	{
-		bkref = &iblk[++bw->bpdir];
-		if(extend) // allocate block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free block
-			free_blk(fs, *bkref);
+	wb_lock(wb);
+	for (i = 0; i < WB_DEPTH; i++) {
+		// keep writes to the same place in order
+		if (wb_overlaps(&wb->reqs[i], off, len))
+			wb_wait_req(wb, &wb->reqs[i]);
+		if (n == WB_DEPTH && wb->reqs[i].state == WB_FREE)
+			n = i;
 	}
-	// first block in indirect block
-	else if(bw->bpdir == EXT2_NDIR_BLOCKS)
-	{
-		bw->bnum++;
-		bw->bpdir = EXT2_IND_BLOCK;
-		bw->bpind = 0;
-		if(extend) // allocate indirect block
-			iblk[bw->bpdir] = alloc_blk(fs,nod);
-		if(reduce) // free indirect block
-			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		bkref = &b[bw->bpind];
-		if(extend) // allocate first block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
+	while (n == WB_DEPTH) {
+		// queue full, wait for any write to complete
+#if HAVE_LINUX_IO_URING_H
+		if (wb->mode == WB_URING)
+			wb_uring_reap(wb, 1);
+#endif
+#if HAVE_PTHREAD_H
+		if (wb->mode == WB_THREADS)
+			pthread_cond_wait(&wb->done, &wb->lock);
+#endif
+		for (i = 0; i < WB_DEPTH && n == WB_DEPTH; i++)
+			if (wb->reqs[i].state == WB_FREE)
+				n = i;
 	}
-	// block in indirect block
-	else if((bw->bpdir == EXT2_IND_BLOCK) && (bw->bpind < BLOCKSIZE/4 - 1))
-	{
-		bw->bpind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		bkref = &b[bw->bpind];
-		if(extend) // allocate block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free block
-			free_blk(fs, *bkref);
-	}
-	// first block in first indirect block in first double indirect block
-	else if(bw->bpdir == EXT2_IND_BLOCK)
-	{
-		bw->bnum += 2;
-		bw->bpdir = EXT2_DIND_BLOCK;
-		bw->bpind = 0;
-		bw->bpdind = 0;
-		if(extend) // allocate double indirect block
-			iblk[bw->bpdir] = alloc_blk(fs,nod);
-		if(reduce) // free double indirect block
-			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		if(extend) // allocate first indirect block
-			b[bw->bpind] = alloc_blk(fs,nod);
-		if(reduce) // free  firstindirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		bkref = &b[bw->bpdind];
-		if(extend) // allocate first block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
-	}
-	// block in indirect block in double indirect block
-	else if((bw->bpdir == EXT2_DIND_BLOCK) && (bw->bpdind < BLOCKSIZE/4 - 1))
-	{
-		bw->bpdind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		bkref = &b[bw->bpdind];
-		if(extend) // allocate block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free block
-			free_blk(fs, *bkref);
+	wb->reqs[n].buf = buf;
+	wb->reqs[n].len = len;
+	wb->reqs[n].off = off;
+	wb->reqs[n].state = WB_RUNNING;
+	wb->inflight++;
+#if HAVE_LINUX_IO_URING_H
+	if (wb->mode == WB_URING) {
+		wb_uring_submit(wb, n);
+		// pick up whatever has completed in the meantime
+		wb_uring_reap(wb, 0);
 	}
-	// first block in indirect block in double indirect block
-	else if((bw->bpdir == EXT2_DIND_BLOCK) && (bw->bpind < BLOCKSIZE/4 - 1))
-	{
-		bw->bnum++;
-		bw->bpdind = 0;
-		bw->bpind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		if(extend) // allocate indirect block
-			b[bw->bpind] = alloc_blk(fs,nod);
-		if(reduce) // free indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		bkref = &b[bw->bpdind];
-		if(extend) // allocate first block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
+#endif
+#if HAVE_PTHREAD_H
+	if (wb->mode == WB_THREADS) {
+		wb->reqs[n].state = WB_QUEUED;
+		wb->queue[wb->qtail++ % WB_DEPTH] = n;
+		pthread_cond_signal(&wb->work);
 	}
+#endif
+	wb_unlock(wb);
+}
 
-	/* Adding support for triple indirection */
-	/* Just starting triple indirection. Allocate the indirection
-	   blocks and the first data block
-	 */
-	else if (bw->bpdir == EXT2_DIND_BLOCK) 
-	{
-	  	bw->bnum += 3;
-		bw->bpdir = EXT2_TIND_BLOCK;
-		bw->bpind = 0;
-		bw->bpdind = 0;
-		bw->bptind = 0;
-		if(extend) // allocate triple indirect block
-			iblk[bw->bpdir] = alloc_blk(fs,nod);
-		if(reduce) // free triple indirect block
-			free_blk(fs, iblk[bw->bpdir]);
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		if(extend) // allocate first double indirect block
-			b[bw->bpind] = alloc_blk(fs,nod);
-		if(reduce) // free first double indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		if(extend) // allocate first indirect block
-			b[bw->bpdind] = alloc_blk(fs,nod);
-		if(reduce) // free first indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
-		bkref = &b[bw->bptind];
-		if(extend) // allocate first data block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
-	}
-	/* Still processing a single indirect block down the indirection
-	   chain.Allocate a data block for it
-	 */
-	else if ( (bw->bpdir == EXT2_TIND_BLOCK) && 
-		  (bw->bptind < BLOCKSIZE/4 -1) )
-	{
-		bw->bptind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
-		bkref = &b[bw->bptind];
-		if(extend) // allocate data block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free block
-			free_blk(fs, *bkref);
-	}
-	/* Finished processing a single indirect block. But still in the 
-	   same double indirect block. Allocate new single indirect block
-	   for it and a data block
-	 */
-	else if ( (bw->bpdir == EXT2_TIND_BLOCK) &&
-		  (bw->bpdind < BLOCKSIZE/4 -1) )
-	{
-		bw->bnum++;
-		bw->bptind = 0;
-		bw->bpdind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		if(extend) // allocate single indirect block
-			b[bw->bpdind] = alloc_blk(fs,nod);
-		if(reduce) // free indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
-		bkref = &b[bw->bptind];
-		if(extend) // allocate first data block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
+// Complete all pending writes and stop the writeback machinery
+static void
+wb_finish(writeback *wb)
+{
+	if (!wb)
+		return;
+	wb_barrier(wb);
+#if HAVE_PTHREAD_H
+	if (wb->mode == WB_THREADS) {
+		int i;
+		pthread_mutex_lock(&wb->lock);
+		wb->quit = 1;
+		pthread_cond_broadcast(&wb->work);
+		pthread_mutex_unlock(&wb->lock);
+		for (i = 0; i < wb->nthreads; i++)
+			pthread_join(wb->threads[i], NULL);
 	}
-	/* Finished processing a double indirect block. Allocate the next
-	   double indirect block and the single,data blocks for it
-	 */
-	else if ( (bw->bpdir == EXT2_TIND_BLOCK) && 
-		  (bw->bpind < BLOCKSIZE/4 - 1) )
-	{
-		bw->bnum += 2;
-		bw->bpdind = 0;
-		bw->bptind = 0;
-		bw->bpind++;
-		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
-		if(extend) // allocate double indirect block
-			b[bw->bpind] = alloc_blk(fs,nod);
-		if(reduce) // free double indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpind], &bmi2);
-		if(extend) // allocate single indirect block
-			b[bw->bpdind] = alloc_blk(fs,nod);
-		if(reduce) // free indirect block
-			free_blk(fs, b[bw->bpind]);
-		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
-		bkref = &b[bw->bptind];
-		if(extend) // allocate first block
-			*bkref = hole ? 0 : alloc_blk(fs,nod);
-		if(reduce) // free first block
-			free_blk(fs, *bkref);
+#endif
+#if HAVE_LINUX_IO_URING_H
+	if (wb->mode == WB_URING) {
+		munmap(wb->sqes, wb->sqes_size);
+		munmap(wb->cq_ptr, wb->cq_size);
+		munmap(wb->sq_ptr, wb->sq_size);
+		close(wb->ring);
 	}
-	else
-		error_msg_and_die("file too big !"); 
-	/* End change for walking triple indirection */
+#endif
+	free(wb);
+}
 
-	bk = *bkref;
-	if (bmi3)
-		put_blkmap(bmi3);
-	if (bmi2)
-		put_blkmap(bmi2);
-	if (bmi1)
-		put_blkmap(bmi1);
+// Work scheduler.  Independent jobs, like setting up or filling block
+// groups, or compressing chunks of the output, run on several cores.
+// Group callbacks must not use the caches (which are not thread safe);
+// they work on private buffers and write them with io_write.
 
-	if(bk)
-	{
-		blk_info *bi;
-		gd_info *gi;
-		uint8 *block;
-		bw->bnum++;
-		block = GRP_GET_BLOCK_BITMAP(fs,bk,&bi,&gi);
-		if(!reduce && !allocated(block, GRP_BBM_OFFSET(fs,bk)))
-			error_msg_and_die("[block %d of inode %d is unallocated !]", bk, nod);
-		GRP_PUT_BLOCK_BITMAP(bi, gi);
-	}
-	if(extend)
-		inod->i_blocks = bw->bnum * INOBLK;
-	put_nod(ni);
-	return bk;
-}
+// number of threads for parallel work, 0 for one per CPU
+static int nthreads;
+
+#define JOB_THREADS_MAX		64
+
+typedef void (*job_fn)(void *arg, uint32 job);
 
 typedef struct
 {
-	blockwalker bw;
-	uint32 nod;
-	nod_info *ni;
-	inode *inod;
-} inode_pos;
-#define INODE_POS_TRUNCATE 0
-#define INODE_POS_EXTEND 1
+	job_fn fn;
+	void *arg;
+	uint32 next;
+	uint32 count;
+} job_work;
 
-// Call this to set up an ipos structure for future use with
-// extend_inode_blk to append blocks to the given inode.  If
-// op is INODE_POS_TRUNCATE, the inode is truncated to zero size.
-// If op is INODE_POS_EXTEND, the position is moved to the end
-// of the inode's data blocks.
-// Call inode_pos_finish when done with the inode_pos structure.
 static void
-inode_pos_init(filesystem *fs, inode_pos *ipos, uint32 nod, int op,
-	       blockwalker *endbw)
+job_work_run(job_work *jw)
 {
-	blockwalker lbw;
+	uint32 job;
 
-	init_bw(&ipos->bw);
-	ipos->nod = nod;
-	ipos->inod = get_nod(fs, nod, &ipos->ni);
-	if (op == INODE_POS_TRUNCATE) {
-		int32 create = -1;
-		while(walk_bw(fs, nod, &ipos->bw, &create, 0) != WALK_END)
-			/*nop*/;
-		ipos->inod->i_blocks = 0;
-	}
+	while ((job = __atomic_fetch_add(&jw->next, 1, __ATOMIC_RELAXED)) < jw->count)
+		jw->fn(jw->arg, job);
+}
 
-	if (endbw)
-		ipos->bw = *endbw;
-	else {
-		/* Seek to the end */
-		init_bw(&ipos->bw);
-		lbw = ipos->bw;
-		while(walk_bw(fs, nod, &ipos->bw, 0, 0) != WALK_END)
-			lbw = ipos->bw;
-		ipos->bw = lbw;
-	}
+#if HAVE_PTHREAD_H
+static void *
+job_thread(void *arg)
+{
+	job_work_run(arg);
+	return NULL;
+}
+#endif
+
+// the number of threads to use for parallel work
+static long
+job_threads(void)
+{
+	long n = nthreads;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	if (n > JOB_THREADS_MAX)
+		n = JOB_THREADS_MAX;
+	return n;
 }
 
-// Clean up the inode_pos structure.
+// Call fn for every job from 0 to count - 1, in no particular order,
+// from several threads if parallel is set.
 static void
-inode_pos_finish(filesystem *fs, inode_pos *ipos)
+run_jobs(uint32 count, int parallel, job_fn fn, void *arg)
 {
-	put_nod(ipos->ni);
+	job_work jw = { fn, arg, 0, count };
+#if HAVE_PTHREAD_H
+	pthread_t threads[JOB_THREADS_MAX];
+	long i, n = parallel ? job_threads() : 1;
+
+	if (n > count)
+		n = count;
+	// the calling thread is one of the workers
+	for (i = 0; i < n - 1; i++)
+		if (pthread_create(&threads[i], NULL, job_thread, &jw))
+			break;
+	job_work_run(&jw);
+	n = i;
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+#else
+	job_work_run(&jw);
+#endif
 }
 
-// add blocks to an inode (file/dir/etc...) at the given position.
-// This will only work when appending to the end of an inode.
+typedef void (*group_fn)(filesystem *fs, uint32 grp, void *arg);
+
+typedef struct
+{
+	filesystem *fs;
+	group_fn fn;
+	void *arg;
+} group_job;
+
 static void
-extend_inode_blk(filesystem *fs, inode_pos *ipos, block b, int amount)
+group_job_run(void *arg, uint32 grp)
 {
-	uint32 bk;
-	uint32 pos;
+	group_job *gj = arg;
+	gj->fn(gj->fs, grp, gj->arg);
+}
 
-	if (amount < 0)
-		error_msg_and_die("extend_inode_blk: Got negative amount");
+// Call fn for every group from 0 to count - 1, in no particular order.
+// Only the plain file backend can be written from several threads at
+// once; with the others the groups are done one after the other.
+static void
+run_groups(filesystem *fs, uint32 count, group_fn fn, void *arg)
+{
+	group_job gj = { fs, fn, arg };
 
-	for (pos = 0; amount; pos += BLOCKSIZE)
-	{
-		int hole = (fs->holes && is_blk_empty(b + pos));
+	run_jobs(count, fs->io->read_at == file_read_at, group_job_run, &gj);
+}
 
-		bk = walk_bw(fs, ipos->nod, &ipos->bw, &amount, hole);
-		if (bk == WALK_END)
-			error_msg_and_die("extend_inode_blk: extend failed");
-		if (!hole) {
-			blk_info *bi;
-			uint8 *block = get_blk(fs, bk, &bi);
-			memcpy(block, b + pos, BLOCKSIZE);
-			put_blk(bi);
-		}
+/* Compressed output.  The image, written in order, is cut into chunks
+   of CZ_CHUNK bytes that are compressed independently on the worker
+   threads, a batch at a time, and written out in order: each chunk is
+   a complete gzip member or zstd frame, and their concatenation is a
+   valid gzip or zstd file.  Skipped ranges (free blocks) are zeros, and
+   a chunk with nothing else reuses the compressed zero chunk. */
+
+#define CZ_NONE		0
+#define CZ_GZIP		1
+#define CZ_ZSTD		2
+// the method is set by --compress (compress_method)
+
+#define CZ_CHUNK	(4 * 1024 * 1024)
+
+typedef struct
+{
+	uint8 *in;
+	size_t inlen;
+	uint8 *out;
+	size_t outlen;
+	int zero;	// nothing but zeros, use io_compress.zout
+} cz_job;
+
+typedef struct
+{
+	io_backend io;
+	io_backend *lower;
+	int method;
+	off_t pos;	// bytes of image taken in
+	off_t outpos;	// bytes written to lower
+	cz_job *jobs;
+	uint32 njobs, maxjobs;
+	uint8 *zout;	// compressed CZ_CHUNK of zeros
+	size_t zoutlen;
+} io_compress;
+
+static void
+cz_compress(io_compress *c, cz_job *j)
+{
+#if HAVE_ZLIB_H && HAVE_LIBZ
+	if (c->method == CZ_GZIP) {
+		z_stream z;
+
+		memset(&z, 0, sizeof(z));
+		// 16 + 15 window bits: a gzip header and trailer
+		if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15,
+				 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			error_msg_and_die("compress: deflateInit2 failed");
+		j->outlen = deflateBound(&z, j->inlen);
+		if (!(j->out = malloc(j->outlen)))
+			error_msg_and_die("compress: out of memory");
+		z.next_in = j->in;
+		z.avail_in = j->inlen;
+		z.next_out = j->out;
+		z.avail_out = j->outlen;
+		if (deflate(&z, Z_FINISH) != Z_STREAM_END)
+			error_msg_and_die("compress: deflate failed");
+		j->outlen = z.total_out;
+		deflateEnd(&z);
+		return;
 	}
+#endif
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+	if (c->method == CZ_ZSTD) {
+		j->outlen = ZSTD_compressBound(j->inlen);
+		if (!(j->out = malloc(j->outlen)))
+			error_msg_and_die("compress: out of memory");
+		j->outlen = ZSTD_compress(j->out, j->outlen, j->in, j->inlen, 3);
+		if (ZSTD_isError(j->outlen))
+			error_msg_and_die("compress: %s", ZSTD_getErrorName(j->outlen));
+		return;
+	}
+#endif
+	error_msg_and_die("Internal error: unsupported compression");
 }
 
-// link an entry (inode #) to a directory
 static void
-add2dir(filesystem *fs, uint32 dnod, uint32 nod, const char* name)
+cz_job_run(void *arg, uint32 i)
 {
-	blockwalker bw, lbw;
-	uint32 bk;
-	directory *d;
-	dirwalker dw;
-	int reclen, nlen;
-	inode *node;
-	inode *pnode;
-	nod_info *dni, *ni;
-	inode_pos ipos;
+	io_compress *c = arg;
 
-	pnode = get_nod(fs, dnod, &dni);
-	if((pnode->i_mode & FM_IFMT) != FM_IFDIR)
-		error_msg_and_die("can't add '%s' to a non-directory", name);
-	if(!*name)
-		error_msg_and_die("can't create an inode with an empty name");
-	if(strchr(name, '/'))
-		error_msg_and_die("bad name '%s' (contains a slash)", name);
-	nlen = strlen(name);
-	reclen = sizeof(directory) + rndup(nlen, 4);
-	if(reclen > BLOCKSIZE)
-		error_msg_and_die("bad name '%s' (too long)", name);
-	init_bw(&bw);
-	lbw = bw;
-	while((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) // for all blocks in dir
-	{
-		// for all dir entries in block
-		for(d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
-		{
-			// if empty dir entry, large enough, use it
-			if((!d->d_inode) && (d->d_rec_len >= reclen))
-			{
-				d->d_inode = nod;
-				node = get_nod(fs, nod, &ni);
-				dir_set_name(&dw, name, nlen);
-				put_dir(&dw);
-				node->i_links_count++;
-				put_nod(ni);
-				goto out;
-			}
-			// if entry with enough room (last one?), shrink it & use it
-			if(d->d_rec_len >= (sizeof(directory) + rndup(d->d_name_len, 4) + reclen))
-			{
-				d = shrink_dir(&dw, nod, name, nlen);
-				put_dir(&dw);
-				node = get_nod(fs, nod, &ni);
-				node->i_links_count++;
-				put_nod(ni);
-				goto out;
-			}
-		}
-		put_dir(&dw);
-		lbw = bw;
-	}
-	// we found no free entry in the directory, so we add a block
-	node = get_nod(fs, nod, &ni);
-	d = new_dir(fs, nod, name, nlen, &dw);
-	node->i_links_count++;
-	put_nod(ni);
-	next_dir(&dw); // Force the data into the buffer
+	if (!c->jobs[i].zero)
+		cz_compress(c, &c->jobs[i]);
+}
 
-	inode_pos_init(fs, &ipos, dnod, INODE_POS_EXTEND, &lbw);
-	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
-	inode_pos_finish(fs, &ipos);
+// compress the pending chunks and write them out in order
+static void
+cz_flush(io_compress *c)
+{
+	cz_job *j;
 
-	put_dir(&dw);
-	pnode->i_size += BLOCKSIZE;
-out:
-	put_nod(dni);
+	run_jobs(c->njobs, 1, cz_job_run, c);
+	for (j = c->jobs; j < c->jobs + c->njobs; j++) {
+		if (j->zero)
+			io_write(c->lower, c->zout, c->zoutlen, c->outpos);
+		else
+			io_write(c->lower, j->out, j->outlen, c->outpos);
+		c->outpos += j->zero ? c->zoutlen : j->outlen;
+		free(j->out);
+		j->out = NULL;
+		j->inlen = 0;
+		j->zero = 0;
+	}
+	c->njobs = 0;
 }
 
-// find an entry in a directory
-static uint32
-find_dir(filesystem *fs, uint32 nod, const char * name)
+// the chunk being filled, starting a new one if needed
+static cz_job *
+cz_current(io_compress *c)
 {
-	blockwalker bw;
-	uint32 bk;
-	int nlen = strlen(name);
-	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-	{
-		directory *d;
-		dirwalker dw;
-		for (d = get_dir(fs, bk, &dw); d; d=next_dir(&dw))
-			if(d->d_inode && (nlen == d->d_name_len) && !strncmp(dir_name(&dw), name, nlen)) {
-				uint32 result = d->d_inode;
-				put_dir(&dw);
-				return result;
+	cz_job *j;
+
+	if (c->njobs && c->jobs[c->njobs - 1].inlen < CZ_CHUNK &&
+	    !c->jobs[c->njobs - 1].zero)
+		return &c->jobs[c->njobs - 1];
+	if (c->njobs == c->maxjobs)
+		cz_flush(c);
+	j = &c->jobs[c->njobs++];
+	if (!j->in && !(j->in = malloc(CZ_CHUNK)))
+		error_msg_and_die("compress: out of memory");
+	return j;
+}
+
+// take in len bytes of zeros
+static void
+cz_zeros(io_compress *c, off_t len)
+{
+	cz_job *j;
+	size_t n;
+
+	while (len) {
+		// whole chunks of zeros are compressed only once
+		if (len >= CZ_CHUNK && c->pos % CZ_CHUNK == 0) {
+			if (!c->zout) {
+				cz_job z = { NULL, CZ_CHUNK, NULL, 0, 0 };
+				if (!(z.in = calloc(1, CZ_CHUNK)))
+					error_msg_and_die("compress: out of memory");
+				cz_compress(c, &z);
+				free(z.in);
+				c->zout = z.out;
+				c->zoutlen = z.outlen;
 			}
-		put_dir(&dw);
+			if (c->njobs == c->maxjobs)
+				cz_flush(c);
+			c->jobs[c->njobs].inlen = CZ_CHUNK;
+			c->jobs[c->njobs++].zero = 1;
+			c->pos += CZ_CHUNK;
+			len -= CZ_CHUNK;
+			continue;
+		}
+		j = cz_current(c);
+		n = CZ_CHUNK - j->inlen;
+		if ((off_t) n > len)
+			n = len;
+		memset(j->in + j->inlen, 0, n);
+		j->inlen += n;
+		c->pos += n;
+		len -= n;
 	}
-	return 0;
 }
 
-// find the inode of a full path
-static uint32
-find_path(filesystem *fs, uint32 nod, const char * name)
+static ssize_t
+cz_write_at(io_backend *io, const void *buf, size_t len, off_t off)
 {
-	char *p, *n, *n2 = xstrdup(name);
-	n = n2;
-	while(*n == '/')
-	{
-		nod = EXT2_ROOT_INO;
-		n++;
-	}
-	while(*n)
-	{
-		if((p = strchr(n, '/')))
-			(*p) = 0;
-		if(!(nod = find_dir(fs, nod, n)))
-			break;
-		if(p)
-			n = p + 1;
-		else
-			break;
+	io_compress *c = container_of(io, io_compress, io);
+	const uint8 *b = buf;
+	size_t done = 0, n;
+	cz_job *j;
+
+	if (off < c->pos)
+		error_msg_and_die("Internal error: out of order compressed write");
+	if (off > c->pos)
+		cz_zeros(c, off - c->pos);
+	while (done < len) {
+		j = cz_current(c);
+		n = CZ_CHUNK - j->inlen;
+		if (n > len - done)
+			n = len - done;
+		memcpy(j->in + j->inlen, b + done, n);
+		j->inlen += n;
+		done += n;
 	}
-	free(n2);
-	return nod;
+	c->pos += len;
+	return len;
 }
 
-// chmod an inode
-void
-chmod_fs(filesystem *fs, uint32 nod, uint16 mode, uint16 uid, uint16 gid)
+static ssize_t
+cz_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
 {
-	inode *node;
-	nod_info *ni;
-	node = get_nod(fs, nod, &ni);
-	node->i_mode = (node->i_mode & ~FM_IMASK) | (mode & FM_IMASK);
-	node->i_uid = uid;
-	node->i_gid = gid;
-	put_nod(ni);
+	return cz_write_at(io, iov->iov_base, iov->iov_len, off);
 }
 
-// create a simple inode
-static uint32
-mknod_fs(filesystem *fs, uint32 parent_nod, const char *name, uint16 mode, uint16 uid, uint16 gid, uint8 major, uint8 minor, uint32 ctime, uint32 mtime)
+static ssize_t
+cz_read_at(io_backend *io, void *buf, size_t len, off_t off)
 {
-	uint32 nod;
-	inode *node;
-	nod_info *ni;
-	gd_info *gi;
+	errno = ESPIPE;
+	return -1;
+}
 
-	nod = alloc_nod(fs);
-	node = get_nod(fs, nod, &ni);
-	node->i_mode = mode;
-	add2dir(fs, parent_nod, nod, name);
-	switch(mode & FM_IFMT)
-	{
-	case FM_IFLNK:
-		mode = FM_IFLNK | FM_IRWXU | FM_IRWXG | FM_IRWXO;
-		break;
-	case FM_IFBLK:
-	case FM_IFCHR:
-		if (fs->swapit) {
-			((uint8*)node->i_block)[3] = minor;
-			((uint8*)node->i_block)[2] = major;
-		} else {
-			((uint8*)node->i_block)[0] = minor;
-			((uint8*)node->i_block)[1] = major;
-		}
-		break;
-	case FM_IFDIR:
-		add2dir(fs, nod, nod, ".");
-		add2dir(fs, nod, parent_nod, "..");
-		get_gd(fs,GRP_GROUP_OF_INODE(fs,nod),&gi)->bg_used_dirs_count++;
-		put_gd(gi);
-		break;
-	}
-	node->i_uid = uid;
-	node->i_gid = gid;
-	node->i_atime = mtime;
-	node->i_ctime = ctime;
-	node->i_mtime = mtime;
-	put_nod(ni);
-	return nod;
+static int
+cz_truncate(io_backend *io, off_t len)
+{
+	errno = ESPIPE;
+	return -1;
 }
 
-// make a full-fledged directory (i.e. with "." & "..")
-static inline uint32
-mkdir_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode,
-	uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+static void
+cz_close(io_backend *io)
 {
-	return mknod_fs(fs, parent_nod, name, mode|FM_IFDIR, uid, gid, 0, 0, ctime, mtime);
+	io_compress *c = container_of(io, io_compress, io);
+	uint32 i;
+
+	cz_flush(c);
+	if (!c->lower->stream && c->lower->truncate(c->lower, c->outpos))
+		perror_msg_and_die("compress: ftruncate");
+	c->lower->close(c->lower);
+	for (i = 0; i < c->maxjobs; i++)
+		free(c->jobs[i].in);
+	free(c->jobs);
+	free(c->zout);
+	free(c);
 }
 
-// byte swapping for symlinks
-static inline void
-swab32_into(uint32 *dst, uint32 *src, size_t n)
+// Compress everything written to the returned backend into lower, which
+// is closed with it.  Writes must come in order, like for a stream.
+static io_backend *
+io_open_compress(io_backend *lower, int method)
 {
-	size_t i;
-	for(i = 0; i < n; i++)
-		dst[i] = swab32(src[i]);
+	io_compress *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		error_msg_and_die(memory_exhausted);
+	c->io.read_at = cz_read_at;
+	c->io.write_at = cz_write_at;
+	c->io.writev_at = cz_writev_at;
+	c->io.truncate = cz_truncate;
+	c->io.punch = stream_punch;
+	c->io.close = cz_close;
+	c->io.fd = -1;
+	c->io.stream = 1;
+	c->lower = lower;
+	c->method = method;
+	// enough chunks in a batch to keep every thread busy
+	c->maxjobs = 2 * job_threads();
+	if (!(c->jobs = calloc(c->maxjobs, sizeof(*c->jobs))))
+		error_msg_and_die(memory_exhausted);
+	return &c->io;
 }
 
-// make a symlink
-static uint32
-mklink_fs(filesystem *fs, uint32 parent_nod, const char *name, size_t size, uint8 *b, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+/* Digest of the output image (--digest), for a checksum file next to
+   it.  The image is hashed as it's written out, or, when it was built
+   in place, straight from it with the free blocks taken as the fill
+   without reading them (see digest_image).  In tree mode the image is
+   cut into leaves of DG_LEAF bytes that are hashed independently, so
+   possibly in parallel, and the result is the digest of the leaf
+   digests in order.  A whole leaf of fill is only hashed once. */
+
+#define DG_LEAF		(1024 * 1024)
+#define DG_FILLBUF	(64 * 1024)
+
+// set by --digest, 0 for none
+static int digest_alg;
+static int digest_tree;
+static const char *digest_name;
+// the checksum file, set by --digest-file or named after the image
+static const char *digest_file;
+
+typedef struct
 {
-	uint32 nod = mknod_fs(fs, parent_nod, name, FM_IFLNK | FM_IRWXU | FM_IRWXG | FM_IRWXO, uid, gid, 0, 0, ctime, mtime);
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
-	inode_pos ipos;
+	int alg;
+	int tree;
+	digest_ctx ctx;		// the whole image, or the current leaf
+	digest_ctx root;	// tree mode: the leaf digests
+	off_t pos;		// bytes taken in
+	int fill;		// the value in fillbuf, -1 if not set up
+	uint8 *fillbuf;		// DG_FILLBUF bytes of fill
+	uint8 fillleaf[DIGEST_MAX_SIZE];	// tree mode: a leaf of fill
+} image_digest;
 
-	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
-	node->i_size = size;
+static void
+dg_init(image_digest *dg, int alg, int tree)
+{
+	memset(dg, 0, sizeof(*dg));
+	dg->alg = alg;
+	dg->tree = tree;
+	dg->fill = -1;
+	digest_init(&dg->ctx, alg);
+	digest_init(&dg->root, alg);
+}
 
-	if (size < 4 * (EXT2_TIND_BLOCK + 1))
-		if (fs->swapit)
-			swab32_into(node->i_block, (uint32 *)b, EXT2_TIND_BLOCK + 1);
-		else
-			memcpy(node->i_block, b, 4 * (EXT2_TIND_BLOCK + 1));
-	else
-		extend_inode_blk(fs, &ipos, b, rndup(size, BLOCKSIZE) / BLOCKSIZE);
+// set up the fill buffer, and the digest of a leaf of it
+static void
+dg_set_fill(image_digest *dg, int val)
+{
+	digest_ctx c;
+	int i;
 
-	inode_pos_finish(fs, &ipos);
-	put_nod(ni);
-	return nod;
+	if (dg->fill == val)
+		return;
+	if (!dg->fillbuf && !(dg->fillbuf = malloc(DG_FILLBUF)))
+		error_msg_and_die("digest: out of memory");
+	memset(dg->fillbuf, val, DG_FILLBUF);
+	dg->fill = val;
+	if (!dg->tree)
+		return;
+	digest_init(&c, dg->alg);
+	for (i = 0; i < DG_LEAF / DG_FILLBUF; i++)
+		digest_update(&c, dg->fillbuf, DG_FILLBUF);
+	digest_final(&c, dg->fillleaf);
 }
 
+// take in the next len bytes of the image
 static void
-fs_upgrade_rev1_largefile(filesystem *fs)
+dg_update(image_digest *dg, const void *buf, size_t len)
 {
-	fs->sb->s_rev_level = 1;
-	fs->sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
-	fs->sb->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+	const uint8 *b = buf;
+	uint8 d[DIGEST_MAX_SIZE];
+	size_t n;
+
+	while (len) {
+		n = len;
+		if (dg->tree && n > DG_LEAF - dg->pos % DG_LEAF)
+			n = DG_LEAF - dg->pos % DG_LEAF;
+		digest_update(&dg->ctx, b, n);
+		dg->pos += n;
+		b += n;
+		len -= n;
+		if (dg->tree && dg->pos % DG_LEAF == 0) {
+			digest_final(&dg->ctx, d);
+			digest_update(&dg->root, d, digest_size(dg->alg));
+			digest_init(&dg->ctx, dg->alg);
+		}
+	}
 }
 
-#define COPY_BLOCKS 16
-#define CB_SIZE (COPY_BLOCKS * BLOCKSIZE)
+// take in len bytes of val
+static void
+dg_fill(image_digest *dg, int val, off_t len)
+{
+	size_t n;
+
+	dg_set_fill(dg, val);
+	while (len) {
+		if (dg->tree && dg->pos % DG_LEAF == 0 && len >= DG_LEAF) {
+			digest_update(&dg->root, dg->fillleaf, digest_size(dg->alg));
+			dg->pos += DG_LEAF;
+			len -= DG_LEAF;
+			continue;
+		}
+		n = (len > DG_FILLBUF) ? DG_FILLBUF : len;
+		dg_update(dg, dg->fillbuf, n);
+		len -= n;
+	}
+}
 
-// make a file from a FILE*
-static uint32
-mkfile_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode, FILE *f, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+// the digest of everything taken in, to out
+static void
+dg_final(image_digest *dg, uint8 *out)
+{
+	uint8 d[DIGEST_MAX_SIZE];
+
+	if (dg->tree) {
+		// the last, partial, leaf
+		if (dg->pos % DG_LEAF || !dg->pos) {
+			digest_final(&dg->ctx, d);
+			digest_update(&dg->root, d, digest_size(dg->alg));
+		}
+		digest_final(&dg->root, out);
+	} else
+		digest_final(&dg->ctx, out);
+	free(dg->fillbuf);
+	dg->fillbuf = NULL;
+}
+
+typedef struct
+{
+	io_backend io;
+	io_backend *lower;
+	image_digest *dg;
+} io_digest;
+
+static ssize_t
+dg_write_at(io_backend *io, const void *buf, size_t len, off_t off)
+{
+	io_digest *d = container_of(io, io_digest, io);
+
+	if (off < d->dg->pos)
+		error_msg_and_die("Internal error: out of order digest write");
+	// skipped ranges are holes, or zeros in a stream
+	if (off > d->dg->pos)
+		dg_fill(d->dg, 0, off - d->dg->pos);
+	if (!len)
+		return d->lower->write_at(d->lower, buf, 0, off);
+	dg_update(d->dg, buf, len);
+	io_write(d->lower, buf, len, off);
+	return len;
+}
+
+static ssize_t
+dg_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return dg_write_at(io, iov->iov_base, iov->iov_len, off);
+}
+
+static ssize_t
+dg_read_at(io_backend *io, void *buf, size_t len, off_t off)
+{
+	errno = ESPIPE;
+	return -1;
+}
+
+static int
+dg_truncate(io_backend *io, off_t len)
+{
+	errno = ESPIPE;
+	return -1;
+}
+
+static void
+dg_close(io_backend *io)
+{
+	io_digest *d = container_of(io, io_digest, io);
+
+	if (!d->lower->stream && d->lower->truncate(d->lower, d->dg->pos))
+		perror_msg_and_die("digest: ftruncate");
+	d->lower->close(d->lower);
+	free(d);
+}
+
+// Hash everything written to the returned backend into dg, and pass
+// it on to lower, which is closed with it.  Writes must come in order,
+// like for a stream.
+static io_backend *
+io_open_digest(io_backend *lower, image_digest *dg)
+{
+	io_digest *d = calloc(1, sizeof(*d));
+
+	if (!d)
+		error_msg_and_die(memory_exhausted);
+	d->io.read_at = dg_read_at;
+	d->io.write_at = dg_write_at;
+	d->io.writev_at = dg_writev_at;
+	d->io.truncate = dg_truncate;
+	d->io.punch = stream_punch;
+	d->io.close = dg_close;
+	d->io.fd = -1;
+	d->io.stream = 1;
+	d->lower = lower;
+	d->dg = dg;
+	return &d->io;
+}
+
+int
+is_hardlink(filesystem *fs, ino_t inode)
+{
+	int i;
+
+	for(i = 0; i < fs->hdlinks.count; i++) {
+		if(fs->hdlinks.hdl[i].src_inode == inode)
+			return i;
+	}
+	return -1;
+}
+
+// printf helper macro
+#define plural(a) (a), ((a) == 1) ? "" : "s"
+
+// temporary working block
+static inline uint8 *
+get_workblk(void)
+{
+	unsigned char* b=calloc(1,BLOCKSIZE);
+	if (!b)
+		error_msg_and_die("get_workblk() failed, out of memory");
+	return b;
+}
+static inline void
+free_workblk(block b)
+{
+	free(b);
+}
+
+/* Rounds qty upto a multiple of siz. siz should be a power of 2 */
+static inline uint32
+rndup(uint32 qty, uint32 siz)
+{
+	return (qty + (siz - 1)) & ~(siz - 1);
+}
+
+// check if something is allocated in the bitmap
+static inline uint32
+allocated(block b, uint32 item)
+{
+	return b[(item-1) / 8] & (1 << ((item-1) % 8));
+}
+
+// Start tracking written blocks: the image is known to be all zeros.
+static void
+init_written(filesystem *fs, uint32 nbblocks)
+{
+	fs->nwritten = (nbblocks + BLOCKSIZE * 8 - 1) / (BLOCKSIZE * 8);
+	fs->written = calloc(fs->nwritten, sizeof(*fs->written));
+	if (!fs->written)
+		error_msg_and_die("init_written: out of memory");
+}
+
+// true if the block is known to still be zero on disk
+static inline int
+blk_unwritten(filesystem *fs, uint32 blk)
+{
+	uint8 *map;
+
+	if (!fs->written)
+		return 0;
+	map = fs->written[blk / (BLOCKSIZE * 8)];
+	return !map || !allocated(map, blk % (BLOCKSIZE * 8) + 1);
+}
+
+static void
+mark_written(filesystem *fs, uint32 blk, uint32 count)
+{
+	uint8 **map;
+
+	if (!fs->written)
+		return;
+	for (; count; blk++, count--) {
+		map = &fs->written[blk / (BLOCKSIZE * 8)];
+		if (!*map && !(*map = calloc(1, BLOCKSIZE)))
+			error_msg_and_die("mark_written: out of memory");
+		(*map)[(blk % (BLOCKSIZE * 8)) / 8] |= 1 << (blk % 8);
+	}
+}
+
+// Stop tracking written blocks: from now on every block is read from
+// the image
+static void
+drop_written(filesystem *fs)
+{
+	uint32 i;
+
+	if (!fs->written)
+		return;
+	for (i = 0; i < fs->nwritten; i++)
+		free(fs->written[i]);
+	free(fs->written);
+	fs->written = NULL;
+	fs->nwritten = 0;
+}
+
+// Used by get_blk/put_blk to hold information about a block owned
+// by the user.
+typedef struct
+{
+	cache_link link;
+
+	filesystem *fs;
+	uint32 blk;
+	uint8 *b;
+	uint32 usecount;
+} blk_info;
+
+#define MAX_FREE_CACHE_BLOCKS 100
+
+static uint32
+blk_elem_val(cache_link *elem)
+{
+	blk_info *bi = container_of(elem, blk_info, link);
+	return bi->blk;
+}
+
+static void
+blk_freed(cache_link *elem)
+{
+	blk_info *bi = container_of(elem, blk_info, link);
+
+	if (bi->fs->blks_clean)
+		free(bi->b);
+	else
+		wb_write(bi->fs->wb, bi->fs->io, bi->b, BLOCKSIZE,
+			 ((off_t) bi->blk) * BLOCKSIZE, 1);
+	free(bi);
+}
+
+// How get_blk_op fills in a block that isn't cached yet
+#define BLK_READ	0	// read the current contents
+#define BLK_ZERO	1	// zero it, the caller wants an empty block
+
+// Return a given block from a filesystem.  Make sure to call
+// put_blk when you are done with it.
+static inline uint8 *
+get_blk_op(filesystem *fs, uint32 blk, blk_info **rbi, int op)
+{
+	cache_link *curr;
+	blk_info *bi;
+
+	if (blk >= fs->sb->s_blocks_count)
+		error_msg_and_die("Internal error, block out of range");
+
+	curr = cache_find(&fs->blks, blk);
+	if (curr) {
+		bi = container_of(curr, blk_info, link);
+		bi->usecount++;
+		if (op == BLK_ZERO)
+			memset(bi->b, 0, BLOCKSIZE);
+		goto out;
+	}
+
+	bi = malloc(sizeof(*bi));
+	if (!bi)
+		error_msg_and_die("get_blk: out of memory");
+	bi->fs = fs;
+	bi->blk = blk;
+	bi->usecount = 1;
+	bi->b = malloc(BLOCKSIZE);
+	if (!bi->b)
+		error_msg_and_die("get_blk: out of memory");
+	cache_add(&fs->blks, &bi->link);
+	if (op == BLK_READ && blk_unwritten(fs, blk))
+		op = BLK_ZERO;
+	if (op == BLK_ZERO)
+		memset(bi->b, 0, BLOCKSIZE);
+	else if (op == BLK_READ) {
+		wb_wait_range(fs->wb, ((off_t) blk) * BLOCKSIZE, BLOCKSIZE);
+		io_read(fs->io, bi->b, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+	}
+	// it will be written back when it leaves the cache
+	mark_written(fs, blk, 1);
+
+out:
+	*rbi = bi;
+	return bi->b;
+}
+
+static inline uint8 *
+get_blk(filesystem *fs, uint32 blk, blk_info **rbi)
+{
+	return get_blk_op(fs, blk, rbi, BLK_READ);
+}
+
+static inline void
+put_blk(blk_info *bi)
+{
+	if (bi->usecount == 0)
+		error_msg_and_die("Internal error: put_blk usecount zero");
+	bi->usecount--;
+	if (bi->usecount == 0)
+		/* Free happens in the cache code */
+		cache_item_set_unused(&bi->fs->blks, &bi->link);
+}
+
+typedef struct
+{
+	cache_link link;
+
+	filesystem *fs;
+	int gds;
+	blk_info *bi;
+	groupdescriptor *gd;
+	uint32 usecount;
+} gd_info;
+
+#define MAX_FREE_CACHE_GDS 100
+
+static uint32
+gd_elem_val(cache_link *elem)
+{
+	gd_info *gi = container_of(elem, gd_info, link);
+	return gi->gds;
+}
+
+static void
+gd_freed(cache_link *elem)
+{
+	gd_info *gi = container_of(elem, gd_info, link);
+
+	if (gi->fs->swapit)
+		swap_gd(gi->gd);
+	put_blk(gi->bi);
+	free(gi);
+}
+
+#define GDS_START ((SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE + BLOCKSIZE - 1) / BLOCKSIZE)
+#define GDS_PER_BLOCK (BLOCKSIZE / sizeof(groupdescriptor))
+// the group descriptors are aligned on the block size
+static inline groupdescriptor *
+get_gd(filesystem *fs, uint32 no, gd_info **rgi)
+{
+	uint32 gdblk;
+	uint32 offset;
+	gd_info *gi;
+	cache_link *curr;
+
+	curr = cache_find(&fs->gds, no);
+	if (curr) {
+		gi = container_of(curr, gd_info, link);
+		gi->usecount++;
+		goto out;
+	}
+
+	gi = malloc(sizeof(*gi));
+	if (!gi)
+		error_msg_and_die("get_gd: out of memory");
+	gi->fs = fs;
+	gi->gds = no;
+	gi->usecount = 1;
+	gdblk = GDS_START + (no / GDS_PER_BLOCK);
+	offset = no % GDS_PER_BLOCK;
+	gi->gd = ((groupdescriptor *) get_blk(fs, gdblk, &gi->bi)) + offset;
+	cache_add(&fs->gds, &gi->link);
+	if (fs->swapit)
+		swap_gd(gi->gd);
+ out:
+	*rgi = gi;
+
+	return gi->gd;
+}
+
+static inline void
+put_gd(gd_info *gi)
+{
+	if (gi->usecount == 0)
+		error_msg_and_die("Internal error: put_gd usecount zero");
+
+	gi->usecount--;
+	if (gi->usecount == 0)
+		/* Free happens in the cache code */
+		cache_item_set_unused(&gi->fs->gds, &gi->link);
+}
+
+// Used by get_blkmap/put_blkmap to hold information about an block map
+// owned by the user.
+typedef struct
+{
+	cache_link link;
+
+	filesystem *fs;
+	uint32 blk;
+	uint8 *b;
+	blk_info *bi;
+	uint32 usecount;
+} blkmap_info;
+
+#define MAX_FREE_CACHE_BLOCKMAPS 100
+
+static uint32
+blkmap_elem_val(cache_link *elem)
+{
+	blkmap_info *bmi = container_of(elem, blkmap_info, link);
+	return bmi->blk;
+}
+
+static void
+blkmap_freed(cache_link *elem)
+{
+	blkmap_info *bmi = container_of(elem, blkmap_info, link);
+
+	if (bmi->fs->swapit)
+		swap_block(bmi->b);
+	put_blk(bmi->bi);
+	free(bmi);
+}
+
+// Return a given block map from a filesystem.  Make sure to call
+// put_blkmap when you are done with it.  op is as for get_blk_op.
+static inline uint32 *
+get_blkmap_op(filesystem *fs, uint32 blk, blkmap_info **rbmi, int op)
+{
+	blkmap_info *bmi;
+	cache_link *curr;
+
+	curr = cache_find(&fs->blkmaps, blk);
+	if (curr) {
+		bmi = container_of(curr, blkmap_info, link);
+		bmi->usecount++;
+		if (op == BLK_ZERO)
+			memset(bmi->b, 0, BLOCKSIZE);
+		goto out;
+	}
+
+	bmi = malloc(sizeof(*bmi));
+	if (!bmi)
+		error_msg_and_die("get_blkmap: out of memory");
+	bmi->fs = fs;
+	bmi->blk = blk;
+	bmi->b = get_blk_op(fs, blk, &bmi->bi, op);
+	bmi->usecount = 1;
+	cache_add(&fs->blkmaps, &bmi->link);
+
+	if (fs->swapit)
+		swap_block(bmi->b);
+ out:
+	*rbmi = bmi;
+	return (uint32 *) bmi->b;
+}
+
+static inline uint32 *
+get_blkmap(filesystem *fs, uint32 blk, blkmap_info **rbmi)
+{
+	return get_blkmap_op(fs, blk, rbmi, BLK_READ);
+}
+
+static inline void
+put_blkmap(blkmap_info *bmi)
+{
+	if (bmi->usecount == 0)
+		error_msg_and_die("Internal error: put_blkmap usecount zero");
+
+	bmi->usecount--;
+	if (bmi->usecount == 0)
+		/* Free happens in the cache code */
+		cache_item_set_unused(&bmi->fs->blkmaps, &bmi->link);
+}
+
+// Used by get_nod/put_nod to hold information about an inode owned
+// by the user.
+typedef struct
+{
+	cache_link link;
+
+	filesystem *fs;
+	uint32 nod;
+	uint8 *b;
+	blk_info *bi;
+	inode *itab;
+	uint32 usecount;
+} nod_info;
+
+#define MAX_FREE_CACHE_INODES 100
+
+static uint32
+inode_elem_val(cache_link *elem)
+{
+	nod_info *ni = container_of(elem, nod_info, link);
+	return ni->nod;
+}
+
+static void
+inode_freed(cache_link *elem)
+{
+	nod_info *ni = container_of(elem, nod_info, link);
+
+	if (ni->fs->swapit)
+		swap_nod(ni->itab);
+	put_blk(ni->bi);
+	free(ni);
+}
+
+#define INODES_PER_BLOCK (BLOCKSIZE / sizeof(inode))
+
+// Return a given inode from a filesystem.  Make sure to call
+// put_nod when you are done with it.
+static inline inode *
+get_nod(filesystem *fs, uint32 nod, nod_info **rni)
+{
+	uint32 grp, boffset, offset;
+	cache_link *curr;
+	groupdescriptor *gd;
+	gd_info *gi;
+	nod_info *ni;
+
+	curr = cache_find(&fs->inodes, nod);
+	if (curr) {
+		ni = container_of(curr, nod_info, link);
+		ni->usecount++;
+		goto out;
+	}
+
+	ni = malloc(sizeof(*ni));
+	if (!ni)
+		error_msg_and_die("get_nod: out of memory");
+	ni->fs = fs;
+	ni->nod = nod;
+	ni->usecount = 1;
+	cache_add(&fs->inodes, &ni->link);
+
+	offset = GRP_IBM_OFFSET(fs,nod) - 1;
+	boffset = offset / INODES_PER_BLOCK;
+	offset %= INODES_PER_BLOCK;
+	grp = GRP_GROUP_OF_INODE(fs,nod);
+	gd = get_gd(fs, grp, &gi);
+	ni->b = get_blk(fs, gd->bg_inode_table + boffset, &ni->bi);
+	ni->itab = ((inode *) ni->b) + offset;
+	if (fs->swapit)
+		swap_nod(ni->itab);
+	put_gd(gi);
+ out:
+	*rni = ni;
+	return ni->itab;
+}
+
+static inline void
+put_nod(nod_info *ni)
+{
+	if (ni->usecount == 0)
+		error_msg_and_die("Internal error: put_nod usecount zero");
+
+	ni->usecount--;
+	if (ni->usecount == 0)
+		/* Free happens in the cache code */
+		cache_item_set_unused(&ni->fs->inodes, &ni->link);
+}
+
+// Used to hold state information while walking a directory inode.
+typedef struct
+{
+	directory d;
+	filesystem *fs;
+	uint32 nod;
+	uint8 *last_d;
+	uint8 *b;
+	blk_info *bi;
+	int need_flush;
+} dirwalker;
+
+// Start a directory walk on the given inode.  You must pass in a
+// dirwalker structure, then use that dirwalker for future operations.
+// Call put_dir when you are done walking the directory.
+// After put_dir, do not use the old pointer returned by get_dir or next_dir.
+static inline directory *
+get_dir(filesystem *fs, uint32 nod, dirwalker *dw)
+{
+	dw->fs = fs;
+	dw->b = get_blk(fs, nod, &dw->bi);
+	dw->nod = nod;
+	dw->last_d = dw->b;
+	dw->need_flush = 1;
+
+	memcpy(&dw->d, dw->last_d, sizeof(directory));
+	if (fs->swapit)
+		swap_dir(&dw->d);
+	return &dw->d;
+}
+
+// Move to the next directory.
+static inline directory *
+next_dir(dirwalker *dw)
+{
+	uint8 *next_d = dw->last_d + dw->d.d_rec_len;
+
+	if (dw->need_flush) {
+		if (dw->fs->swapit)
+			swap_dir(&dw->d);
+		memcpy(dw->last_d, &dw->d, sizeof(directory));
+	}
+
+	if (next_d - dw->b >= BLOCKSIZE) {
+		// no more directories in block b
+		dw->need_flush = 0;
+		return NULL;
+	}
+
+	dw->last_d = next_d;
+	memcpy(&dw->d, next_d, sizeof(directory));
+	if (dw->fs->swapit)
+		swap_dir(&dw->d);
+	return &dw->d;
+}
+
+// Call then when you are done with the directory walk.
+static inline void
+put_dir(dirwalker *dw)
+{
+	if (dw->need_flush) {
+		// walk ended before reaching the end of block b
+		if (dw->fs->swapit)
+			swap_dir(&dw->d);
+		memcpy(dw->last_d, &dw->d, sizeof(directory));
+	}
+
+	if (dw->nod == 0)
+		free_workblk(dw->b);
+	else
+		put_blk(dw->bi);
+}
+
+// Create a new directory block with the given inode as it's destination
+// and append it to the current dirwalker.
+static directory *
+new_dir(filesystem *fs, uint32 dnod, const char *name, int nlen, dirwalker *dw)
+{
+	directory *d;
+
+	dw->fs = fs;
+	dw->b = get_workblk();
+	dw->nod = 0;
+	dw->last_d = dw->b;
+	dw->need_flush = 1;
+	d = &dw->d;
+	d->d_inode = dnod;
+	d->d_rec_len = BLOCKSIZE;
+	d->d_name_len = nlen;
+	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+	return d;
+}
+
+// Shrink the current directory entry, make a new one with the free
+// space, and return the new directory entry (making it current).
+static inline directory *
+shrink_dir(dirwalker *dw, uint32 nod, const char *name, int nlen)
+{
+	int reclen, preclen;
+	directory *d = &dw->d;
+
+	reclen = d->d_rec_len;
+	d->d_rec_len = sizeof(directory) + rndup(d->d_name_len, 4);
+	preclen = d->d_rec_len;
+	reclen -= preclen;
+	if (dw->fs->swapit)
+		swap_dir(&dw->d);
+	memcpy(dw->last_d, &dw->d, sizeof(directory));
+
+	dw->last_d = dw->last_d + preclen;
+	d->d_rec_len = reclen;
+	d->d_inode = nod;
+	d->d_name_len = nlen;
+	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+
+	return d;
+}
+
+// Return the current block the directory is walking
+static inline uint8 *
+dir_data(dirwalker *dw)
+{
+	return dw->b;
+}
+
+// Return the pointer to the name for the current directory
+static inline char *
+dir_name(dirwalker *dw)
+{
+	return ((char *) dw->last_d) + sizeof(directory);
+}
+
+// Set the name for the current directory.  Note that this doesn't
+// verify that there is space for the directory name, you must do
+// that yourself.
+static void
+dir_set_name(dirwalker *dw, const char *name, int nlen)
+{
+	dw->d.d_name_len = nlen;
+	strncpy(((char *) dw->last_d) + sizeof(directory), name, nlen);
+}
+
+// allocate a given block/inode in the bitmap
+// allocate first free if item == 0
+static uint32
+allocate(block b, uint32 item)
+{
+	if(!item)
+	{
+		int i;
+		uint8 bits;
+		for(i = 0; i < BLOCKSIZE; i++)
+			if((bits = b[i]) != (uint8)-1)
+			{
+				int j;
+				for(j = 0; j < 8; j++)
+					if(!(bits & (1 << j)))
+						break;
+				item = i * 8 + j + 1;
+				break;
+			}
+		if(i == BLOCKSIZE)
+			return 0;
+	}
+	b[(item-1) / 8] |= (1 << ((item-1) % 8));
+	return item;
+}
+
+// deallocate a given block/inode
+static void
+deallocate(block b, uint32 item)
+{
+	b[(item-1) / 8] &= ~(1 << ((item-1) % 8));
+}
+
+// set (val != 0) or clear the items first to last (inclusive) in the
+// bitmap, a byte at a time except for the partial bytes at the edges
+static void
+bitmap_range(block b, uint32 first, uint32 last, int val)
+{
+	uint32 s = first - 1, e = last;	// bits [s, e)
+	uint8 mask;
+
+	if(first > last)
+		return;
+	if(s / 8 == (e - 1) / 8) {
+		mask = (0xff << (s % 8)) & (0xff >> (7 - (e - 1) % 8));
+		if(val)
+			b[s / 8] |= mask;
+		else
+			b[s / 8] &= ~mask;
+		return;
+	}
+	if(s % 8) {
+		mask = 0xff << (s % 8);
+		if(val)
+			b[s / 8] |= mask;
+		else
+			b[s / 8] &= ~mask;
+		s += 8 - s % 8;
+	}
+	if(e % 8) {
+		mask = 0xff >> (8 - e % 8);
+		if(val)
+			b[e / 8] |= mask;
+		else
+			b[e / 8] &= ~mask;
+		e -= e % 8;
+	}
+	if(e > s)
+		memset(b + s / 8, val ? 0xff : 0, (e - s) / 8);
+}
+
+// allocate the items first to last (inclusive) in the bitmap
+static inline void
+allocate_range(block b, uint32 first, uint32 last)
+{
+	bitmap_range(b, first, last, 1);
+}
+
+// deallocate the items first to last (inclusive) in the bitmap
+static inline void
+deallocate_range(block b, uint32 first, uint32 last)
+{
+	bitmap_range(b, first, last, 0);
+}
+
+// return the first item from item to last (inclusive) whose bit is
+// set (val != 0) or clear, or last + 1 if there is none; whole bytes
+// that can't match are skipped
+static uint32
+bitmap_find(block b, uint32 item, uint32 last, int val)
+{
+	uint8 skip = val ? 0 : 0xff;
+
+	while(item <= last) {
+		if((item - 1) % 8 == 0 && b[(item - 1) / 8] == skip) {
+			item += 8;
+			continue;
+		}
+		if(!allocated(b, item) == !val)
+			return item;
+		item++;
+	}
+	return last + 1;
+}
+
+/* Layout of a previous image (--layout-from).  The paths that are still
+   there get their old inode number back, and their blocks are handed
+   out again in the order they were allocated in, so an unchanged file
+   ends up where it was.  Until then, the inodes and blocks used in the
+   old image are set aside: marked allocated, and only given to the
+   path that had them.  Whatever is left is released at the end, or
+   as soon as there is nothing else free. */
+
+struct layout_ent
+{
+	uint32 parent;	// directory in the old image
+	uint32 ino;
+	uint32 name;	// offset in names
+	uint32 len;
+	uint32 next;	// next in the hash chain, plus one
+};
+
+typedef struct layout
+{
+	filesystem *old;
+	// the directory entries of the old image, hashed by parent and name
+	struct layout_ent *ents;
+	uint32 nents, maxents;
+	uint32 *hash;	// first entry of each chain, plus one
+	uint32 hmask;
+	char *names;
+	uint32 nnames, maxnames;
+	// for each new inode, the inode of the same path in the old image
+	// (or 0) and how many blocks it has been given
+	uint32 *old_of;
+	uint32 *pos;
+	// blocks of old_of[cur] in the order they were allocated
+	uint32 cur;
+	uint32 *seq;
+	uint32 nseq, maxseq;
+	// set aside: blocks by number from s_first_data_block, inodes
+	uint8 *rblk;
+	uint8 *rnod;
+	uint32 nrblk, nrnod;
+} layout;
+
+static uint32
+layout_hash(uint32 parent, const char *name, uint32 len)
+{
+	uint32 h = 2166136261u ^ parent;
+
+	while (len--)
+		h = (h ^ (uint8) *name++) * 16777619u;
+	return h;
+}
+
+// the inode of name in the old image, in the directory that was at the
+// place of parent_nod, or 0
+static uint32
+layout_lookup(filesystem *fs, uint32 parent_nod, const char *name)
+{
+	layout *l = fs->layout;
+	struct layout_ent *e;
+	uint32 len, i, parent;
+
+	if (!l || !(parent = l->old_of[parent_nod]))
+		return 0;
+	len = strlen(name);
+	for (i = l->hash[layout_hash(parent, name, len) & l->hmask]; i; i = e->next) {
+		e = &l->ents[i - 1];
+		if (e->parent == parent && e->len == len &&
+		    !memcmp(l->names + e->name, name, len))
+			return e->ino;
+	}
+	return 0;
+}
+
+// nod has been made for the path of the old inode old_nod (or 0)
+static void
+layout_map(filesystem *fs, uint32 nod, uint32 old_nod)
+{
+	layout *l = fs->layout;
+
+	if (!l)
+		return;
+	l->old_of[nod] = old_nod;
+	l->pos[nod] = 0;
+	if (l->cur == nod)
+		l->cur = 0;
+}
+
+static void
+layout_push(layout *l, uint32 blk)
+{
+	if (l->nseq == l->maxseq) {
+		l->maxseq = l->maxseq ? l->maxseq * 2 : 64;
+		if (!(l->seq = realloc(l->seq, l->maxseq * sizeof(*l->seq))))
+			error_msg_and_die(memory_exhausted);
+	}
+	l->seq[l->nseq++] = blk;
+}
+
+// an indirect block of the given depth and what it points to, in the
+// order walk_bw allocates them
+static void
+layout_push_ind(layout *l, uint32 blk, int depth)
+{
+	blkmap_info *bmi;
+	uint32 *b;
+	int i;
+
+	if (!blk || blk >= l->old->sb->s_blocks_count)
+		return;
+	layout_push(l, blk);
+	b = get_blkmap(l->old, blk, &bmi);
+	for (i = 0; i < BLOCKSIZE / 4; i++) {
+		if (depth > 1)
+			layout_push_ind(l, b[i], depth - 1);
+		else if (b[i] && b[i] < l->old->sb->s_blocks_count)
+			layout_push(l, b[i]);
+	}
+	put_blkmap(bmi);
+}
+
+// gather the blocks the old inode of nod had
+static void
+layout_seq(layout *l, uint32 nod)
+{
+	nod_info *ni;
+	inode *node = get_nod(l->old, l->old_of[nod], &ni);
+	int i;
+
+	l->cur = nod;
+	l->nseq = 0;
+	// devices and fast symlinks keep other things in i_block
+	if (node->i_blocks) {
+		for (i = 0; i < EXT2_IND_BLOCK; i++)
+			if (node->i_block[i] &&
+			    node->i_block[i] < l->old->sb->s_blocks_count)
+				layout_push(l, node->i_block[i]);
+		layout_push_ind(l, node->i_block[EXT2_IND_BLOCK], 1);
+		layout_push_ind(l, node->i_block[EXT2_DIND_BLOCK], 2);
+		layout_push_ind(l, node->i_block[EXT2_TIND_BLOCK], 3);
+	}
+	put_nod(ni);
+}
+
+// the next block nod had in the old image, if it's still set aside;
+// it's already counted as allocated
+static uint32
+layout_blk(filesystem *fs, uint32 nod)
+{
+	layout *l = fs->layout;
+	uint32 k, bk;
+
+	if (!l->nrblk || !l->old_of[nod])
+		return 0;
+	if (l->cur != nod)
+		layout_seq(l, nod);
+	if ((k = l->pos[nod]++) >= l->nseq)
+		return 0;
+	bk = l->seq[k];
+	if (bk < fs->sb->s_first_data_block || bk >= fs->sb->s_blocks_count ||
+	    !allocated(l->rblk, bk - fs->sb->s_first_data_block + 1))
+		return 0;
+	deallocate(l->rblk, bk - fs->sb->s_first_data_block + 1);
+	l->nrblk--;
+	return bk;
+}
+
+// the old inode number, if it's still set aside
+static uint32
+layout_nod(filesystem *fs, uint32 old_nod)
+{
+	layout *l = fs->layout;
+
+	if (!old_nod || old_nod > fs->sb->s_inodes_count ||
+	    !allocated(l->rnod, old_nod))
+		return 0;
+	deallocate(l->rnod, old_nod);
+	l->nrnod--;
+	return old_nod;
+}
+
+// free what is still set aside
+static void
+layout_release(filesystem *fs)
+{
+	layout *l = fs->layout;
+	uint32 grp, nbgroups = GRP_NBGROUPS(fs), first, last, i;
+	uint32 bpg = fs->sb->s_blocks_per_group;
+	uint32 ipg = fs->sb->s_inodes_per_group;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	block b;
+
+	for (grp = 0; grp < nbgroups && (l->nrblk || l->nrnod); grp++) {
+		gd = get_gd(fs, grp, &gi);
+		first = grp * bpg + 1;
+		last = first + bpg - 1;
+		if (last > fs->sb->s_blocks_count - fs->sb->s_first_data_block)
+			last = fs->sb->s_blocks_count - fs->sb->s_first_data_block;
+		b = GRP_GET_GROUP_BBM(fs, gd, &bi);
+		for (i = bitmap_find(l->rblk, first, last, 1); i <= last;
+		     i = bitmap_find(l->rblk, i + 1, last, 1)) {
+			deallocate(b, i - grp * bpg);
+			deallocate(l->rblk, i);
+			gd->bg_free_blocks_count++;
+			fs->sb->s_free_blocks_count++;
+			l->nrblk--;
+		}
+		GRP_PUT_GROUP_BBM(bi);
+		first = grp * ipg + 1;
+		last = first + ipg - 1;
+		b = GRP_GET_GROUP_IBM(fs, gd, &bi);
+		for (i = bitmap_find(l->rnod, first, last, 1); i <= last;
+		     i = bitmap_find(l->rnod, i + 1, last, 1)) {
+			deallocate(b, i - grp * ipg);
+			deallocate(l->rnod, i);
+			gd->bg_free_inodes_count++;
+			fs->sb->s_free_inodes_count++;
+			l->nrnod--;
+		}
+		GRP_PUT_GROUP_IBM(bi);
+		put_gd(gi);
+	}
+}
+
+// allocate the first free block (or inode, if inodes is set) from n
+// on, or return 0 if there is none
+static uint32
+alloc_after(filesystem *fs, uint32 n, int inodes)
+{
+	uint32 first = inodes ? 1 : fs->sb->s_first_data_block;
+	uint32 per = inodes ? fs->sb->s_inodes_per_group :
+			      fs->sb->s_blocks_per_group;
+	uint32 grp, item, nbgroups = GRP_NBGROUPS(fs);
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	block b;
+
+	if (n < first)
+		n = first;
+	for (grp = (n - first) / per, item = (n - first) % per + 1;
+	     grp < nbgroups; grp++, item = 1) {
+		gd = get_gd(fs, grp, &gi);
+		if (inodes ? gd->bg_free_inodes_count : gd->bg_free_blocks_count) {
+			b = inodes ? GRP_GET_GROUP_IBM(fs, gd, &bi) :
+				     GRP_GET_GROUP_BBM(fs, gd, &bi);
+			if ((item = bitmap_find(b, item, per, 0)) <= per)
+				allocate(b, item);
+			put_blk(bi);
+			if (item <= per) {
+				if (inodes) {
+					gd->bg_free_inodes_count--;
+					fs->sb->s_free_inodes_count--;
+				} else {
+					gd->bg_free_blocks_count--;
+					fs->sb->s_free_blocks_count--;
+				}
+				put_gd(gi);
+				return first + grp * per + item - 1;
+			}
+		}
+		put_gd(gi);
+	}
+	return 0;
+}
+
+#define ALLOC_SPREAD	0	// inodes spread across the groups
+#define ALLOC_ORLOV	1	// only top level directories are spread
+
+// set by --alloc-policy
+static int alloc_policy;
+
+// set by --inline-indirect: the blocks of a file, indirect ones
+// included, are allocated one after the other, so that each indirect
+// block comes right before the data it maps and the file is read in
+// one forward sweep
+static int inline_indirect;
+
+// allocate a block
+static uint32
+alloc_blk(filesystem *fs, uint32 nod)
+{
+	uint32 bk=0;
+	uint32 grp,nbgroups;
+	blk_info *bi;
+	groupdescriptor *gd;
+	gd_info *gi;
+	int next;
+
+	// from the previous block, if it goes on from there
+	next = fs->sequential || fs->align_nod == nod ||
+	       (inline_indirect && fs->last_nod == nod);
+	fs->last_nod = nod;
+	if (fs->layout) {
+		if ((bk = layout_blk(fs, nod))) {
+			fs->next_blk = bk + 1;
+			return bk;
+		}
+		// nothing else left
+		if (!fs->sb->s_free_blocks_count && fs->layout->nrblk)
+			layout_release(fs);
+	}
+	if (next && (bk = alloc_after(fs, fs->next_blk, 0))) {
+		fs->next_blk = bk + 1;
+		return bk;
+	}
+	// in the inode's group, or the closest one after it
+	if (alloc_policy == ALLOC_ORLOV &&
+	    ((bk = alloc_after(fs, fs->sb->s_first_data_block +
+			       GRP_GROUP_OF_INODE(fs, nod) * fs->sb->s_blocks_per_group, 0)) ||
+	     (bk = alloc_after(fs, 0, 0)))) {
+		fs->next_blk = bk + 1;
+		return bk;
+	}
+	grp = GRP_GROUP_OF_INODE(fs,nod);
+	nbgroups = GRP_NBGROUPS(fs);
+	gd = get_gd(fs, grp, &gi);
+	bk = allocate(GRP_GET_GROUP_BBM(fs, gd, &bi), 0);
+	GRP_PUT_GROUP_BBM(bi);
+	put_gd(gi);
+	if (!bk) {
+		for (grp=0; grp<nbgroups && !bk; grp++) {
+			gd = get_gd(fs, grp, &gi);
+			bk = allocate(GRP_GET_GROUP_BBM(fs, gd, &bi), 0);
+			GRP_PUT_GROUP_BBM(bi);
+			put_gd(gi);
+		}
+		grp--;
+	}
+	if (!bk)
+		error_msg_and_die("couldn't allocate a block (no free space)");
+	gd = get_gd(fs, grp, &gi);
+	if(!(gd->bg_free_blocks_count--))
+		error_msg_and_die("group descr %d. free blocks count == 0 (corrupted fs?)",grp);
+	put_gd(gi);
+	if(!(fs->sb->s_free_blocks_count--))
+		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
+	bk = fs->sb->s_first_data_block + fs->sb->s_blocks_per_group*grp + (bk-1);
+	fs->next_blk = bk + 1;
+	return bk;
+}
+
+// free a block
+static void
+free_blk(filesystem *fs, uint32 bk)
+{
+	uint32 grp;
+	blk_info *bi;
+	gd_info *gi;
+	groupdescriptor *gd;
+
+	grp = GRP_GROUP_OF_BLOCK(fs, bk);
+	gd = get_gd(fs, grp, &gi);
+	deallocate(GRP_GET_GROUP_BBM(fs, gd, &bi), GRP_BBM_OFFSET(fs, bk));
+	GRP_PUT_GROUP_BBM(bi);
+	gd->bg_free_blocks_count++;
+	put_gd(gi);
+	fs->sb->s_free_blocks_count++;
+}
+
+// The group of a new inode in parent_nod with the Orlov allocator, as
+// in find_group_orlov in fs/ext2/ialloc.c: top level directories go to
+// the group with the fewest directories among those with more free
+// inodes and blocks than average, other directories to the first group
+// from the parent's that has not much less than that, and anything else
+// to the first one from the parent's with free inodes (and blocks).
+static uint32
+orlov_group(filesystem *fs, uint32 parent_nod, int dir)
+{
+	uint32 nbgroups = GRP_NBGROUPS(fs), pgrp, grp, i, best = -1;
+	uint32 avefreei = fs->sb->s_free_inodes_count / nbgroups;
+	uint32 avefreeb = fs->sb->s_free_blocks_count / nbgroups;
+	uint32 mini = avefreei - avefreei / 4, minb = avefreeb - avefreeb / 4;
+	uint32 bestdirs = -1;
+	groupdescriptor *gd;
+	gd_info *gi;
+
+	pgrp = GRP_GROUP_OF_INODE(fs, parent_nod);
+	if (dir && parent_nod == EXT2_ROOT_INO) {
+		for (grp = 0; grp < nbgroups; grp++) {
+			gd = get_gd(fs, grp, &gi);
+			if (gd->bg_free_inodes_count && gd->bg_free_inodes_count >= avefreei &&
+			    gd->bg_free_blocks_count >= avefreeb &&
+			    gd->bg_used_dirs_count < bestdirs) {
+				best = grp;
+				bestdirs = gd->bg_used_dirs_count;
+			}
+			put_gd(gi);
+		}
+		if (best != (uint32) -1)
+			return best;
+	} else if (dir) {
+		for (i = 0; i < nbgroups; i++) {
+			grp = (pgrp + i) % nbgroups;
+			gd = get_gd(fs, grp, &gi);
+			if (gd->bg_free_inodes_count && gd->bg_free_inodes_count >= mini &&
+			    gd->bg_free_blocks_count >= minb)
+				best = grp;
+			put_gd(gi);
+			if (best != (uint32) -1)
+				return best;
+		}
+	}
+	// with free blocks if possible, otherwise just a free inode
+	for (i = 0; i < 2 * nbgroups; i++) {
+		grp = (pgrp + i) % nbgroups;
+		gd = get_gd(fs, grp, &gi);
+		if (gd->bg_free_inodes_count &&
+		    (i >= nbgroups || gd->bg_free_blocks_count))
+			best = grp;
+		put_gd(gi);
+		if (best != (uint32) -1)
+			return best;
+	}
+	return pgrp;
+}
+
+// allocate an inode in parent_nod, old_nod if it's set aside for it
+// (see layout_nod)
+static uint32
+alloc_nod(filesystem *fs, uint32 parent_nod, int dir, uint32 old_nod)
+{
+	uint32 nod,best_group=0;
+	uint32 grp,nbgroups,avefreei;
+	blk_info *bi;
+	gd_info *gi, *bestgi;
+	groupdescriptor *gd, *bestgd;
+
+	if (fs->layout) {
+		if ((nod = layout_nod(fs, old_nod)))
+			return nod;
+		if (!fs->sb->s_free_inodes_count && fs->layout->nrnod)
+			layout_release(fs);
+	}
+	if (fs->sequential && (nod = alloc_after(fs, fs->next_nod, 1))) {
+		fs->next_nod = nod + 1;
+		return nod;
+	}
+	nbgroups = GRP_NBGROUPS(fs);
+	if (alloc_policy == ALLOC_ORLOV) {
+		best_group = orlov_group(fs, parent_nod, dir);
+		bestgd = get_gd(fs, best_group, &bestgi);
+		goto found;
+	}
+
+	/* Distribute inodes amongst all the blocks                           */
+	/* For every block group with more than average number of free inodes */
+	/* find the one with the most free blocks and allocate node there     */
+	/* Idea from find_group_dir in fs/ext2/ialloc.c in 2.4.19 kernel      */
+	/* We do it for all inodes.                                           */
+	avefreei  =  fs->sb->s_free_inodes_count / nbgroups;
+	bestgd = get_gd(fs, best_group, &bestgi);
+	for(grp=0; grp<nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		if (gd->bg_free_inodes_count < avefreei ||
+		    gd->bg_free_inodes_count == 0) {
+			put_gd(gi);
+			continue;
+		}
+		if (!best_group || gd->bg_free_blocks_count > bestgd->bg_free_blocks_count) {
+			put_gd(bestgi);
+			best_group = grp;
+			bestgd = gd;
+			bestgi = gi;
+		} else
+			put_gd(gi);
+	}
+found:
+	if (!(nod = allocate(GRP_GET_GROUP_IBM(fs, bestgd, &bi), 0)))
+		error_msg_and_die("couldn't allocate an inode (no free inode)");
+	GRP_PUT_GROUP_IBM(bi);
+	if(!(bestgd->bg_free_inodes_count--))
+		error_msg_and_die("group descr. free blocks count == 0 (corrupted fs?)");
+	put_gd(bestgi);
+	if(!(fs->sb->s_free_inodes_count--))
+		error_msg_and_die("superblock free blocks count == 0 (corrupted fs?)");
+	nod += fs->sb->s_inodes_per_group*best_group;
+	fs->next_nod = nod + 1;
+	return nod;
+}
+
+// print a bitmap allocation
+static void
+print_bm(block b, uint32 max)
+{
+	uint32 i;
+	printf("----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8----+----9----+----0\n");
+	for(i=1; i <= max; i++)
+	{
+		putchar(allocated(b, i) ? '*' : '.');
+		if(!(i % 100))
+			printf("\n");
+	}
+	if((i-1) % 100)
+		printf("\n");
+}
+
+// initalize a blockwalker (iterator for blocks list)
+static inline void
+init_bw(blockwalker *bw)
+{
+	bw->bnum = 0;
+	bw->bpdir = EXT2_INIT_BLOCK;
+}
+
+// return next block of inode (WALK_END for end)
+// if *create>0, append a newly allocated block at the end
+// if *create<0, free the block - warning, the metadata blocks contents is
+//				  used after being freed, so once you start
+//				  freeing blocks don't stop until the end of
+//				  the file. moreover, i_blocks isn't updated.
+// if hole!=0, create a hole in the file
+static uint32
+walk_bw(filesystem *fs, uint32 nod, blockwalker *bw, int32 *create, uint32 hole)
+{
+	uint32 *bkref = 0;
+	uint32 bk = 0;
+	blkmap_info *bmi1 = NULL, *bmi2 = NULL, *bmi3 = NULL;
+	uint32 *b;
+	int extend = 0, reduce = 0;
+	int newmap = BLK_READ;
+	inode *inod;
+	nod_info *ni;
+	uint32 *iblk;
+
+	if(create && (*create) < 0)
+		reduce = 1;
+	inod = get_nod(fs, nod, &ni);
+	if(bw->bnum >= inod->i_blocks / INOBLK)
+	{
+		if(create && (*create) > 0)
+		{
+			(*create)--;
+			extend = 1;
+			// indirect blocks allocated below start out empty
+			newmap = BLK_ZERO;
+		}
+		else
+		{
+			put_nod(ni);
+			return WALK_END;
+		}
+	}
+	iblk = inod->i_block;
+	// first direct block
+	if(bw->bpdir == EXT2_INIT_BLOCK)
+	{
+		bkref = &iblk[bw->bpdir = 0];
+		if(extend) // allocate first block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	// direct block
+	else if(bw->bpdir < EXT2_NDIR_BLOCKS)
+	{
+		bkref = &iblk[++bw->bpdir];
+		if(extend) // allocate block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free block
+			free_blk(fs, *bkref);
+	}
+	// first block in indirect block
+	else if(bw->bpdir == EXT2_NDIR_BLOCKS)
+	{
+		bw->bnum++;
+		bw->bpdir = EXT2_IND_BLOCK;
+		bw->bpind = 0;
+		if(extend) // allocate indirect block
+			iblk[bw->bpdir] = alloc_blk(fs,nod);
+		if(reduce) // free indirect block
+			free_blk(fs, iblk[bw->bpdir]);
+		b = get_blkmap_op(fs, iblk[bw->bpdir], &bmi1, newmap);
+		bkref = &b[bw->bpind];
+		if(extend) // allocate first block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	// block in indirect block
+	else if((bw->bpdir == EXT2_IND_BLOCK) && (bw->bpind < BLOCKSIZE/4 - 1))
+	{
+		bw->bpind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		bkref = &b[bw->bpind];
+		if(extend) // allocate block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free block
+			free_blk(fs, *bkref);
+	}
+	// first block in first indirect block in first double indirect block
+	else if(bw->bpdir == EXT2_IND_BLOCK)
+	{
+		bw->bnum += 2;
+		bw->bpdir = EXT2_DIND_BLOCK;
+		bw->bpind = 0;
+		bw->bpdind = 0;
+		if(extend) // allocate double indirect block
+			iblk[bw->bpdir] = alloc_blk(fs,nod);
+		if(reduce) // free double indirect block
+			free_blk(fs, iblk[bw->bpdir]);
+		b = get_blkmap_op(fs, iblk[bw->bpdir], &bmi1, newmap);
+		if(extend) // allocate first indirect block
+			b[bw->bpind] = alloc_blk(fs,nod);
+		if(reduce) // free  firstindirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpind], &bmi2, newmap);
+		bkref = &b[bw->bpdind];
+		if(extend) // allocate first block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	// block in indirect block in double indirect block
+	else if((bw->bpdir == EXT2_DIND_BLOCK) && (bw->bpdind < BLOCKSIZE/4 - 1))
+	{
+		bw->bpdind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		bkref = &b[bw->bpdind];
+		if(extend) // allocate block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free block
+			free_blk(fs, *bkref);
+	}
+	// first block in indirect block in double indirect block
+	else if((bw->bpdir == EXT2_DIND_BLOCK) && (bw->bpind < BLOCKSIZE/4 - 1))
+	{
+		bw->bnum++;
+		bw->bpdind = 0;
+		bw->bpind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		if(extend) // allocate indirect block
+			b[bw->bpind] = alloc_blk(fs,nod);
+		if(reduce) // free indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpind], &bmi2, newmap);
+		bkref = &b[bw->bpdind];
+		if(extend) // allocate first block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+
+	/* Adding support for triple indirection */
+	/* Just starting triple indirection. Allocate the indirection
+	   blocks and the first data block
+	 */
+	else if (bw->bpdir == EXT2_DIND_BLOCK) 
+	{
+	  	bw->bnum += 3;
+		bw->bpdir = EXT2_TIND_BLOCK;
+		bw->bpind = 0;
+		bw->bpdind = 0;
+		bw->bptind = 0;
+		if(extend) // allocate triple indirect block
+			iblk[bw->bpdir] = alloc_blk(fs,nod);
+		if(reduce) // free triple indirect block
+			free_blk(fs, iblk[bw->bpdir]);
+		b = get_blkmap_op(fs, iblk[bw->bpdir], &bmi1, newmap);
+		if(extend) // allocate first double indirect block
+			b[bw->bpind] = alloc_blk(fs,nod);
+		if(reduce) // free first double indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpind], &bmi2, newmap);
+		if(extend) // allocate first indirect block
+			b[bw->bpdind] = alloc_blk(fs,nod);
+		if(reduce) // free first indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpdind], &bmi3, newmap);
+		bkref = &b[bw->bptind];
+		if(extend) // allocate first data block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	/* Still processing a single indirect block down the indirection
+	   chain.Allocate a data block for it
+	 */
+	else if ( (bw->bpdir == EXT2_TIND_BLOCK) && 
+		  (bw->bptind < BLOCKSIZE/4 -1) )
+	{
+		bw->bptind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		b = get_blkmap(fs, b[bw->bpdind], &bmi3);
+		bkref = &b[bw->bptind];
+		if(extend) // allocate data block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free block
+			free_blk(fs, *bkref);
+	}
+	/* Finished processing a single indirect block. But still in the 
+	   same double indirect block. Allocate new single indirect block
+	   for it and a data block
+	 */
+	else if ( (bw->bpdir == EXT2_TIND_BLOCK) &&
+		  (bw->bpdind < BLOCKSIZE/4 -1) )
+	{
+		bw->bnum++;
+		bw->bptind = 0;
+		bw->bpdind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		b = get_blkmap(fs, b[bw->bpind], &bmi2);
+		if(extend) // allocate single indirect block
+			b[bw->bpdind] = alloc_blk(fs,nod);
+		if(reduce) // free indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpdind], &bmi3, newmap);
+		bkref = &b[bw->bptind];
+		if(extend) // allocate first data block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	/* Finished processing a double indirect block. Allocate the next
+	   double indirect block and the single,data blocks for it
+	 */
+	else if ( (bw->bpdir == EXT2_TIND_BLOCK) && 
+		  (bw->bpind < BLOCKSIZE/4 - 1) )
+	{
+		bw->bnum += 2;
+		bw->bpdind = 0;
+		bw->bptind = 0;
+		bw->bpind++;
+		b = get_blkmap(fs, iblk[bw->bpdir], &bmi1);
+		if(extend) // allocate double indirect block
+			b[bw->bpind] = alloc_blk(fs,nod);
+		if(reduce) // free double indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpind], &bmi2, newmap);
+		if(extend) // allocate single indirect block
+			b[bw->bpdind] = alloc_blk(fs,nod);
+		if(reduce) // free indirect block
+			free_blk(fs, b[bw->bpind]);
+		b = get_blkmap_op(fs, b[bw->bpdind], &bmi3, newmap);
+		bkref = &b[bw->bptind];
+		if(extend) // allocate first block
+			*bkref = hole ? 0 : alloc_blk(fs,nod);
+		if(reduce) // free first block
+			free_blk(fs, *bkref);
+	}
+	else
+		error_msg_and_die("file too big !"); 
+	/* End change for walking triple indirection */
+
+	bk = *bkref;
+	if (bmi3)
+		put_blkmap(bmi3);
+	if (bmi2)
+		put_blkmap(bmi2);
+	if (bmi1)
+		put_blkmap(bmi1);
+
+	if(bk)
+	{
+		blk_info *bi;
+		gd_info *gi;
+		uint8 *block;
+		bw->bnum++;
+		block = GRP_GET_BLOCK_BITMAP(fs,bk,&bi,&gi);
+		if(!reduce && !allocated(block, GRP_BBM_OFFSET(fs,bk)))
+			error_msg_and_die("[block %d of inode %d is unallocated !]", bk, nod);
+		GRP_PUT_BLOCK_BITMAP(bi, gi);
+	}
+	if(extend)
+		inod->i_blocks = bw->bnum * INOBLK;
+	put_nod(ni);
+	return bk;
+}
+
+typedef struct
+{
+	blockwalker bw;
+	uint32 nod;
+	nod_info *ni;
+	inode *inod;
+} inode_pos;
+#define INODE_POS_TRUNCATE 0
+#define INODE_POS_EXTEND 1
+
+// Call this to set up an ipos structure for future use with
+// extend_inode_blk to append blocks to the given inode.  If
+// op is INODE_POS_TRUNCATE, the inode is truncated to zero size.
+// If op is INODE_POS_EXTEND, the position is moved to the end
+// of the inode's data blocks.
+// Call inode_pos_finish when done with the inode_pos structure.
+static void
+inode_pos_init(filesystem *fs, inode_pos *ipos, uint32 nod, int op,
+	       blockwalker *endbw)
+{
+	blockwalker lbw;
+
+	init_bw(&ipos->bw);
+	ipos->nod = nod;
+	ipos->inod = get_nod(fs, nod, &ipos->ni);
+	if (op == INODE_POS_TRUNCATE) {
+		int32 create = -1;
+		while(walk_bw(fs, nod, &ipos->bw, &create, 0) != WALK_END)
+			/*nop*/;
+		ipos->inod->i_blocks = 0;
+	}
+
+	if (endbw)
+		ipos->bw = *endbw;
+	else {
+		/* Seek to the end */
+		init_bw(&ipos->bw);
+		lbw = ipos->bw;
+		while(walk_bw(fs, nod, &ipos->bw, 0, 0) != WALK_END)
+			lbw = ipos->bw;
+		ipos->bw = lbw;
+	}
+}
+
+// Clean up the inode_pos structure.
+static void
+inode_pos_finish(filesystem *fs, inode_pos *ipos)
+{
+	put_nod(ipos->ni);
+}
+
+// Write count consecutive data blocks starting at bk straight to the
+// image, bypassing the block cache.  Data blocks are written once and
+// never read back, so there is no point reading them in first or
+// keeping them around.  Blocks that happen to be cached already are
+// updated in the cache instead, so a later eviction doesn't undo the
+// write.
+static void
+put_data_blks(filesystem *fs, uint32 bk, uint8 *b, uint32 count)
+{
+	uint32 i, start = 0;
+	cache_link *curr;
+	blk_info *bi;
+
+	if (bk + count > fs->sb->s_blocks_count)
+		error_msg_and_die("Internal error, block out of range");
+
+	for (i = 0; i <= count; i++) {
+		curr = (i < count) ? cache_find(&fs->blks, bk + i) : NULL;
+		if (i < count && !curr)
+			continue;
+		if (i > start && fs->data_src >= 0)
+			plan_add_ref(fs->io, bk + start, i - start, fs->data_src,
+				     fs->data_off + (b + start * BLOCKSIZE - fs->data_buf));
+		else if (i > start)
+			wb_write(fs->wb, fs->io, b + start * BLOCKSIZE,
+				 (i - start) * BLOCKSIZE,
+				 ((off_t) bk + start) * BLOCKSIZE, 0);
+		// --shrink may read them back
+		if (i > start)
+			mark_written(fs, bk + start, i - start);
+		if (curr) {
+			bi = container_of(curr, blk_info, link);
+			bi->usecount++;
+			memcpy(bi->b, b + i * BLOCKSIZE, BLOCKSIZE);
+			put_blk(bi);
+		}
+		start = i + 1;
+	}
+}
+
+// add blocks to an inode (file/dir/etc...) at the given position.
+// This will only work when appending to the end of an inode.
+static void
+extend_inode_blk(filesystem *fs, inode_pos *ipos, block b, int amount)
+{
+	uint32 bk;
+	uint32 pos;
+	uint32 run_bk = 0, run_pos = 0, run_len = 0;
+
+	if (amount < 0)
+		error_msg_and_die("extend_inode_blk: Got negative amount");
+
+	for (pos = 0; amount; pos += BLOCKSIZE)
+	{
+		int hole = (fs->holes && is_blk_empty(b + pos));
+
+		bk = walk_bw(fs, ipos->nod, &ipos->bw, &amount, hole);
+		if (bk == WALK_END)
+			error_msg_and_die("extend_inode_blk: extend failed");
+		if (hole)
+			continue;
+		// gather consecutive blocks into a single write
+		if (run_len && (bk != run_bk + run_len ||
+				pos != run_pos + run_len * BLOCKSIZE)) {
+			put_data_blks(fs, run_bk, b + run_pos, run_len);
+			run_len = 0;
+		}
+		if (!run_len) {
+			run_bk = bk;
+			run_pos = pos;
+		}
+		run_len++;
+	}
+	if (run_len)
+		put_data_blks(fs, run_bk, b + run_pos, run_len);
+}
+
+// link an entry (inode #) to a directory
+static void
+add2dir(filesystem *fs, uint32 dnod, uint32 nod, const char* name)
+{
+	blockwalker bw, lbw;
+	uint32 bk;
+	directory *d;
+	dirwalker dw;
+	int reclen, nlen;
+	inode *node;
+	inode *pnode;
+	nod_info *dni, *ni;
+	inode_pos ipos;
+
+	pnode = get_nod(fs, dnod, &dni);
+	if((pnode->i_mode & FM_IFMT) != FM_IFDIR)
+		error_msg_and_die("can't add '%s' to a non-directory", name);
+	if(!*name)
+		error_msg_and_die("can't create an inode with an empty name");
+	if(strchr(name, '/'))
+		error_msg_and_die("bad name '%s' (contains a slash)", name);
+	nlen = strlen(name);
+	reclen = sizeof(directory) + rndup(nlen, 4);
+	if(reclen > BLOCKSIZE)
+		error_msg_and_die("bad name '%s' (too long)", name);
+	init_bw(&bw);
+	lbw = bw;
+	while((bk = walk_bw(fs, dnod, &bw, 0, 0)) != WALK_END) // for all blocks in dir
+	{
+		// for all dir entries in block
+		for(d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
+		{
+			// if empty dir entry, large enough, use it
+			if((!d->d_inode) && (d->d_rec_len >= reclen))
+			{
+				d->d_inode = nod;
+				node = get_nod(fs, nod, &ni);
+				dir_set_name(&dw, name, nlen);
+				put_dir(&dw);
+				node->i_links_count++;
+				put_nod(ni);
+				goto out;
+			}
+			// if entry with enough room (last one?), shrink it & use it
+			if(d->d_rec_len >= (sizeof(directory) + rndup(d->d_name_len, 4) + reclen))
+			{
+				d = shrink_dir(&dw, nod, name, nlen);
+				put_dir(&dw);
+				node = get_nod(fs, nod, &ni);
+				node->i_links_count++;
+				put_nod(ni);
+				goto out;
+			}
+		}
+		put_dir(&dw);
+		lbw = bw;
+	}
+	// we found no free entry in the directory, so we add a block
+	node = get_nod(fs, nod, &ni);
+	d = new_dir(fs, nod, name, nlen, &dw);
+	node->i_links_count++;
+	put_nod(ni);
+	next_dir(&dw); // Force the data into the buffer
+
+	inode_pos_init(fs, &ipos, dnod, INODE_POS_EXTEND, &lbw);
+	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
+	inode_pos_finish(fs, &ipos);
+
+	put_dir(&dw);
+	pnode->i_size += BLOCKSIZE;
+out:
+	put_nod(dni);
+}
+
+// find an entry in a directory
+static uint32
+find_dir(filesystem *fs, uint32 nod, const char * name)
+{
+	blockwalker bw;
+	uint32 bk;
+	int nlen = strlen(name);
+	init_bw(&bw);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+	{
+		directory *d;
+		dirwalker dw;
+		for (d = get_dir(fs, bk, &dw); d; d=next_dir(&dw))
+			if(d->d_inode && (nlen == d->d_name_len) && !strncmp(dir_name(&dw), name, nlen)) {
+				uint32 result = d->d_inode;
+				put_dir(&dw);
+				return result;
+			}
+		put_dir(&dw);
+	}
+	return 0;
+}
+
+// find the inode of a full path
+static uint32
+find_path(filesystem *fs, uint32 nod, const char * name)
+{
+	char *p, *n, *n2 = xstrdup(name);
+	n = n2;
+	while(*n == '/')
+	{
+		nod = EXT2_ROOT_INO;
+		n++;
+	}
+	while(*n)
+	{
+		if((p = strchr(n, '/')))
+			(*p) = 0;
+		if(!(nod = find_dir(fs, nod, n)))
+			break;
+		if(p)
+			n = p + 1;
+		else
+			break;
+	}
+	free(n2);
+	return nod;
+}
+
+// chmod an inode
+void
+chmod_fs(filesystem *fs, uint32 nod, uint16 mode, uint16 uid, uint16 gid)
+{
+	inode *node;
+	nod_info *ni;
+	node = get_nod(fs, nod, &ni);
+	node->i_mode = (node->i_mode & ~FM_IMASK) | (mode & FM_IMASK);
+	node->i_uid = uid;
+	node->i_gid = gid;
+	put_nod(ni);
+}
+
+// create a simple inode
+static uint32
+mknod_fs(filesystem *fs, uint32 parent_nod, const char *name, uint16 mode, uint16 uid, uint16 gid, uint8 major, uint8 minor, uint32 ctime, uint32 mtime)
+{
+	uint32 nod;
+	inode *node;
+	nod_info *ni;
+	gd_info *gi;
+	uint32 old_nod = layout_lookup(fs, parent_nod, name);
+
+	nod = alloc_nod(fs, parent_nod, (mode & FM_IFMT) == FM_IFDIR, old_nod);
+	layout_map(fs, nod, old_nod);
+	node = get_nod(fs, nod, &ni);
+	node->i_mode = mode;
+	add2dir(fs, parent_nod, nod, name);
+	switch(mode & FM_IFMT)
+	{
+	case FM_IFLNK:
+		mode = FM_IFLNK | FM_IRWXU | FM_IRWXG | FM_IRWXO;
+		break;
+	case FM_IFBLK:
+	case FM_IFCHR:
+		if (fs->swapit) {
+			((uint8*)node->i_block)[3] = minor;
+			((uint8*)node->i_block)[2] = major;
+		} else {
+			((uint8*)node->i_block)[0] = minor;
+			((uint8*)node->i_block)[1] = major;
+		}
+		break;
+	case FM_IFDIR:
+		add2dir(fs, nod, nod, ".");
+		add2dir(fs, nod, parent_nod, "..");
+		get_gd(fs,GRP_GROUP_OF_INODE(fs,nod),&gi)->bg_used_dirs_count++;
+		put_gd(gi);
+		break;
+	}
+	node->i_uid = uid;
+	node->i_gid = gid;
+	node->i_atime = mtime;
+	node->i_ctime = ctime;
+	node->i_mtime = mtime;
+	put_nod(ni);
+	return nod;
+}
+
+// make a full-fledged directory (i.e. with "." & "..")
+static inline uint32
+mkdir_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode,
+	uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+{
+	return mknod_fs(fs, parent_nod, name, mode|FM_IFDIR, uid, gid, 0, 0, ctime, mtime);
+}
+
+// byte swapping for symlinks
+static inline void
+swab32_into(uint32 *dst, uint32 *src, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n; i++)
+		dst[i] = swab32(src[i]);
+}
+
+// make a symlink
+static uint32
+mklink_fs(filesystem *fs, uint32 parent_nod, const char *name, size_t size, uint8 *b, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+{
+	uint32 nod = mknod_fs(fs, parent_nod, name, FM_IFLNK | FM_IRWXU | FM_IRWXG | FM_IRWXO, uid, gid, 0, 0, ctime, mtime);
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	inode_pos ipos;
+
+	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
+	node->i_size = size;
+
+	if (size < 4 * (EXT2_TIND_BLOCK + 1))
+		if (fs->swapit)
+			swab32_into(node->i_block, (uint32 *)b, EXT2_TIND_BLOCK + 1);
+		else
+			memcpy(node->i_block, b, 4 * (EXT2_TIND_BLOCK + 1));
+	else
+		extend_inode_blk(fs, &ipos, b, rndup(size, BLOCKSIZE) / BLOCKSIZE);
+
+	inode_pos_finish(fs, &ipos);
+	put_nod(ni);
+	return nod;
+}
+
+static void
+fs_upgrade_rev1_largefile(filesystem *fs)
+{
+	fs->sb->s_rev_level = 1;
+	fs->sb->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+	fs->sb->s_inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+}
+
+#define COPY_BLOCKS 16
+#define CB_SIZE (COPY_BLOCKS * BLOCKSIZE)
+
+// set by --align and --align-threshold: the data of regular files of
+// at least align_threshold bytes starts at a multiple of align bytes
+// in the image, for flash erase blocks or RAID stripes
+static uint32 align;
+static off_t align_threshold = -1;
+
+// what was aligned, for the report
+static struct
+{
+	uint32 files;	// files big enough
+	uint32 count;	// files aligned
+	uint32 *starts;	// their first block
+} aligned;
+
+// whether the count blocks from bk are all free
+static int
+blks_free(filesystem *fs, uint32 bk, uint32 count)
+{
+	uint32 first = fs->sb->s_first_data_block;
+	uint32 bpg = fs->sb->s_blocks_per_group;
+	uint32 grp, item, last;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	int used;
+
+	if (bk < first || bk + count > fs->sb->s_blocks_count)
+		return 0;
+	while (count) {
+		grp = (bk - first) / bpg;
+		item = (bk - first) % bpg + 1;
+		last = item + count - 1;
+		if (last > bpg)
+			last = bpg;
+		gd = get_gd(fs, grp, &gi);
+		used = bitmap_find(GRP_GET_GROUP_BBM(fs, gd, &bi), item, last, 1) <= last;
+		GRP_PUT_GROUP_BBM(bi);
+		put_gd(gi);
+		if (used)
+			return 0;
+		count -= last - item + 1;
+		bk += last - item + 1;
+	}
+	return 1;
+}
+
+// make the data of nod, of size bytes, start on an aligned block with
+// free blocks after it for the file or up to the next aligned block,
+// looking from the group of nod on, then from the start.  The blocks
+// before it are left for the small files.
+static void
+align_file(filesystem *fs, uint32 nod, off_t size)
+{
+	uint32 step = align / BLOCKSIZE, count, from, bk;
+	int pass;
+
+	aligned.files++;
+	count = size / BLOCKSIZE < step ? (size + BLOCKSIZE - 1) / BLOCKSIZE : step;
+	from = fs->sb->s_first_data_block +
+	       GRP_GROUP_OF_INODE(fs, nod) * fs->sb->s_blocks_per_group;
+	for (pass = 0; pass < 2; pass++, from = 0)
+		for (bk = (from + step - 1) / step * step;
+		     bk + count <= fs->sb->s_blocks_count; bk += step)
+			if (blks_free(fs, bk, count)) {
+				fs->align_nod = nod;
+				fs->next_blk = bk;
+				return;
+			}
+}
+
+// count nod in the report if its data did start on the aligned block
+static void
+align_done(filesystem *fs, uint32 nod, inode *node)
+{
+	if (fs->align_nod != nod)
+		return;
+	fs->align_nod = 0;
+	if (!node->i_block[0] || node->i_block[0] % (align / BLOCKSIZE))
+		return;
+	if (!(aligned.count % 64)) {
+		aligned.starts = realloc(aligned.starts,
+					 (aligned.count + 64) * sizeof(uint32));
+		if (!aligned.starts)
+			error_msg_and_die(memory_exhausted);
+	}
+	aligned.starts[aligned.count++] = node->i_block[0];
+}
+
+// make a file from a FILE*
+static uint32
+mkfile_fs(filesystem *fs, uint32 parent_nod, const char *name, uint32 mode, FILE *f, uid_t uid, gid_t gid, uint32 ctime, uint32 mtime)
+{
+	uint8 * b;
+	uint32 nod = mknod_fs(fs, parent_nod, name, mode|FM_IFREG, uid, gid, 0, 0, ctime, mtime);
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	off_t size = 0;
+	size_t readbytes;
+	inode_pos ipos;
+	int fullsize;
+	struct stat st;
+
+	b = malloc(CB_SIZE);
+	if (!b)
+		error_msg_and_die("mkfile_fs: out of memory");
+	if (align > BLOCKSIZE && !fstat(fileno(f), &st) &&
+	    st.st_size && st.st_size >= align_threshold)
+		align_file(fs, nod, st.st_size);
+	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
+	// a planned image reads the data again from the file at the end
+	if (io_is_plan(fs->io))
+		fs->data_src = plan_add_source(fs->io, fileno(f));
+	fs->data_buf = b;
+	readbytes = fread(b, 1, CB_SIZE, f);
+	while (readbytes) {
+		fullsize = rndup(readbytes, BLOCKSIZE);
+		// Fill to end of block with zeros.
+		memset(b + readbytes, 0, fullsize - readbytes);
+		fs->data_off = size;
+		extend_inode_blk(fs, &ipos, b, fullsize / BLOCKSIZE);
+		size += readbytes;
+		readbytes = fread(b, 1, CB_SIZE, f);
+	}
+	fs->data_src = -1;
+	if (size > 0x7fffffff) {
+		if (fs->sb->s_rev_level < 1)
+			fs_upgrade_rev1_largefile(fs);
+		fs->sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	}
+	node->i_dir_acl = size >> 32;
+	node->i_size = size;
+	inode_pos_finish(fs, &ipos);
+	align_done(fs, nod, node);
+	put_nod(ni);
+	free(b);
+	return nod;
+}
+
+// retrieves a mode info from a struct stat
+static uint32
+get_mode(struct stat *st)
+{
+	uint32 mode = 0;
+
+	if(st->st_mode & S_IRUSR)
+		mode |= FM_IRUSR;
+	if(st->st_mode & S_IWUSR)
+		mode |= FM_IWUSR;
+	if(st->st_mode & S_IXUSR)
+		mode |= FM_IXUSR;
+	if(st->st_mode & S_IRGRP)
+		mode |= FM_IRGRP;
+	if(st->st_mode & S_IWGRP)
+		mode |= FM_IWGRP;
+	if(st->st_mode & S_IXGRP)
+		mode |= FM_IXGRP;
+	if(st->st_mode & S_IROTH)
+		mode |= FM_IROTH;
+	if(st->st_mode & S_IWOTH)
+		mode |= FM_IWOTH;
+	if(st->st_mode & S_IXOTH)
+		mode |= FM_IXOTH;
+	if(st->st_mode & S_ISUID)
+		mode |= FM_ISUID;
+	if(st->st_mode & S_ISGID)
+		mode |= FM_ISGID;
+	if(st->st_mode & S_ISVTX)
+		mode |= FM_ISVTX;
+	return mode;
+}
+
+// add or fixup entries to the filesystem from a text file
+/*  device table entries take the form of:
+    <path>	<type> <mode>	<uid>	<gid>	<major>	<minor>	<start>	<inc>	<count>
+    /dev/mem     c    640       0       0         1       1       0     0         -
+
+    type can be one of: 
+	f	A regular file
+	d	Directory
+	c	Character special device file
+	b	Block special device file
+	p	Fifo (named pipe)
+
+    I don't bother with symlinks (permissions are irrelevant), hard
+    links (special cases of regular files), or sockets (why bother).
+
+    Regular files must exist in the target root directory.  If a char,
+    block, fifo, or directory does not exist, it will be created.
+*/
+
+/* Sizing, for the first pass of populate_fs.  The blocks are counted as
+   they are allocated: the data, the indirect blocks walk_bw adds for it,
+   and directories that grow a block at a time. */
+
+// the blocks of a file of n data blocks, with its indirect blocks
+static unsigned long
+file_blocks(unsigned long n)
+{
+	unsigned long p = BLOCKSIZE / 4, t = n;
+
+	if (n <= EXT2_IND_BLOCK)
+		return t;
+	n -= EXT2_IND_BLOCK;
+	t++;
+	if (n <= p)
+		return t;
+	n -= p;
+	if (n <= p * p)
+		return t + 1 + (n + p - 1) / p;
+	t += 1 + p;
+	n -= p * p;
+	return t + 1 + (n + p * p - 1) / (p * p) + (n + p - 1) / p;
+}
+
+// the room left in each block of a directory: like add2dir does, an
+// entry goes in the first block it fits in, or in a new one
+typedef struct
+{
+	uint16 *room;
+	uint32 n, max;
+	uint32 full;	// the blocks before have no room for any entry
+} dir_size;
+
+// a directory of one block, used bytes of it taken
+static void
+dir_size_init(dir_size *ds, uint32 used)
+{
+	ds->room = NULL;
+	ds->n = ds->max = ds->full = 0;
+	if (used) {
+		ds->room = malloc((ds->max = 16) * sizeof(*ds->room));
+		if (!ds->room)
+			error_msg_and_die(memory_exhausted);
+		ds->room[ds->n++] = BLOCKSIZE - used;
+	}
+}
+
+static void
+dir_size_add(dir_size *ds, const char *name)
+{
+	uint32 reclen = sizeof(directory) + rndup(strlen(name), 4), i;
+
+	for (; ds->full < ds->n && ds->room[ds->full] < sizeof(directory) + 4; ds->full++)
+		;
+	for (i = ds->full; i < ds->n; i++)
+		if (ds->room[i] >= reclen) {
+			ds->room[i] -= reclen;
+			return;
+		}
+	if (ds->n == ds->max) {
+		ds->max = ds->max ? ds->max * 2 : 16;
+		ds->room = realloc(ds->room, ds->max * sizeof(*ds->room));
+		if (!ds->room)
+			error_msg_and_die(memory_exhausted);
+	}
+	ds->room[ds->n++] = BLOCKSIZE - reclen;
+}
+
+// the blocks of the directory
+static unsigned long
+dir_size_done(dir_size *ds)
+{
+	free(ds->room);
+	return file_blocks(ds->n);
+}
+
+struct stats_link
+{
+	ino_t ino;
+	unsigned long nblocks;
+};
+
+// count a file that may be a hard link (see add2fs_entry)
+static void
+stats_link(struct stats *stats, ino_t ino, unsigned long nblocks)
+{
+	if (!(stats->nlinks % 64)) {
+		stats->links = realloc(stats->links, (stats->nlinks + 64) * sizeof(*stats->links));
+		if (!stats->links)
+			error_msg_and_die(memory_exhausted);
+	}
+	stats->links[stats->nlinks].ino = ino;
+	stats->links[stats->nlinks++].nblocks = nblocks;
+}
+
+static int
+stats_link_cmp(const void *a, const void *b)
+{
+	ino_t ia = ((const struct stats_link *) a)->ino;
+	ino_t ib = ((const struct stats_link *) b)->ino;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+// take out the hard links counted more than once
+static void
+stats_links(struct stats *stats)
+{
+	unsigned long i;
+
+	if (stats->nlinks)
+		qsort(stats->links, stats->nlinks, sizeof(*stats->links), stats_link_cmp);
+	for (i = 1; i < stats->nlinks; i++)
+		if (stats->links[i].ino == stats->links[i - 1].ino) {
+			stats->nblocks -= stats->links[i].nblocks;
+			stats->ninodes--;
+		}
+	free(stats->links);
+	stats->links = NULL;
+	stats->nlinks = 0;
+}
+
+// the directories a device table adds to, to size them: those made
+// before are taken as new, which may count a block too many
+struct dev_dir
+{
+	char *path;
+	dir_size ds;
+	struct dev_dir *next;
+};
+
+static dir_size *
+dev_dir(struct dev_dir **list, const char *dir, const char *name)
+{
+	struct dev_dir *d;
+	char *path;
+
+	if (!(path = malloc(strlen(dir) + (name ? strlen(name) : 0) + 2)))
+		error_msg_and_die(memory_exhausted);
+	sprintf(path, name ? "%s/%s" : "%s", dir, name);
+	// "/dev", "dev" and "./dev/" are the same
+	while (*path == '/' || (path[0] == '.' && (path[1] == '/' || !path[1])))
+		memmove(path, path + 1, strlen(path));
+	while (*path && path[strlen(path) - 1] == '/')
+		path[strlen(path) - 1] = 0;
+	for (d = *list; d; d = d->next)
+		if (!strcmp(d->path, path)) {
+			free(path);
+			return &d->ds;
+		}
+	if (!(d = malloc(sizeof(*d))))
+		error_msg_and_die(memory_exhausted);
+	d->path = path;
+	dir_size_init(&d->ds, 24);
+	d->next = *list;
+	*list = d;
+	return &d->ds;
+}
+
+static void
+add2fs_from_file(filesystem *fs, uint32 this_nod, FILE * fh, uint32 fs_timestamp, struct stats *stats)
+{
+	struct dev_dir *dirs = NULL, *d;
+	unsigned long mode, uid, gid, major, minor;
+	unsigned long start, increment, count;
+	uint32 nod, ctime, mtime;
+	char *c, type, *path = NULL, *path2 = NULL, *dir, *name, *line = NULL;
+	size_t len;
+	struct stat st;
+	int nbargs, lineno = 0;
+
+	fstat(fileno(fh), &st);
+	ctime = fs_timestamp;
+	mtime = st.st_mtime;
+	while(getline(&line, &len, fh) >= 0)
+	{
+		mode = uid = gid = major = minor = 0;
+		start = 0; increment = 1; count = 0;
+		lineno++;
+		if((c = strchr(line, '#')))
+			*c = 0;
+		if (path) {
+			free(path);
+			path = NULL;
+		}
+		if (path2) {
+			free(path2);
+			path2 = NULL;
+		}
+		nbargs = sscanf (line, "%" SCANF_PREFIX "s %c %lo %lu %lu %lu %lu %lu %lu %lu",
+					SCANF_STRING(path), &type, &mode, &uid, &gid, &major, &minor,
+					&start, &increment, &count);
+		if(nbargs < 3)
+		{
+			if(nbargs > 0)
+				error_msg("device table line %d skipped: bad format for entry '%s'", lineno, path);
+			continue;
+		}
+		mode &= FM_IMASK;
+		path2 = strdup(path);
+		name = basename(path);
+		dir = dirname(path2);
+		if((!strcmp(name, ".")) || (!strcmp(name, "..")))
+		{
+			error_msg("device table line %d skipped", lineno);
+			continue;
+		}
+		if(fs)
+		{
+			if(!(nod = find_path(fs, this_nod, dir)))
+			{
+				error_msg("device table line %d skipped: can't find directory '%s' to create '%s''", lineno, dir, name);
+				continue;
+			}
+		}
+		else
+			nod = 0;
+		switch (type)
+		{
+			case 'd':
+				mode |= FM_IFDIR;
+				break;
+			case 'f':
+				mode |= FM_IFREG;
+				break;
+			case 'p':
+				mode |= FM_IFIFO;
+				break;
+			case 's':
+				mode |= FM_IFSOCK;
+				break;
+			case 'c':
+				mode |= FM_IFCHR;
+				break;
+			case 'b':
+				mode |= FM_IFBLK;
+				break;
+			default:
+				error_msg("device table line %d skipped: bad type '%c' for entry '%s'", lineno, type, name);
+				continue;
+		}
+		if(stats) {
+			dir_size *ds = dev_dir(&dirs, dir, NULL);
+			if(count > 0)
+			{
+				char *dname;
+				unsigned long i;
+				unsigned len;
+				len = strlen(name) + 10;
+				dname = malloc(len + 1);
+				stats->ninodes += count - start;
+				for(i = start; i < count; i++)
+				{
+					SNPRINTF(dname, len, "%s%lu", name, i);
+					dir_size_add(ds, dname);
+				}
+				free(dname);
+			}
+			else
+			{
+				stats->ninodes++;
+				dir_size_add(ds, name);
+			}
+			if(type == 'd')
+				dev_dir(&dirs, dir, name);
+		} else {
+			if(count > 0)
+			{
+				char *dname;
+				unsigned long i;
+				unsigned len;
+				len = strlen(name) + 10;
+				dname = malloc(len + 1);
+				for(i = start; i < count; i++)
+				{
+					uint32 oldnod;
+					SNPRINTF(dname, len, "%s%lu", name, i);
+					oldnod = find_dir(fs, nod, dname);
+					if(oldnod)
+						chmod_fs(fs, oldnod, mode, uid, gid);
+					else
+						mknod_fs(fs, nod, dname, mode, uid, gid, major, minor + (i * increment - start), ctime, mtime);
+				}
+				free(dname);
+			}
+			else
+			{
+				uint32 oldnod = find_dir(fs, nod, name);
+				if(oldnod)
+					chmod_fs(fs, oldnod, mode, uid, gid);
+				else
+					mknod_fs(fs, nod, name, mode, uid, gid, major, minor, ctime, mtime);
+			}
+		}
+	}
+	while((d = dirs))
+	{
+		stats->nblocks += dir_size_done(&d->ds);
+		dirs = d->next;
+		free(d->path);
+		free(d);
+	}
+	if (line)
+		free(line);
+	if (path) 
+		free(path);
+	if (path2)
+		free(path2);
+}
+
+/* The source directories are read once: each directory's entries and
+   their lstat() are kept for both passes over the tree (counting, then
+   adding), and sorted there if requested, so the image doesn't depend
+   on the order readdir() returns them in. */
+
+#define SORT_NONE	0	// readdir() order
+#define SORT_NAME	1	// by name, after those in the --sort-file list
+
+// set by --sort
+static int sort_mode;
+
+// the --sort-file list, sorted by path for lookups
+typedef struct
+{
+	char *path;	// in the image, without the leading '/'
+	uint32 rank;	// line in the list
+} sort_item;
+
+static sort_item *sort_list;
+static uint32 sort_count;
+
+// the --order-file list, in its order
+static char **order_list;
+static uint32 order_count;
+
+typedef struct src_dir src_dir;
+
+typedef struct
+{
+	char *name;
+	struct stat st;
+	uint32 rank;	// in the --sort-file list, or -1
+	src_dir *dir;	// contents of a directory, once read
+	uint32 nod;	// inode, once added ahead of the rest (add2fs_order)
+} src_ent;
+
+struct src_dir
+{
+	char *path;	// in the image, without the leading '/'
+	uint32 n;
+	src_ent *ents;
+};
+
+static int
+sort_item_cmp(const void *a, const void *b)
+{
+	const sort_item *x = a, *y = b;
+	int r = strcmp(x->path, y->path);
+
+	if (r)
+		return r;
+	return (x->rank > y->rank) - (x->rank < y->rank);
+}
+
+// read a list of paths in the image, one per line, without the
+// leading and trailing '/'
+static char **
+read_paths(const char *fname, uint32 *count)
+{
+	FILE *fh = xfopen(fname, "r");
+	char *line = NULL, *p, **paths = NULL;
+	size_t len = 0;
+	uint32 max = 0;
+	ssize_t r;
+
+	*count = 0;
+	while ((r = getline(&line, &len, fh)) >= 0) {
+		while (r > 0 && (line[r - 1] == '\n' || line[r - 1] == '\r' ||
+				 line[r - 1] == '/'))
+			line[--r] = 0;
+		for (p = line; *p == '/'; p++)
+			;
+		if (!*p)
+			continue;
+		if (*count == max) {
+			max = max ? max * 2 : 256;
+			if (!(paths = realloc(paths, max * sizeof(*paths))))
+				error_msg_and_die(memory_exhausted);
+		}
+		paths[(*count)++] = xstrdup(p);
+	}
+	free(line);
+	fclose(fh);
+	return paths;
+}
+
+// read the --sort-file list
+static void
+sort_load(const char *fname)
+{
+	char **paths = read_paths(fname, &sort_count);
+	uint32 i, n;
+
+	if (sort_count &&
+	    !(sort_list = malloc(sort_count * sizeof(*sort_list))))
+		error_msg_and_die(memory_exhausted);
+	for (i = 0; i < sort_count; i++) {
+		sort_list[i].path = paths[i];
+		sort_list[i].rank = i;
+	}
+	free(paths);
+	// a path listed twice keeps its first place
+	qsort(sort_list, sort_count, sizeof(*sort_list), sort_item_cmp);
+	for (i = n = 0; i < sort_count; i++) {
+		if (n && !strcmp(sort_list[n - 1].path, sort_list[i].path)) {
+			free(sort_list[i].path);
+			continue;
+		}
+		sort_list[n++] = sort_list[i];
+	}
+	sort_count = n;
+}
+
+// the place of path in the --sort-file list, or -1
+static uint32
+sort_rank(const char *path)
+{
+	uint32 lo = 0, hi = sort_count, mid;
+	int r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (!(r = strcmp(path, sort_list[mid].path)))
+			return sort_list[mid].rank;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+static int
+src_ent_cmp(const void *a, const void *b)
+{
+	const src_ent *x = a, *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return strcmp(x->name, y->name);
+}
+
+// the path in the image of name in dir
+static char *
+src_path(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *p = malloc(dlen + nlen + 2);
+
+	if (!p)
+		error_msg_and_die(memory_exhausted);
+	memcpy(p, dir, dlen);
+	if (dlen)
+		p[dlen++] = '/';
+	memcpy(p + dlen, name, nlen + 1);
+	return p;
+}
+
+// read the current directory, which is path in the image
+static src_dir *
+src_read(const char *path)
+{
+	src_dir *sd = calloc(1, sizeof(*sd));
+	uint32 max = 0;
+	char *p;
+	struct dirent *dent;
+	src_ent *e;
+	DIR *dh;
+
+	if (!sd)
+		error_msg_and_die(memory_exhausted);
+	while (*path == '/')
+		path++;
+	sd->path = xstrdup(path);
+	for (p = sd->path + strlen(sd->path); p > sd->path && p[-1] == '/'; )
+		*--p = 0;
+	if(!(dh = opendir(".")))
+		perror_msg_and_die(".");
+	while((dent = readdir(dh)))
+	{
+		if((!strcmp(dent->d_name, ".")) || (!strcmp(dent->d_name, "..")))
+			continue;
+		if (sd->n == max) {
+			max = max ? max * 2 : 16;
+			if (!(sd->ents = realloc(sd->ents, max * sizeof(*sd->ents))))
+				error_msg_and_die(memory_exhausted);
+		}
+		e = &sd->ents[sd->n++];
+		e->name = xstrdup(dent->d_name);
+		lstat(e->name, &e->st);
+		e->rank = -1;
+		e->dir = NULL;
+		e->nod = 0;
+		if (sort_count) {
+			p = src_path(sd->path, e->name);
+			e->rank = sort_rank(p);
+			free(p);
+		}
+	}
+	closedir(dh);
+	if (sort_mode == SORT_NAME)
+		qsort(sd->ents, sd->n, sizeof(*sd->ents), src_ent_cmp);
+	return sd;
+}
+
+// the contents of the directory e of sd, which is the current directory
+static src_dir *
+src_subdir(src_dir *sd, src_ent *e)
+{
+	if (!e->dir) {
+		char *p = src_path(sd->path, e->name);
+		e->dir = src_read(p);
+		free(p);
+	}
+	return e->dir;
+}
+
+static void
+src_free(src_dir *sd)
+{
+	uint32 i;
+
+	if (!sd)
+		return;
+	for (i = 0; i < sd->n; i++) {
+		free(sd->ents[i].name);
+		src_free(sd->ents[i].dir);
+	}
+	free(sd->ents);
+	free(sd->path);
+	free(sd);
+}
+
+// the blocks of a directory with the entries of sd, added to one that
+// has used bytes of its first block taken already
+static unsigned long
+dir_blocks(src_dir *sd, uint32 used)
+{
+	dir_size ds;
+	uint32 i;
+
+	dir_size_init(&ds, used);
+	for (i = 0; i < sd->n; i++)
+		dir_size_add(&ds, sd->ents[i].name);
+	return dir_size_done(&ds);
+}
+
+static void add2fs_from_dir(filesystem *fs, uint32 this_nod, src_dir *sd, int squash_uids, int squash_perms, uint32 fs_timestamp, struct stats *stats);
+
+// adds the entry dent of the current directory, whose contents are sd,
+// to this_nod, with its contents if it's a directory and recurse is
+// set; returns its inode, or 0 if it was ignored
+static uint32
+add2fs_entry(filesystem *fs, uint32 this_nod, src_dir *sd, src_ent *dent, int recurse, int squash_uids, int squash_perms, uint32 fs_timestamp)
+{
+	uint32 nod = 0;
+	uint32 uid, gid, mode, ctime, mtime;
+	const char *name;
+	FILE *fh;
+	struct stat st = dent->st;
+	char *lnk;
+	uint32 save_nod;
+
+	uid = st.st_uid;
+	gid = st.st_gid;
+	ctime = fs_timestamp;
+	mtime = st.st_mtime;
+	name = dent->name;
+	mode = get_mode(&st);
+	if(squash_uids)
+		uid = gid = 0;
+	if(squash_perms)
+		mode &= ~(FM_IRWXG | FM_IRWXO);
+	if((nod = find_dir(fs, this_nod, name)))
+	{
+		error_msg("ignoring duplicate entry %s", name);
+		if(S_ISDIR(st.st_mode) && recurse) {
+			if(chdir(dent->name) < 0)
+				perror_msg_and_die(name);
+			add2fs_from_dir(fs, nod, src_subdir(sd, dent), squash_uids, squash_perms, fs_timestamp, NULL);
+			if (chdir("..") == -1)
+				perror_msg_and_die("..");
+		}
+		return nod;
+	}
+	save_nod = 0;
+	/* Check for hardlinks */
+	if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode) && st.st_nlink > 1) {
+		int32 hdlink = is_hardlink(fs, st.st_ino);
+		if (hdlink >= 0) {
+			add2dir(fs, this_nod, fs->hdlinks.hdl[hdlink].dst_nod, name);
+			return fs->hdlinks.hdl[hdlink].dst_nod;
+		} else {
+			save_nod = 1;
+		}
+	}
+	switch(st.st_mode & S_IFMT)
+	{
+#if HAVE_STRUCT_STAT_ST_RDEV
+		case S_IFCHR:
+			nod = mknod_fs(fs, this_nod, name, mode|FM_IFCHR, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
+			break;
+		case S_IFBLK:
+			nod = mknod_fs(fs, this_nod, name, mode|FM_IFBLK, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
+			break;
+#endif
+		case S_IFIFO:
+			nod = mknod_fs(fs, this_nod, name, mode|FM_IFIFO, uid, gid, 0, 0, ctime, mtime);
+			break;
+		case S_IFSOCK:
+			nod = mknod_fs(fs, this_nod, name, mode|FM_IFSOCK, uid, gid, 0, 0, ctime, mtime);
+			break;
+		case S_IFLNK:
+			lnk = calloc(1, rndup(st.st_size, BLOCKSIZE));
+			if (lnk == NULL)
+				error_msg_and_die(memory_exhausted);
+			if (readlink(dent->name, lnk, st.st_size) > 0)
+				nod = mklink_fs(fs, this_nod, name, st.st_size, (uint8*)lnk, uid, gid, ctime, mtime);
+			else
+				error_msg("readlink: %s", dent->name);
+			free(lnk);
+			break;
+		case S_IFREG:
+			fh = fopen(dent->name, "rb");
+			if (!fh) {
+				error_msg("Unable to open file %s", dent->name);
+				break;
+			}
+			nod = mkfile_fs(fs, this_nod, name, mode, fh, uid, gid, ctime, mtime);
+			fclose(fh);
+			break;
+		case S_IFDIR:
+			nod = mkdir_fs(fs, this_nod, name, mode, uid, gid, ctime, mtime);
+			if(!recurse)
+				break;
+			if(chdir(dent->name) < 0)
+				perror_msg_and_die(name);
+			add2fs_from_dir(fs, nod, src_subdir(sd, dent), squash_uids, squash_perms, fs_timestamp, NULL);
+			if (chdir("..") == -1)
+				perror_msg_and_die("..");
+			break;
+		default:
+			error_msg("ignoring entry %s", name);
+	}
+	if (save_nod) {
+		if (fs->hdlinks.count == fs->hdlink_cnt) {
+			if ((fs->hdlinks.hdl =
+				 realloc (fs->hdlinks.hdl, (fs->hdlink_cnt + HDLINK_CNT) *
+						  sizeof (struct hdlink_s))) == NULL) {
+				error_msg_and_die("Not enough memory");
+			}
+			fs->hdlink_cnt += HDLINK_CNT;
+		}
+		fs->hdlinks.hdl[fs->hdlinks.count].src_inode = st.st_ino;
+		fs->hdlinks.hdl[fs->hdlinks.count].dst_nod = nod;
+		fs->hdlinks.count++;
+	}
+	return nod;
+}
+
+// adds a tree of entries to the filesystem from current dir, whose
+// contents are sd
+static void
+add2fs_from_dir(filesystem *fs, uint32 this_nod, src_dir *sd, int squash_uids, int squash_perms, uint32 fs_timestamp, struct stats *stats)
+{
+	src_ent *dent;
+	struct stat st;
+	uint32 i;
+
+	for(i = 0; i < sd->n; i++)
+	{
+		unsigned long nblocks = 0;
+		src_dir *sub;
+
+		dent = &sd->ents[i];
+		st = dent->st;
+		if(stats)
+			switch(st.st_mode & S_IFMT)
+			{
+				case S_IFLNK:
+					// fast symlinks are kept in the inode
+					if(st.st_size >= 4 * (EXT2_TIND_BLOCK+1))
+						stats->nblocks += file_blocks((st.st_size + BLOCKSIZE - 1) / BLOCKSIZE);
+					stats->ninodes++;
+					break;
+				case S_IFREG:
+					nblocks = file_blocks((st.st_size + BLOCKSIZE - 1) / BLOCKSIZE);
+					stats->nblocks += nblocks;
+				case S_IFCHR:
+				case S_IFBLK:
+				case S_IFIFO:
+				case S_IFSOCK:
+					stats->ninodes++;
+					if(st.st_nlink > 1)
+						stats_link(stats, st.st_ino, nblocks);
+					break;
+				case S_IFDIR:
+					stats->ninodes++;
+					if(chdir(dent->name) < 0)
+						perror_msg_and_die(dent->name);
+					sub = src_subdir(sd, dent);
+					// with "." and ".."
+					stats->nblocks += dir_blocks(sub, 24);
+					add2fs_from_dir(fs, this_nod, sub, squash_uids, squash_perms, fs_timestamp, stats);
+					if (chdir("..") == -1)
+						perror_msg_and_die("..");
+
+					break;
+				default:
+					break;
+			}
+		else if(dent->nod)
+		{
+			// added already (see add2fs_order), but not its contents
+			if(S_ISDIR(st.st_mode)) {
+				if(chdir(dent->name) < 0)
+					perror_msg_and_die(dent->name);
+				add2fs_from_dir(fs, dent->nod, src_subdir(sd, dent), squash_uids, squash_perms, fs_timestamp, stats);
+				if (chdir("..") == -1)
+					perror_msg_and_die("..");
+			}
+		}
+		else
+			add2fs_entry(fs, this_nod, sd, dent, 1, squash_uids, squash_perms, fs_timestamp);
+	}
+}
+
+// the entry of sd called name (len bytes), if any
+static src_ent *
+src_find(src_dir *sd, const char *name, size_t len)
+{
+	uint32 i;
+
+	for (i = 0; i < sd->n; i++)
+		if (!strncmp(sd->ents[i].name, name, len) && !sd->ents[i].name[len])
+			return &sd->ents[i];
+	return NULL;
+}
+
+// adds the paths of the --order-file list that are in sd (the current
+// directory, added at this_nod) before the rest of it, in that order,
+// with the directories leading to them.  Their inodes and blocks are
+// allocated one after the other.
+static void
+add2fs_order(filesystem *fs, uint32 this_nod, src_dir *root, int squash_uids, int squash_perms, uint32 fs_timestamp)
+{
+	size_t plen = strlen(root->path), len;
+	const char *p, *slash;
+	src_dir *sd;
+	src_ent *e;
+	uint32 i, nod;
+	int pdir;
+
+	if((pdir = open(".", O_RDONLY)) < 0)
+		perror_msg_and_die(".");
+	fs->sequential = 1;
+	for (i = 0; i < order_count; i++) {
+		p = order_list[i];
+		if (plen) {
+			if (strncmp(p, root->path, plen) || p[plen] != '/')
+				continue;
+			p += plen + 1;
+		}
+		sd = root;
+		nod = this_nod;
+		for (;;) {
+			slash = strchr(p, '/');
+			len = slash ? (size_t) (slash - p) : strlen(p);
+			if (!(e = src_find(sd, p, len)))
+				break;
+			if (slash && !S_ISDIR(e->st.st_mode))
+				break;
+			if (!e->nod)
+				e->nod = add2fs_entry(fs, nod, sd, e, 0, squash_uids, squash_perms, fs_timestamp);
+			if (!slash || !e->nod)
+				break;
+			if (chdir(e->name) < 0)
+				perror_msg_and_die(e->name);
+			nod = e->nod;
+			sd = src_subdir(sd, e);
+			p = slash + 1;
+		}
+		if (sd != root && fchdir(pdir) < 0)
+			perror_msg_and_die("fchdir");
+	}
+	fs->sequential = 0;
+	if (close(pdir) < 0)
+		perror_msg_and_die("close");
+}
+
+#define CLONE_BUFSIZE	(1024 * 1024)
+
+// Copy the data regions of src between off and end to the same place
+// in dst, so holes in src stay holes (or read as zeros from a stream):
+// in the kernel with copy_file_range, or sendfile for a stream, if
+// possible, otherwise through a large buffer.  Copying to a stream has
+// to go in order.
+static void
+copy_data(io_backend *dst, io_backend *src, off_t off, off_t end)
+{
+	uint8 *b = NULL;
+	int use_cfr = !dst->stream, use_sf = dst->write_at == stream_write_at;
+	off_t hole;
+	size_t n;
+
+	for (; off < end; off = hole) {
+		hole = end;
+#ifdef SEEK_DATA
+		{
+			off_t data = lseek(src->fd, off, SEEK_DATA);
+			if (data < 0 && errno == ENXIO)
+				break;	// nothing but holes up to the end
+			// on failure, take everything as data
+			if (data >= 0 && data < end) {
+				off = data;
+				hole = lseek(src->fd, off, SEEK_HOLE);
+				if (hole < 0 || hole > end)
+					hole = end;
+			} else if (data >= end)
+				break;
+		}
+#endif
+		while (off < hole) {
+#if HAVE_COPY_FILE_RANGE
+			if (use_cfr) {
+				loff_t in = off, out = off;
+				ssize_t r = copy_file_range(src->fd, &in, dst->fd,
+							    &out, hole - off, 0);
+				if (r > 0) {
+					off += r;
+					continue;
+				}
+				if (!r)
+					break;	// src is shorter, the rest is zeros
+				if (errno != EXDEV && errno != ENOSYS &&
+				    errno != EOPNOTSUPP && errno != EINVAL)
+					perror_msg_and_die("copy_data: copy_file_range");
+				use_cfr = 0;
+			}
+#endif
+#if HAVE_SENDFILE
+			if (use_sf) {
+				// catch the stream up to off, then let the
+				// kernel move the data
+				off_t in = off;
+				ssize_t r;
+				if (dst->write_at(dst, "", 0, off) < 0)
+					perror_msg_and_die("write image");
+				r = sendfile(dst->fd, src->fd, &in, hole - off);
+				if (r > 0) {
+					dst->pos += r;
+					off += r;
+					continue;
+				}
+				if (!r)
+					break;
+				if (errno != EINVAL && errno != ENOSYS)
+					perror_msg_and_die("copy_data: sendfile");
+				use_sf = 0;
+			}
+#endif
+			if (!b && !(b = malloc(CLONE_BUFSIZE)))
+				error_msg_and_die("copy_data: out of memory");
+			n = (hole - off > CLONE_BUFSIZE) ? CLONE_BUFSIZE : hole - off;
+			if (!io_read(src, b, n, off))
+				break;
+			io_write(dst, b, n, off);
+			off += n;
+		}
+	}
+	free(b);
+}
+
+// Copy the first size blocks of src to dst, a new file.  A reflink
+// shares the data with src and costs nothing, otherwise the data
+// regions are copied.
+static void
+clone_file(io_backend *dst, io_backend *src, uint32 size)
+{
+	off_t end = ((off_t) size) * BLOCKSIZE;
+
+	if (dst->stream)
+		error_msg_and_die("Internal error: cloning to a stream");
+#ifdef FICLONE
+	if (!ioctl(dst->fd, FICLONE, src->fd)) {
+		if (dst->truncate(dst, end))
+			perror_msg_and_die("clone_file: ftruncate");
+		return;
+	}
+#endif
+	if (dst->truncate(dst, end))
+		perror_msg_and_die("clone_file: ftruncate");
+	copy_data(dst, src, 0, end);
+}
+
+// Copy-on-write overlay on a read-only base image, for -x without
+// copying the base.  Written blocks go to a sparse delta file; two
+// bitmaps say which blocks live there and which are known to be zeros
+// (punched), the rest are still those of the base.
+typedef struct
+{
+	io_backend io;
+	io_backend *base;
+	io_backend *delta;
+	uint8 *data;	// block is in the delta
+	uint8 *zero;	// block reads as zeros
+	uint32 nblocks;	// blocks covered by the bitmaps
+	off_t size;
+} io_overlay;
+
+#define OVL_BASE	0
+#define OVL_DATA	1
+#define OVL_ZERO	2
+
+// overlay mode for -x, set by --overlay
+static int overlay;
+
+static int
+ovl_state(io_overlay *o, uint32 blk)
+{
+	if (blk >= o->nblocks)
+		return OVL_ZERO;
+	if (o->data[blk / 8] & (1 << (blk % 8)))
+		return OVL_DATA;
+	if (o->zero[blk / 8] & (1 << (blk % 8)))
+		return OVL_ZERO;
+	return OVL_BASE;
+}
+
+// make the bitmaps cover nblocks, new blocks read as zeros
+static void
+ovl_resize(io_overlay *o, uint32 nblocks)
+{
+	size_t old = (o->nblocks + 7) / 8, len = (nblocks + 7) / 8;
+	uint32 i;
+
+	if (nblocks <= o->nblocks)
+		return;
+	o->data = realloc(o->data, len);
+	o->zero = realloc(o->zero, len);
+	if (len && (!o->data || !o->zero))
+		error_msg_and_die("overlay: out of memory");
+	memset(o->data + old, 0, len - old);
+	memset(o->zero + old, 0, len - old);
+	for (i = o->nblocks; i < nblocks; i++)
+		o->zero[i / 8] |= 1 << (i % 8);
+	o->nblocks = nblocks;
+}
+
+static void
+ovl_set(io_overlay *o, uint32 blk, int state)
+{
+	ovl_resize(o, blk + 1);
+	o->data[blk / 8] &= ~(1 << (blk % 8));
+	o->zero[blk / 8] &= ~(1 << (blk % 8));
+	if (state == OVL_DATA)
+		o->data[blk / 8] |= 1 << (blk % 8);
+	else if (state == OVL_ZERO)
+		o->zero[blk / 8] |= 1 << (blk % 8);
+}
+
+// number of blocks from blk on (up to max) in the same state as blk
+static uint32
+ovl_run(io_overlay *o, uint32 blk, uint32 max)
+{
+	int state = ovl_state(o, blk);
+	uint32 n = 1;
+
+	while (n < max && ovl_state(o, blk + n) == state)
+		n++;
+	return n;
+}
+
+static ssize_t
+ovl_read_at(io_backend *io, void *buf, size_t len, off_t off)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint8 *b = buf;
+	size_t done = 0, n;
+	uint32 blk, cnt;
+
+	if (off >= o->size)
+		return 0;
+	if ((off_t) len > o->size - off)
+		len = o->size - off;
+	while (done < len) {
+		blk = (off + done) / BLOCKSIZE;
+		cnt = ovl_run(o, blk, (off + len - 1) / BLOCKSIZE - blk + 1);
+		n = ((off_t) blk + cnt) * BLOCKSIZE - (off + done);
+		if (n > len - done)
+			n = len - done;
+		switch (ovl_state(o, blk)) {
+			case OVL_DATA:
+				io_read(o->delta, b + done, n, off + done);
+				break;
+			case OVL_BASE:
+				io_read(o->base, b + done, n, off + done);
+				break;
+			default:
+				memset(b + done, 0, n);
+		}
+		done += n;
+	}
+	return done;
+}
+
+// bring a block into the delta before part of it is written
+static void
+ovl_materialize(io_overlay *o, uint32 blk)
+{
+	uint8 *b;
+
+	if (ovl_state(o, blk) == OVL_DATA)
+		return;
+	if (!(b = malloc(BLOCKSIZE)))
+		error_msg_and_die("overlay: out of memory");
+	if (ovl_state(o, blk) == OVL_BASE)
+		io_read(o->base, b, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+	else
+		memset(b, 0, BLOCKSIZE);
+	io_write(o->delta, b, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+	ovl_set(o, blk, OVL_DATA);
+	free(b);
+}
+
+static ssize_t
+ovl_write_at(io_backend *io, const void *buf, size_t len, off_t off)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint32 blk, last;
+
+	if (!len)
+		return 0;
+	blk = off / BLOCKSIZE;
+	last = (off + len - 1) / BLOCKSIZE;
+	if (off % BLOCKSIZE)
+		ovl_materialize(o, blk);
+	if ((off + len) % BLOCKSIZE)
+		ovl_materialize(o, last);
+	io_write(o->delta, buf, len, off);
+	for (; blk <= last; blk++)
+		ovl_set(o, blk, OVL_DATA);
+	if (off + (off_t) len > o->size)
+		o->size = off + len;
+	return len;
+}
+
+static ssize_t
+ovl_writev_at(io_backend *io, const struct iovec *iov, int iovcnt, off_t off)
+{
+	return ovl_write_at(io, iov->iov_base, iov->iov_len, off);
+}
+
+static int
+ovl_truncate(io_backend *io, off_t len)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint32 blk;
+
+	// a partial last block keeps its head, the rest reads as zeros
+	if (len % BLOCKSIZE && len < o->size) {
+		uint8 *b = calloc(1, BLOCKSIZE);
+		if (!b)
+			error_msg_and_die("overlay: out of memory");
+		ovl_materialize(o, len / BLOCKSIZE);
+		io_write(o->delta, b, BLOCKSIZE - len % BLOCKSIZE, len);
+		free(b);
+	}
+	for (blk = (len + BLOCKSIZE - 1) / BLOCKSIZE; blk < o->nblocks; blk++)
+		ovl_set(o, blk, OVL_ZERO);
+	ovl_resize(o, (len + BLOCKSIZE - 1) / BLOCKSIZE);
+	o->size = len;
+	return o->delta->truncate(o->delta, len);
+}
+
+static int
+ovl_punch(io_backend *io, off_t off, off_t len)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint32 blk = (off + BLOCKSIZE - 1) / BLOCKSIZE;
+	uint32 end = (off + len) / BLOCKSIZE;
+	uint8 *b;
+
+	// partial blocks at either end are written as zeros
+	if (off % BLOCKSIZE || (off + len) % BLOCKSIZE) {
+		if (!(b = calloc(1, BLOCKSIZE)))
+			error_msg_and_die("overlay: out of memory");
+		if (off % BLOCKSIZE) {
+			off_t n = BLOCKSIZE - off % BLOCKSIZE;
+			ovl_write_at(io, b, n < len ? n : len, off);
+		}
+		if ((off + len) % BLOCKSIZE && blk <= end)
+			ovl_write_at(io, b, (off + len) % BLOCKSIZE,
+				     ((off_t) end) * BLOCKSIZE);
+		free(b);
+	}
+	if (blk < end)
+		o->delta->punch(o->delta, ((off_t) blk) * BLOCKSIZE,
+				((off_t) end - blk) * BLOCKSIZE);
+	for (; blk < end; blk++)
+		ovl_set(o, blk, OVL_ZERO);
+	return 0;
+}
+
+static void
+ovl_close(io_backend *io)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+
+	o->base->close(o->base);
+	o->delta->close(o->delta);
+	free(o->data);
+	free(o->zero);
+	free(o);
+}
+
+// Open an overlay on base (which is closed with it), backed by a
+// temporary delta file.
+static io_backend *
+io_open_overlay(io_backend *base, uint32 nblocks)
+{
+	io_overlay *o = calloc(1, sizeof(*o));
+
+	if (!o)
+		error_msg_and_die(memory_exhausted);
+	o->io.read_at = ovl_read_at;
+	o->io.write_at = ovl_write_at;
+	o->io.writev_at = ovl_writev_at;
+	o->io.truncate = ovl_truncate;
+	o->io.punch = ovl_punch;
+	o->io.close = ovl_close;
+	o->io.fd = -1;
+	o->base = base;
+	o->delta = io_open(NULL, 0);
+	// until told otherwise, everything comes from the base
+	o->data = calloc((nblocks + 7) / 8, 1);
+	o->zero = calloc((nblocks + 7) / 8, 1);
+	if (nblocks && (!o->data || !o->zero))
+		error_msg_and_die(memory_exhausted);
+	o->nblocks = nblocks;
+	o->size = ((off_t) nblocks) * BLOCKSIZE;
+	return &o->io;
+}
+
+// Write the merged image to out, in block order: base blocks are copied
+// from the base, changed ones from the delta, and zero blocks are left
+// as holes.
+static void
+overlay_emit(io_backend *io, io_backend *out)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint32 blk, cnt, nblocks = (o->size + BLOCKSIZE - 1) / BLOCKSIZE;
+	off_t off, end;
+
+	if (!out->stream && out->truncate(out, o->size))
+		perror_msg_and_die("overlay: ftruncate");
+	for (blk = 0; blk < nblocks; blk += cnt) {
+		cnt = ovl_run(o, blk, nblocks - blk);
+		off = ((off_t) blk) * BLOCKSIZE;
+		end = ((off_t) blk + cnt) * BLOCKSIZE;
+		if (end > o->size)
+			end = o->size;
+		switch (ovl_state(o, blk)) {
+			case OVL_DATA:
+				copy_data(out, o->delta, off, end);
+				break;
+			case OVL_BASE:
+				copy_data(out, o->base, off, end);
+				break;
+		}
+	}
+	// zeros up to the end
+	if (out->stream && out->write_at(out, "", 0, o->size) < 0)
+		perror_msg_and_die("write image");
+}
+
+// Block-level patch turning the base image into the overlay's image.
+// All fields are little endian: a header of PATCH_MAGIC, the version,
+// the block size and the number of blocks of the new image, then
+// records of type, first block and count, with count blocks of data
+// following PATCH_DATA records, and finally a PATCH_END record.
+#define PATCH_MAGIC	"GE2PATCH"
+#define PATCH_VERSION	1
+
+#define PATCH_END	0	// end of the patch
+#define PATCH_DATA	1	// replace the blocks with the data that follows
+#define PATCH_ZERO	2	// the blocks are zeros (they may be punched)
+
+static void
+put_le32(uint8 *p, uint32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void
+patch_record(FILE *fh, uint32 type, uint32 blk, uint32 cnt)
+{
+	uint8 rec[12];
+
+	put_le32(rec, type);
+	put_le32(rec + 4, blk);
+	put_le32(rec + 8, cnt);
+	if (fwrite(rec, sizeof(rec), 1, fh) != 1)
+		perror_msg_and_die("writing patch");
+}
+
+// Writing a patch: blocks come in order, and runs of the same type go
+// in one record, with the data of PATCH_DATA ones
+typedef struct
+{
+	FILE *fh;
+	uint32 type, first, cnt;
+	uint8 *data;	// CLONE_BUFSIZE bytes at most
+} patch_writer;
+
+static void
+patch_begin(patch_writer *pw, FILE *fh, uint32 nblocks)
+{
+	uint8 hdr[24];
+
+	memcpy(hdr, PATCH_MAGIC, 8);
+	put_le32(hdr + 8, PATCH_VERSION);
+	put_le32(hdr + 12, BLOCKSIZE);
+	put_le32(hdr + 16, nblocks);
+	put_le32(hdr + 20, 0);
+	if (fwrite(hdr, sizeof(hdr), 1, fh) != 1)
+		perror_msg_and_die("writing patch");
+	pw->fh = fh;
+	pw->cnt = 0;
+	if (!(pw->data = malloc(CLONE_BUFSIZE)))
+		error_msg_and_die("patch: out of memory");
+}
+
+static void
+patch_flush(patch_writer *pw)
+{
+	if (!pw->cnt)
+		return;
+	patch_record(pw->fh, pw->type, pw->first, pw->cnt);
+	if (pw->type == PATCH_DATA &&
+	    fwrite(pw->data, BLOCKSIZE, pw->cnt, pw->fh) != pw->cnt)
+		perror_msg_and_die("writing patch");
+	pw->cnt = 0;
+}
+
+// Add block blk as type t, with its contents b for PATCH_DATA
+static void
+patch_add(patch_writer *pw, uint32 blk, uint32 t, const uint8 *b)
+{
+	if (pw->cnt && (t != pw->type || blk != pw->first + pw->cnt))
+		patch_flush(pw);
+	if (!pw->cnt) {
+		pw->first = blk;
+		pw->type = t;
+	}
+	if (t == PATCH_DATA)
+		memcpy(pw->data + pw->cnt * (size_t) BLOCKSIZE, b, BLOCKSIZE);
+	pw->cnt++;
+	// keep the buffered data bounded
+	if (t == PATCH_DATA && pw->cnt * (size_t) BLOCKSIZE >= CLONE_BUFSIZE)
+		patch_flush(pw);
+}
+
+static void
+patch_end(patch_writer *pw)
+{
+	patch_flush(pw);
+	patch_record(pw->fh, PATCH_END, 0, 0);
+	free(pw->data);
+}
+
+// Whether off is in a hole of the base image, so it reads as zeros
+// without looking.  [*ds, *de) caches the data region at or after the
+// last offset asked about.
+static int
+ovl_base_hole(io_overlay *o, off_t off, off_t *ds, off_t *de)
+{
+#ifdef SEEK_DATA
+	if (off >= *de) {
+		*ds = lseek(o->base->fd, off, SEEK_DATA);
+		if (*ds < 0) {
+			*de = *ds = (errno == ENXIO) ? o->size : off;
+			return errno == ENXIO;
+		}
+		*de = lseek(o->base->fd, *ds, SEEK_HOLE);
+		if (*de < 0)
+			*de = o->size;
+	}
+	return off < *ds;
+#else
+	return 0;
+#endif
+}
+
+// Write a patch with the blocks that differ from the base.  Blocks
+// written back unchanged are left out, and so are zero blocks that
+// are zeros in the base already.
+static void
+overlay_patch(io_backend *io, FILE *fh)
+{
+	io_overlay *o = container_of(io, io_overlay, io);
+	uint32 blk, nblocks = (o->size + BLOCKSIZE - 1) / BLOCKSIZE, t;
+	patch_writer pw;
+	off_t ds = 0, de = 0;
+	uint8 *b, *bb;
+
+	patch_begin(&pw, fh, nblocks);
+	b = malloc(BLOCKSIZE);
+	bb = malloc(BLOCKSIZE);
+	if (!b || !bb)
+		error_msg_and_die("overlay_patch: out of memory");
+	for (blk = 0; blk < nblocks; blk++) {
+		t = PATCH_END;
+		if (ovl_state(o, blk) == OVL_ZERO) {
+			if (!ovl_base_hole(o, ((off_t) blk) * BLOCKSIZE, &ds, &de)) {
+				io_read(o->base, bb, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+				if (!is_blk_empty(bb))
+					t = PATCH_ZERO;
+			}
+		} else if (ovl_state(o, blk) == OVL_DATA) {
+			io_read(io, b, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+			io_read(o->base, bb, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+			if (memcmp(b, bb, BLOCKSIZE))
+				t = is_blk_empty(b) ? PATCH_ZERO : PATCH_DATA;
+		}
+		if (t != PATCH_END)
+			patch_add(&pw, blk, t, b);
+	}
+	patch_end(&pw);
+	free(b);
+	free(bb);
+}
+
+// An empty filesystem structure, without an image yet
+static filesystem *
+new_fs(int swapit)
+{
+	filesystem *fs;
+
+	fs = malloc(sizeof(*fs));
+	if (!fs)
+		error_msg_and_die("not enough memory for filesystem");
+	memset(fs, 0, sizeof(*fs));
+	fs->swapit = swapit;
+	fs->data_src = -1;
+	fs->free_fill = -1;
+	cache_init(&fs->blks, MAX_FREE_CACHE_BLOCKS, blk_elem_val, blk_freed);
+	cache_init(&fs->gds, MAX_FREE_CACHE_GDS, gd_elem_val, gd_freed);
+	cache_init(&fs->blkmaps, MAX_FREE_CACHE_BLOCKMAPS,
+		   blkmap_elem_val, blkmap_freed);
+	cache_init(&fs->inodes, MAX_FREE_CACHE_INODES,
+		   inode_elem_val, inode_freed);
+	fs->hdlink_cnt = HDLINK_CNT;
+	fs->hdlinks.hdl = calloc(sizeof(struct hdlink_s), fs->hdlink_cnt);
+	if (!fs->hdlinks.hdl)
+		error_msg_and_die("Not enough memory");
+	fs->hdlinks.count = 0 ;
+	return fs;
+}
+
+// Allocate a new filesystem structure, allocate internal memory,
+// and initialize the contents.
+static filesystem *
+alloc_fs(int swapit, char *fname, uint32 nbblocks, FILE *srcfile)
+{
+	filesystem *fs = new_fs(swapit);
+	struct stat srcstat, dststat;
+
+	if (srcfile) {
+		if (fstat(fileno(srcfile), &srcstat))
+			perror_msg_and_die("fstat srcfile");
+		if (fname && strcmp(fname, "-") != 0
+		    && stat(fname, &dststat) == 0
+		    && srcstat.st_ino == dststat.st_ino
+		    && srcstat.st_dev == dststat.st_dev)
+		  {
+			// source and destination are the same file, don't
+			// truncate or copy, just use the file.
+			if (overlay || OUTPUT_SEPARATE)
+				error_msg_and_die("the output can't be the starting image "
+						  "with --overlay, --output-format or --compress");
+			fs->io = io_open(fname, O_RDWR);
+		} else if (overlay) {
+			fs->io = io_open_overlay(io_open_fd(dup(fileno(srcfile))),
+						 nbblocks);
+		} else {
+			// for stdout, work on a copy in a temporary file
+			io_backend *src = io_open_fd(dup(fileno(srcfile)));
+			if (!fname || strcmp(fname, "-") == 0 || OUTPUT_SEPARATE)
+				fs->io = io_open(NULL, 0);
+			else
+				fs->io = io_open(fname, O_RDWR | O_CREAT | O_TRUNC);
+			clone_file(fs->io, src, nbblocks);
+			src->close(src);
+		}
+	} else if (streaming)
+		fs->io = io_open_plan();
+	else if (!fname || strcmp(fname, "-") == 0 || OUTPUT_SEPARATE)
+		fs->io = io_open(NULL, 0);
+	else
+		fs->io = io_open(fname, O_RDWR | O_CREAT | O_TRUNC);
+	fs->wb = wb_init(fs->io);
+	return fs;
+}
+
+/* Make sure the output file is the right size */
+static void
+set_file_size(filesystem *fs)
+{
+	if (fs->io->truncate(fs->io,
+			     ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE))
+		perror_msg_and_die("set_file_size: ftruncate");
+}
+
+// what init_group_bitmaps needs to know about the layout
+struct group_bitmaps
+{
+	uint32 first_bbm;
+	uint32 blocks_per_group;
+	uint32 overhead;
+	uint32 free_per_group;
+	uint32 free_blocks;
+	uint32 inodes_per_group;
+};
+
+// Write the initial block and inode bitmaps of a group; they are
+// adjacent, so it takes a single write.  The free blocks are handed
+// out to the groups in order, so the last ones may get fewer.
+static void
+init_group_bitmaps(filesystem *fs, uint32 grp, void *arg)
+{
+	struct group_bitmaps *gb = arg;
+	uint32 used = grp * gb->free_per_group, nfree = 0;
+	uint8 *b;
+
+	if(used < gb->free_blocks)
+		nfree = gb->free_blocks - used;
+	if(nfree > gb->free_per_group)
+		nfree = gb->free_per_group;
+	if(!(b = calloc(2, BLOCKSIZE)))
+		error_msg_and_die("init_group_bitmaps: out of memory");
+	//non-filesystem blocks
+	allocate_range(b, nfree + gb->overhead + 1, BLOCKSIZE * 8);
+	//system blocks
+	allocate_range(b, 1, gb->overhead);
+	//non-filesystem inodes
+	allocate_range(b + BLOCKSIZE, gb->inodes_per_group + 1, BLOCKSIZE * 8);
+	//system inodes
+	if(grp == 0)
+		allocate_range(b + BLOCKSIZE, 1, EXT2_FIRST_INO - 1);
+	io_write(fs->io, b, 2 * BLOCKSIZE,
+		 ((off_t) gb->first_bbm + grp * gb->blocks_per_group) * BLOCKSIZE);
+	free(b);
+}
+
+// how init_fs lays out nbblocks blocks and nbinodes inodes
+typedef struct
+{
+	uint32 first_block;
+	uint32 nbgroups;
+	uint32 blocks_per_group;
+	uint32 inodes_per_group;
+	uint32 gdsz;	// group descriptor blocks
+	uint32 itblsz;	// inode table blocks per group
+	uint32 overhead_per_group;
+	long long free_blocks;
+} geometry;
+
+static void
+get_geometry(geometry *g, uint32 nbblocks, uint32 nbinodes)
+{
+	uint32 min_nbgroups;
+
+	/* nbinodes is the total number of inodes in the system.
+	 * a block group can have no more than 8192 inodes.
+	 */
+	min_nbgroups = (nbinodes + INODES_PER_GROUP - 1) / INODES_PER_GROUP;
+
+	/* On filesystems with 1k block size, the bootloader area uses a full
+	 * block. For 2048 and up, the superblock can be fitted into block 0.
+	 */
+	g->first_block = (BLOCKSIZE == 1024);
+
+	/* nbblocks is the total number of blocks in the filesystem.
+	 * a block group can have no more than 8192 blocks.
+	 */
+	g->nbgroups = (nbblocks - g->first_block + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	if(g->nbgroups < min_nbgroups) g->nbgroups = min_nbgroups;
+	g->blocks_per_group = rndup((nbblocks - g->first_block + g->nbgroups - 1)/g->nbgroups, 8);
+	g->inodes_per_group = rndup((nbinodes + g->nbgroups - 1)/g->nbgroups,
+						(BLOCKSIZE/sizeof(inode)));
+	if (g->inodes_per_group < 16)
+		g->inodes_per_group = 16; //minimum number b'cos the first 10 are reserved
+
+	g->gdsz = rndup(g->nbgroups*sizeof(groupdescriptor),BLOCKSIZE)/BLOCKSIZE;
+	g->itblsz = g->inodes_per_group * sizeof(inode)/BLOCKSIZE;
+	g->overhead_per_group = 3 /*sb,bbm,ibm*/ + g->gdsz + g->itblsz;
+	g->free_blocks = (long long) nbblocks - (long long) g->overhead_per_group*g->nbgroups - g->first_block;
+}
+
+// pct percent of n, rounded up
+static unsigned long
+percent_of(unsigned long n, float pct)
+{
+	double x = (double) n * pct / 100;
+	unsigned long r = x;
+
+	return r + (r < x);
+}
+
+// the fewest blocks init_fs can fit nblocks blocks of data and nbinodes
+// inodes in, or as many inodes as bytes_per_inode gives if more (see
+// main)
+static uint32
+auto_blocks(unsigned long nblocks, unsigned long nbinodes, float bytes_per_inode)
+{
+	long long n = nblocks + 1, last;
+	unsigned long inodes;
+	geometry g;
+
+	if(n < 8)
+		n = 8;
+	for(;;)
+	{
+		inodes = nbinodes;
+		if(bytes_per_inode > 0 && n * BLOCKSIZE / bytes_per_inode > inodes)
+			inodes = n * BLOCKSIZE / bytes_per_inode;
+		get_geometry(&g, n, inodes);
+		// the last group, maybe smaller, holds its own overhead too
+		last = n - g.first_block - (long long) (g.nbgroups - 1) * g.blocks_per_group;
+		if(g.free_blocks >= (long long) nblocks && last > g.overhead_per_group)
+			return n;
+		// no fewer are needed: each block adds at most one free one
+		n += g.free_blocks < (long long) nblocks ? nblocks - g.free_blocks : 1;
+		if(n > 0xffffffffLL)
+			error_msg_and_die("too much data for a filesystem");
+	}
+}
+
+// initialize an empty filesystem
+static filesystem *
+init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
+	uint32 fs_timestamp, uint32 creator_os, int swapit, char *fname)
+{
+	uint32 i;
+	filesystem *fs;
+	dirwalker dw;
+	uint32 nod, first_block;
+	uint32 nbgroups,nbinodes_per_group,overhead_per_group,free_blocks,
+		free_blocks_per_group,nbblocks_per_group;
+	geometry g;
+	uint32 gdsz,bbmpos,ibmpos,itblpos;
+	struct group_bitmaps gb;
+	inode *itab0;
+	nod_info *ni;
+	groupdescriptor *gd;
+	gd_info *gi;
+	inode_pos ipos;
+	
+	if(nbresrvd < 0)
+		error_msg_and_die("reserved blocks value is invalid. Note: options have changed, see --help or the man page.");
+	if(nbinodes < EXT2_FIRST_INO - 1 + (nbresrvd ? 1 : 0))
+		error_msg_and_die("too few inodes. Note: options have changed, see --help or the man page.");
+	if(nbblocks < 8)
+		error_msg_and_die("too few blocks. Note: options have changed, see --help or the man page.");
+
+	get_geometry(&g, nbblocks, nbinodes);
+	first_block = g.first_block;
+	nbgroups = g.nbgroups;
+	nbblocks_per_group = g.blocks_per_group;
+	nbinodes_per_group = g.inodes_per_group;
+	gdsz = g.gdsz;
+	overhead_per_group = g.overhead_per_group;
+	free_blocks = g.free_blocks;
+	free_blocks_per_group = nbblocks_per_group - overhead_per_group;
+
+	fs = alloc_fs(swapit, fname, nbblocks, NULL);
+	init_written(fs, nbblocks);
+	fs->sb = calloc(1, SUPERBLOCK_SIZE);
+	if (!fs->sb)
+		error_msg_and_die("error allocating header memory");
+
+	// create the superblock for an empty filesystem
+	fs->sb->s_inodes_count = nbinodes_per_group * nbgroups;
+	fs->sb->s_blocks_count = nbblocks;
+	fs->sb->s_r_blocks_count = nbresrvd;
+	fs->sb->s_free_blocks_count = free_blocks;
+	fs->sb->s_free_inodes_count = fs->sb->s_inodes_count - EXT2_FIRST_INO + 1;
+	fs->sb->s_first_data_block = first_block;
+	fs->sb->s_log_block_size = BLOCKSIZE >> 11;
+	fs->sb->s_log_frag_size = BLOCKSIZE >> 11;
+	fs->sb->s_blocks_per_group = nbblocks_per_group;
+	fs->sb->s_frags_per_group = nbblocks_per_group;
+	fs->sb->s_inodes_per_group = nbinodes_per_group;
+	fs->sb->s_wtime = fs_timestamp;
+	fs->sb->s_magic = EXT2_MAGIC_NUMBER;
+	fs->sb->s_lastcheck = fs_timestamp;
+	fs->sb->s_creator_os = creator_os;
+
+	set_file_size(fs);
+
+	// set up groupdescriptors
+	for(i=0, bbmpos=first_block+1+gdsz, ibmpos=bbmpos+1, itblpos=ibmpos+1;
+		i<nbgroups;
+		i++, bbmpos+=nbblocks_per_group, ibmpos+=nbblocks_per_group, itblpos+=nbblocks_per_group)
+	{
+		gd = get_gd(fs, i, &gi);
+
+		if(free_blocks > free_blocks_per_group) {
+			gd->bg_free_blocks_count = free_blocks_per_group;
+			free_blocks -= free_blocks_per_group;
+		} else {
+			gd->bg_free_blocks_count = free_blocks;
+			free_blocks = 0; // this is the last block group
+		}
+		if(i)
+			gd->bg_free_inodes_count = nbinodes_per_group;
+		else
+			gd->bg_free_inodes_count = nbinodes_per_group -
+							EXT2_FIRST_INO + 2;
+		gd->bg_used_dirs_count = 0;
+		gd->bg_block_bitmap = bbmpos;
+		gd->bg_inode_bitmap = ibmpos;
+		gd->bg_inode_table = itblpos;
+		put_gd(gi);
+	}
+
+	/* Mark non-filesystem blocks and inodes as allocated */
+	/* Mark system blocks and inodes as allocated         */
+	gb.first_bbm = first_block + 1 + gdsz;
+	gb.blocks_per_group = nbblocks_per_group;
+	gb.overhead = overhead_per_group;
+	gb.free_per_group = free_blocks_per_group;
+	gb.free_blocks = fs->sb->s_free_blocks_count;
+	gb.inodes_per_group = nbinodes_per_group;
+	run_groups(fs, nbgroups, init_group_bitmaps, &gb);
+	for(i = 0; i < nbgroups; i++)
+		mark_written(fs, gb.first_bbm + i * nbblocks_per_group, 2);
+
+	// make root inode and directory
+	/* We have groups now. Add the root filesystem in group 0 */
+	/* Also increment the directory count for group 0 */
+	gd = get_gd(fs, 0, &gi);
+	gd->bg_free_inodes_count--;
+	gd->bg_used_dirs_count = 1;
+	put_gd(gi);
+	itab0 = get_nod(fs, EXT2_ROOT_INO, &ni);
+	itab0->i_mode = FM_IFDIR | FM_IRWXU | FM_IRGRP | FM_IROTH | FM_IXGRP | FM_IXOTH;
+	itab0->i_ctime = fs_timestamp;
+	itab0->i_mtime = fs_timestamp;
+	itab0->i_atime = fs_timestamp;
+	itab0->i_size = BLOCKSIZE;
+	itab0->i_links_count = 2;
+	put_nod(ni);
+
+	new_dir(fs, EXT2_ROOT_INO, ".", 1, &dw);
+	shrink_dir(&dw, EXT2_ROOT_INO, "..", 2);
+	next_dir(&dw); // Force the data into the buffer
+	inode_pos_init(fs, &ipos, EXT2_ROOT_INO, INODE_POS_EXTEND, NULL);
+	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
+	inode_pos_finish(fs, &ipos);
+	put_dir(&dw);
+
+	// make lost+found directory
+	if(fs->sb->s_r_blocks_count)
+	{
+		inode *node;
+		uint8 *b;
+
+		nod = mkdir_fs(fs, EXT2_ROOT_INO, "lost+found", FM_IRWXU,
+			       0, 0, fs_timestamp, fs_timestamp);
+		b = get_workblk();
+		memset(b, 0, BLOCKSIZE);
+		((directory*)b)->d_rec_len = swapit ? swab16(BLOCKSIZE) : BLOCKSIZE;
+		inode_pos_init(fs, &ipos, nod, INODE_POS_EXTEND, NULL);
+		// It is always 16 blocks to start out with
+		for(i = 1; i < 16; i++)
+			extend_inode_blk(fs, &ipos, b, 1);
+		inode_pos_finish(fs, &ipos);
+		free_workblk(b);
+		node = get_nod(fs, nod, &ni);
+		node->i_size = 16 * BLOCKSIZE;
+		put_nod(ni);
+	}
+
+	// administrative info
+	fs->sb->s_state = 1;
+	fs->sb->s_max_mnt_count = 20;
+
+	// options for me
+	fs->holes = holes;
+	
+	return fs;
+}
+
+// Read and check the superblock of a loaded image
+static void
+read_sb(filesystem *fs)
+{
+	fs->sb = malloc(SUPERBLOCK_SIZE);
+	if (!fs->sb)
+		error_msg_and_die("error allocating header memory");
+	if (io_read(fs->io, fs->sb, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET)
+	    != SUPERBLOCK_SIZE)
+		error_msg_and_die("fread filesystem image superblock");
+	if(fs->swapit)
+		swap_sb(fs->sb);
+
+	if((fs->sb->s_rev_level > 1) || (fs->sb->s_magic != EXT2_MAGIC_NUMBER))
+		error_msg_and_die("not a suitable ext2 filesystem");
+	if (fs->sb->s_rev_level > 0) {
+		if (fs->sb->s_first_ino != EXT2_GOOD_OLD_FIRST_INO)
+			error_msg_and_die("First inode incompatible");
+		if (fs->sb->s_inode_size != EXT2_GOOD_OLD_INODE_SIZE)
+			error_msg_and_die("inode size incompatible");
+		if (fs->sb->s_feature_compat)
+			error_msg_and_die("Unsupported compat features");
+		if (fs->sb->s_feature_incompat)
+			error_msg_and_die("Unsupported incompat features");
+		if (fs->sb->s_feature_ro_compat
+		    & ~EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+			error_msg_and_die("Unsupported ro compat features");
+	}
+}
+
+// loads a filesystem from disk
+static filesystem *
+load_fs(FILE *fh, int swapit, char *fname)
+{
+	off_t fssize;
+	filesystem *fs;
+
+	if((fseek(fh, 0, SEEK_END) < 0) || ((fssize = ftello(fh)) == -1))
+		perror_msg_and_die("input filesystem image");
+	rewind(fh);
+	if ((fssize % BLOCKSIZE) != 0)
+		error_msg_and_die("Input file not a multiple of block size");
+	fssize /= BLOCKSIZE;
+	if(fssize < 16) // totally arbitrary
+		error_msg_and_die("too small filesystem");
+	fs = alloc_fs(swapit, fname, fssize, fh);
+	read_sb(fs);
+	set_file_size(fs);
+	return fs;
+}
+
+static void
+free_fs(filesystem *fs)
+{
+	drop_written(fs);
+	free(fs->hdlinks.hdl);
+	wb_finish(fs->wb);
+	fs->io->close(fs->io);
+	free(fs->sb);
+	free(fs);
+}
+
+// set by --layout-from
+static const char *layout_from;
+
+static void
+layout_add(layout *l, uint32 parent, uint32 ino, const char *name, uint32 len)
+{
+	struct layout_ent *e;
+
+	if (l->nents == l->maxents) {
+		l->maxents = l->maxents ? l->maxents * 2 : 256;
+		if (!(l->ents = realloc(l->ents, l->maxents * sizeof(*l->ents))))
+			error_msg_and_die(memory_exhausted);
+	}
+	while (l->nnames + len > l->maxnames) {
+		l->maxnames = l->maxnames ? l->maxnames * 2 : 4096;
+		if (!(l->names = realloc(l->names, l->maxnames)))
+			error_msg_and_die(memory_exhausted);
+	}
+	e = &l->ents[l->nents++];
+	e->parent = parent;
+	e->ino = ino;
+	e->name = l->nnames;
+	e->len = len;
+	memcpy(l->names + l->nnames, name, len);
+	l->nnames += len;
+}
+
+// read all the directories of the old image, from the root
+static void
+layout_scan(layout *l)
+{
+	filesystem *old = l->old;
+	uint32 ninodes = old->sb->s_inodes_count;
+	uint32 *stack, nstack = 0, dir, bk, i;
+	uint8 *seen;
+	blockwalker bw;
+	dirwalker dw;
+	directory *d;
+	nod_info *ni;
+	int isdir;
+
+	stack = malloc(ninodes * sizeof(*stack));
+	seen = calloc(1, ninodes / 8 + 1);
+	if (!stack || !seen)
+		error_msg_and_die(memory_exhausted);
+	stack[nstack++] = EXT2_ROOT_INO;
+	allocate(seen, EXT2_ROOT_INO);
+	while (nstack) {
+		dir = stack[--nstack];
+		init_bw(&bw);
+		while ((bk = walk_bw(old, dir, &bw, 0, 0)) != WALK_END) {
+			if (!bk || bk >= old->sb->s_blocks_count)
+				continue;
+			for (d = get_dir(old, bk, &dw); d; d = next_dir(&dw)) {
+				char *name = dir_name(&dw);
+
+				if (!d->d_inode || d->d_inode > ninodes ||
+				    (d->d_name_len == 1 && name[0] == '.') ||
+				    (d->d_name_len == 2 && !strncmp(name, "..", 2)))
+					continue;
+				layout_add(l, dir, d->d_inode, name, d->d_name_len);
+				if (allocated(seen, d->d_inode))
+					continue;
+				isdir = (get_nod(old, d->d_inode, &ni)->i_mode & FM_IFMT) == FM_IFDIR;
+				put_nod(ni);
+				if (isdir) {
+					allocate(seen, d->d_inode);
+					stack[nstack++] = d->d_inode;
+				}
+			}
+			put_dir(&dw);
+		}
+	}
+	free(stack);
+	free(seen);
+
+	for (i = 16; i < 2 * l->nents; i *= 2)
+		;
+	l->hmask = i - 1;
+	if (!(l->hash = calloc(i, sizeof(*l->hash))))
+		error_msg_and_die(memory_exhausted);
+	for (i = 0; i < l->nents; i++) {
+		struct layout_ent *e = &l->ents[i];
+		uint32 h = layout_hash(e->parent, l->names + e->name, e->len) & l->hmask;
+
+		e->next = l->hash[h];
+		l->hash[h] = i + 1;
+	}
+}
+
+// whether item is set in a bitmap of group grp of the old image, the
+// block bitmap or the inode bitmap; the last one used stays in *obi
+static int
+layout_old_used(filesystem *old, uint32 grp, uint32 item, int inodes,
+		blk_info **obi)
+{
+	groupdescriptor *gd;
+	gd_info *gi;
+	uint32 blk;
+
+	if (grp >= GRP_NBGROUPS(old))
+		return 0;
+	gd = get_gd(old, grp, &gi);
+	blk = inodes ? gd->bg_inode_bitmap : gd->bg_block_bitmap;
+	put_gd(gi);
+	if (!*obi || (*obi)->blk != blk) {
+		if (*obi)
+			put_blk(*obi);
+		get_blk(old, blk, obi);
+	}
+	return allocated((*obi)->b, item);
+}
+
+// set aside the blocks and inodes in use in the old image that are
+// free here
+static void
+layout_reserve(filesystem *fs, layout *l)
+{
+	filesystem *old = l->old;
+	uint32 grp, nbgroups = GRP_NBGROUPS(fs), i, last, n;
+	uint32 bpg = fs->sb->s_blocks_per_group;
+	uint32 ipg = fs->sb->s_inodes_per_group;
+	uint32 first = fs->sb->s_first_data_block;
+	uint32 ofirst = old->sb->s_first_data_block;
+	uint32 obpg = old->sb->s_blocks_per_group;
+	uint32 oipg = old->sb->s_inodes_per_group;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi, *obi = NULL;
+	block b;
+
+	l->rblk = calloc(1, (fs->sb->s_blocks_count - first) / 8 + 1);
+	l->rnod = calloc(1, fs->sb->s_inodes_count / 8 + 1);
+	if (!l->rblk || !l->rnod)
+		error_msg_and_die(memory_exhausted);
+	for (grp = 0; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		// the bits past the end of the filesystem are set
+		b = GRP_GET_GROUP_BBM(fs, gd, &bi);
+		for (i = bitmap_find(b, 1, bpg, 0); i <= bpg;
+		     i = bitmap_find(b, i + 1, bpg, 0)) {
+			n = first + grp * bpg + i - 1;
+			if (n < ofirst || n >= old->sb->s_blocks_count ||
+			    !layout_old_used(old, (n - ofirst) / obpg,
+					     (n - ofirst) % obpg + 1, 0, &obi))
+				continue;
+			allocate(b, i);
+			allocate(l->rblk, n - first + 1);
+			gd->bg_free_blocks_count--;
+			fs->sb->s_free_blocks_count--;
+			l->nrblk++;
+		}
+		GRP_PUT_GROUP_BBM(bi);
+		b = GRP_GET_GROUP_IBM(fs, gd, &bi);
+		last = ipg;
+		for (i = bitmap_find(b, 1, last, 0); i <= last;
+		     i = bitmap_find(b, i + 1, last, 0)) {
+			n = grp * ipg + i;
+			if (n > old->sb->s_inodes_count ||
+			    !layout_old_used(old, (n - 1) / oipg,
+					     (n - 1) % oipg + 1, 1, &obi))
+				continue;
+			allocate(b, i);
+			allocate(l->rnod, n);
+			gd->bg_free_inodes_count--;
+			fs->sb->s_free_inodes_count--;
+			l->nrnod++;
+		}
+		GRP_PUT_GROUP_IBM(bi);
+		put_gd(gi);
+	}
+	if (obi)
+		put_blk(obi);
+}
+
+// set up the new inode of a path init_fs made already
+static void
+layout_premade(filesystem *fs, uint32 nod, uint32 old_nod)
+{
+	nod_info *ni;
+
+	layout_map(fs, nod, old_nod);
+	fs->layout->pos[nod] = get_nod(fs, nod, &ni)->i_blocks / INOBLK;
+	put_nod(ni);
+}
+
+// Lay the new filesystem out like the image fname, as far as possible
+static void
+layout_open(filesystem *fs, const char *fname)
+{
+	layout *l;
+	filesystem *old;
+	uint32 nod;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) < 0)
+		perror_msg_and_die(fname);
+	old = new_fs(fs->swapit);
+	old->io = io_open_fd(fd);
+	// it's only read: the cached blocks are dropped, not written
+	old->blks_clean = 1;
+	read_sb(old);
+	if (old->sb->s_log_block_size != fs->sb->s_log_block_size)
+		error_msg_and_die("%s: not the same block size", fname);
+
+	if (!(l = calloc(1, sizeof(*l))))
+		error_msg_and_die(memory_exhausted);
+	l->old = old;
+	l->old_of = calloc(fs->sb->s_inodes_count + 1, sizeof(*l->old_of));
+	l->pos = calloc(fs->sb->s_inodes_count + 1, sizeof(*l->pos));
+	if (!l->old_of || !l->pos)
+		error_msg_and_die(memory_exhausted);
+	layout_scan(l);
+	layout_reserve(fs, l);
+	fs->layout = l;
+	layout_premade(fs, EXT2_ROOT_INO, EXT2_ROOT_INO);
+	if ((nod = find_dir(fs, EXT2_ROOT_INO, "lost+found")))
+		layout_premade(fs, nod,
+			       layout_lookup(fs, EXT2_ROOT_INO, "lost+found"));
+}
+
+// Stop following the old layout and free what's still set aside
+static void
+layout_close(filesystem *fs)
+{
+	layout *l = fs->layout;
+	filesystem *old = l->old;
+
+	layout_release(fs);
+	fs->layout = NULL;
+	if (cache_flush(&old->inodes) || cache_flush(&old->blkmaps) ||
+	    cache_flush(&old->gds) || cache_flush(&old->blks))
+		error_msg_and_die("entry mismatch on layout image cache flush");
+	free_fs(old);
+	free(l->ents);
+	free(l->hash);
+	free(l->names);
+	free(l->old_of);
+	free(l->pos);
+	free(l->seq);
+	free(l->rblk);
+	free(l->rnod);
+	free(l);
+}
+
+// just walk through blocks list
+static void
+flist_blocks(filesystem *fs, uint32 nod, FILE *fh)
+{
+	blockwalker bw;
+	uint32 bk;
+	init_bw(&bw);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+		fprintf(fh, " %d", bk);
+	fprintf(fh, "\n");
+}
+
+// walk through blocks list
+static void
+list_blocks(filesystem *fs, uint32 nod)
+{
+	int bn = 0;
+	blockwalker bw;
+	uint32 bk;
+	init_bw(&bw);
+	printf("blocks in inode %d:", nod);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+		printf(" %d", bk), bn++;
+	printf("\n%d blocks (%d bytes)\n", bn, bn * BLOCKSIZE);
+}
+
+// saves blocks to FILE*
+static void
+write_blocks(filesystem *fs, uint32 nod, FILE* f)
+{
+	blockwalker bw;
+	uint32 bk;
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	int32 fsize = node->i_size;
+	blk_info *bi;
+
+	init_bw(&bw);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+	{
+		if(fsize <= 0)
+			error_msg_and_die("wrong size while saving inode %d", nod);
+		if(fwrite(get_blk(fs, bk, &bi),
+			  (fsize > BLOCKSIZE) ? BLOCKSIZE : fsize, 1, f) != 1)
+			error_msg_and_die("error while saving inode %d", nod);
+		put_blk(bi);
+		fsize -= BLOCKSIZE;
+	}
+	put_nod(ni);
+}
+
+
+// print block/char device minor and major
+static void
+print_dev(filesystem *fs, uint32 nod)
+{
+	int minor, major;
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	if (fs->swapit) {
+		minor = ((uint8*)node->i_block)[3];
+		major = ((uint8*)node->i_block)[2];
+	} else {
+		minor = ((uint8*)node->i_block)[0];
+		major = ((uint8*)node->i_block)[1];
+	}
+	put_nod(ni);
+	printf("major: %d, minor: %d\n", major, minor);
+}
+
+// print an inode as a directory
+static void
+print_dir(filesystem *fs, uint32 nod)
+{
+	blockwalker bw;
+	uint32 bk;
+	init_bw(&bw);
+	printf("directory for inode %d:\n", nod);
+	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
+	{
+		directory *d;
+		dirwalker dw;
+		for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
+			if(d->d_inode)
+			{
+				printf("entry '");
+				fwrite(dir_name(&dw), 1, d->d_name_len, stdout);
+				printf("' (inode %d): rec_len: %d (name_len: %d)\n", d->d_inode, d->d_rec_len, d->d_name_len);
+			}
+		put_dir(&dw);
+	}
+}
+
+// print a symbolic link
+static void
+print_link(filesystem *fs, uint32 nod)
 {
-	uint8 * b;
-	uint32 nod = mknod_fs(fs, parent_nod, name, mode|FM_IFREG, uid, gid, 0, 0, ctime, mtime);
 	nod_info *ni;
 	inode *node = get_nod(fs, nod, &ni);
-	off_t size = 0;
-	size_t readbytes;
-	inode_pos ipos;
-	int fullsize;
 
-	b = malloc(CB_SIZE);
-	if (!b)
-		error_msg_and_die("mkfile_fs: out of memory");
-	inode_pos_init(fs, &ipos, nod, INODE_POS_TRUNCATE, NULL);
-	readbytes = fread(b, 1, CB_SIZE, f);
-	while (readbytes) {
-		fullsize = rndup(readbytes, BLOCKSIZE);
-		// Fill to end of block with zeros.
-		memset(b + readbytes, 0, fullsize - readbytes);
-		extend_inode_blk(fs, &ipos, b, fullsize / BLOCKSIZE);
-		size += readbytes;
-		readbytes = fread(b, 1, CB_SIZE, f);
+	if (!node->i_blocks) {
+		if (fs->swapit) {
+			uint32 *buf = malloc(4 * (EXT2_TIND_BLOCK + 1));
+			if (buf == NULL)
+				error_msg_and_die(memory_exhausted);
+			swab32_into(buf, node->i_block, EXT2_TIND_BLOCK + 1);
+			printf("links to '%s'\n", (char*) buf);
+			free(buf);
+		} else {
+			printf("links to '%s'\n", (char*) node->i_block);
+		}
+	} else {
+		printf("links to '");
+		write_blocks(fs, nod, stdout);
+		printf("'\n");
 	}
-	if (size > 0x7fffffff) {
-		if (fs->sb->s_rev_level < 1)
-			fs_upgrade_rev1_largefile(fs);
-		fs->sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+	put_nod(ni);
+}
+
+// make a ls-like printout of permissions
+static void
+make_perms(uint32 mode, char perms[11])
+{
+	strcpy(perms, "----------");
+	if(mode & FM_IRUSR)
+		perms[1] = 'r';
+	if(mode & FM_IWUSR)
+		perms[2] = 'w';
+	if(mode & FM_IXUSR)
+		perms[3] = 'x';
+	if(mode & FM_IRGRP)
+		perms[4] = 'r';
+	if(mode & FM_IWGRP)
+		perms[5] = 'w';
+	if(mode & FM_IXGRP)
+		perms[6] = 'x';
+	if(mode & FM_IROTH)
+		perms[7] = 'r';
+	if(mode & FM_IWOTH)
+		perms[8] = 'w';
+	if(mode & FM_IXOTH)
+		perms[9] = 'x';
+	if(mode & FM_ISUID)
+		perms[3] = 's';
+	if(mode & FM_ISGID)
+		perms[6] = 's';
+	if(mode & FM_ISVTX)
+		perms[9] = 't';
+	switch(mode & FM_IFMT)
+	{
+		case 0:
+			*perms = '0';
+			break;
+		case FM_IFSOCK:
+			*perms = 's';
+			break;
+		case FM_IFLNK:
+			*perms = 'l';
+			break;
+		case FM_IFREG:
+			*perms = '-';
+			break;
+		case FM_IFBLK:
+			*perms = 'b';
+			break;
+		case FM_IFDIR:
+			*perms = 'd';
+			break;
+		case FM_IFCHR:
+			*perms = 'c';
+			break;
+		case FM_IFIFO:
+			*perms = 'p';
+			break;
+		default:
+			*perms = '?';
 	}
-	node->i_dir_acl = size >> 32;
-	node->i_size = size;
-	inode_pos_finish(fs, &ipos);
+}
+
+// print an inode
+static void
+print_inode(filesystem *fs, uint32 nod)
+{
+	char *s;
+	char perms[11];
+	nod_info *ni;
+	inode *node = get_nod(fs, nod, &ni);
+	blk_info *bi;
+	gd_info *gi;
+
+	if(!node->i_mode)
+		goto out;
+	switch(nod)
+	{
+		case EXT2_BAD_INO:
+			s = "bad blocks";
+			break;
+		case EXT2_ROOT_INO:
+			s = "root";
+			break;
+		case EXT2_ACL_IDX_INO:
+		case EXT2_ACL_DATA_INO:
+			s = "ACL";
+			break;
+		case EXT2_BOOT_LOADER_INO:
+			s = "boot loader";
+			break;
+		case EXT2_UNDEL_DIR_INO:
+			s = "undelete directory";
+			break;
+		default:
+			s = (nod >= EXT2_FIRST_INO) ? "normal" : "unknown reserved"; 
+	}
+	printf("inode %d (%s, %d links): ", nod, s, node->i_links_count);
+	if(!allocated(GRP_GET_INODE_BITMAP(fs,nod,&bi,&gi), GRP_IBM_OFFSET(fs,nod)))
+	{
+		GRP_PUT_INODE_BITMAP(bi,gi);
+		printf("unallocated\n");
+		goto out;
+	}
+	GRP_PUT_INODE_BITMAP(bi,gi);
+	make_perms(node->i_mode, perms);
+	printf("%s,  size: %d byte%s (%d block%s)\n", perms,
+	       plural(node->i_size), plural(node->i_blocks / INOBLK));
+	switch(node->i_mode & FM_IFMT)
+	{
+		case FM_IFSOCK:
+			list_blocks(fs, nod);
+			break;
+		case FM_IFLNK:
+			print_link(fs, nod);
+			break;
+		case FM_IFREG:
+			list_blocks(fs, nod);
+			break;
+		case FM_IFBLK:
+			print_dev(fs, nod);
+			break;
+		case FM_IFDIR:
+			list_blocks(fs, nod);
+			print_dir(fs, nod);
+			break;
+		case FM_IFCHR:
+			print_dev(fs, nod);
+			break;
+		case FM_IFIFO:
+			list_blocks(fs, nod);
+			break;
+		default:
+			list_blocks(fs, nod);
+	}
+	printf("Done with inode %d\n",nod);
+out:
 	put_nod(ni);
-	free(b);
-	return nod;
 }
 
-// retrieves a mode info from a struct stat
-static uint32
-get_mode(struct stat *st)
+// describes various fields in a filesystem
+static void
+print_fs(filesystem *fs)
 {
-	uint32 mode = 0;
+	uint32 i;
+	blk_info *bi;
+	groupdescriptor *gd;
+	gd_info *gi;
+	uint8 *ibm;
 
-	if(st->st_mode & S_IRUSR)
-		mode |= FM_IRUSR;
-	if(st->st_mode & S_IWUSR)
-		mode |= FM_IWUSR;
-	if(st->st_mode & S_IXUSR)
-		mode |= FM_IXUSR;
-	if(st->st_mode & S_IRGRP)
-		mode |= FM_IRGRP;
-	if(st->st_mode & S_IWGRP)
-		mode |= FM_IWGRP;
-	if(st->st_mode & S_IXGRP)
-		mode |= FM_IXGRP;
-	if(st->st_mode & S_IROTH)
-		mode |= FM_IROTH;
-	if(st->st_mode & S_IWOTH)
-		mode |= FM_IWOTH;
-	if(st->st_mode & S_IXOTH)
-		mode |= FM_IXOTH;
-	if(st->st_mode & S_ISUID)
-		mode |= FM_ISUID;
-	if(st->st_mode & S_ISGID)
-		mode |= FM_ISGID;
-	if(st->st_mode & S_ISVTX)
-		mode |= FM_ISVTX;
-	return mode;
+	printf("%d blocks (%d free, %d reserved), first data block: %d\n",
+	       fs->sb->s_blocks_count, fs->sb->s_free_blocks_count,
+	       fs->sb->s_r_blocks_count, fs->sb->s_first_data_block);
+	printf("%d inodes (%d free)\n", fs->sb->s_inodes_count,
+	       fs->sb->s_free_inodes_count);
+	printf("block size = %d, frag size = %d\n",
+	       fs->sb->s_log_block_size ? (fs->sb->s_log_block_size << 11) : 1024,
+	       fs->sb->s_log_frag_size ? (fs->sb->s_log_frag_size << 11) : 1024);
+	printf("number of groups: %d\n",GRP_NBGROUPS(fs));
+	printf("%d blocks per group,%d frags per group,%d inodes per group\n",
+	     fs->sb->s_blocks_per_group, fs->sb->s_frags_per_group,
+	     fs->sb->s_inodes_per_group);
+	printf("Size of inode table: %d blocks\n",
+		(int)(fs->sb->s_inodes_per_group * sizeof(inode) / BLOCKSIZE));
+	for (i = 0; i < GRP_NBGROUPS(fs); i++) {
+		printf("Group No: %d\n", i+1);
+		gd = get_gd(fs, i, &gi);
+		printf("block bitmap: block %d,inode bitmap: block %d, inode table: block %d\n",
+		     gd->bg_block_bitmap,
+		     gd->bg_inode_bitmap,
+		     gd->bg_inode_table);
+		printf("block bitmap allocation:\n");
+		print_bm(GRP_GET_GROUP_BBM(fs, gd, &bi),fs->sb->s_blocks_per_group);
+		GRP_PUT_GROUP_BBM(bi);
+		printf("inode bitmap allocation:\n");
+		ibm = GRP_GET_GROUP_IBM(fs, gd, &bi);
+		print_bm(ibm, fs->sb->s_inodes_per_group);
+		for (i = 1; i <= fs->sb->s_inodes_per_group; i++)
+			if (allocated(ibm, i))
+				print_inode(fs, i);
+		GRP_PUT_GROUP_IBM(bi);
+		put_gd(gi);
+	}
 }
 
-// add or fixup entries to the filesystem from a text file
-/*  device table entries take the form of:
-    <path>	<type> <mode>	<uid>	<gid>	<major>	<minor>	<start>	<inc>	<count>
-    /dev/mem     c    640       0       0         1       1       0     0         -
+/* What --layout-report measures: the blocks read to list each directory
+   with the attributes of its entries and then read its files, before
+   going into its subdirectories, as ls -lR or loading a package does,
+   and how far apart they are.  A block read right after another one,
+   or again, isn't a seek.  The files that have to seek backwards, to
+   an indirect block or to data, are counted too. */
 
-    type can be one of: 
-	f	A regular file
-	d	Directory
-	c	Character special device file
-	b	Block special device file
-	p	Fifo (named pipe)
+typedef struct
+{
+	uint32 last;	// last block read
+	uint64 reads;
+	uint64 seeks;
+	uint64 dist;	// sum of the seek distances, in blocks
+	uint64 files;
+	uint64 backward;	// files not read in one forward sweep
+	int back;	// a seek backwards since the first read after it was -1
+} seek_stats;
 
-    I don't bother with symlinks (permissions are irrelevant), hard
-    links (special cases of regular files), or sockets (why bother).
+static void
+seek_read(seek_stats *ss, uint32 blk)
+{
+	if (ss->reads && blk == ss->last)
+		return;
+	if (ss->back < 0)
+		ss->back = 0;
+	else if (ss->reads && blk < ss->last)
+		ss->back = 1;
+	if (ss->reads && blk != ss->last + 1) {
+		ss->seeks++;
+		ss->dist += blk > ss->last ? blk - ss->last : ss->last - blk;
+	}
+	ss->reads++;
+	ss->last = blk;
+}
 
-    Regular files must exist in the target root directory.  If a char,
-    block, fifo, or directory does not exist, it will be created.
-*/
+// the inode table block holding nod
+static uint32
+seek_inode_blk(filesystem *fs, uint32 nod)
+{
+	groupdescriptor *gd;
+	gd_info *gi;
+	uint32 blk;
+
+	gd = get_gd(fs, GRP_GROUP_OF_INODE(fs, nod), &gi);
+	blk = gd->bg_inode_table + (GRP_IBM_OFFSET(fs, nod) - 1) / INODES_PER_BLOCK;
+	put_gd(gi);
+	return blk;
+}
 
+// an indirect block of depth levels, then the blocks it maps
 static void
-add2fs_from_file(filesystem *fs, uint32 this_nod, FILE * fh, uint32 fs_timestamp, struct stats *stats)
+seek_ind(filesystem *fs, seek_stats *ss, uint32 bk, int depth)
 {
-	unsigned long mode, uid, gid, major, minor;
-	unsigned long start, increment, count;
-	uint32 nod, ctime, mtime;
-	char *c, type, *path = NULL, *path2 = NULL, *dir, *name, *line = NULL;
-	size_t len;
-	struct stat st;
-	int nbargs, lineno = 0;
+	blkmap_info *bmi;
+	uint32 *b;
+	int i;
 
-	fstat(fileno(fh), &st);
-	ctime = fs_timestamp;
-	mtime = st.st_mtime;
-	while(getline(&line, &len, fh) >= 0)
-	{
-		mode = uid = gid = major = minor = 0;
-		start = 0; increment = 1; count = 0;
-		lineno++;
-		if((c = strchr(line, '#')))
-			*c = 0;
-		if (path) {
-			free(path);
-			path = NULL;
-		}
-		if (path2) {
-			free(path2);
-			path2 = NULL;
-		}
-		nbargs = sscanf (line, "%" SCANF_PREFIX "s %c %lo %lu %lu %lu %lu %lu %lu %lu",
-					SCANF_STRING(path), &type, &mode, &uid, &gid, &major, &minor,
-					&start, &increment, &count);
-		if(nbargs < 3)
-		{
-			if(nbargs > 0)
-				error_msg("device table line %d skipped: bad format for entry '%s'", lineno, path);
-			continue;
-		}
-		mode &= FM_IMASK;
-		path2 = strdup(path);
-		name = basename(path);
-		dir = dirname(path2);
-		if((!strcmp(name, ".")) || (!strcmp(name, "..")))
-		{
-			error_msg("device table line %d skipped", lineno);
-			continue;
-		}
-		if(fs)
-		{
-			if(!(nod = find_path(fs, this_nod, dir)))
-			{
-				error_msg("device table line %d skipped: can't find directory '%s' to create '%s''", lineno, dir, name);
-				continue;
-			}
-		}
-		else
-			nod = 0;
-		switch (type)
-		{
-			case 'd':
-				mode |= FM_IFDIR;
-				break;
-			case 'f':
-				mode |= FM_IFREG;
-				break;
-			case 'p':
-				mode |= FM_IFIFO;
-				break;
-			case 's':
-				mode |= FM_IFSOCK;
-				break;
-			case 'c':
-				mode |= FM_IFCHR;
-				break;
-			case 'b':
-				mode |= FM_IFBLK;
-				break;
-			default:
-				error_msg("device table line %d skipped: bad type '%c' for entry '%s'", lineno, type, name);
-				continue;
-		}
-		if(stats) {
-			if(count > 0)
-				stats->ninodes += count - start;
-			else
-				stats->ninodes++;
-		} else {
-			if(count > 0)
-			{
-				char *dname;
-				unsigned long i;
-				unsigned len;
-				len = strlen(name) + 10;
-				dname = malloc(len + 1);
-				for(i = start; i < count; i++)
-				{
-					uint32 oldnod;
-					SNPRINTF(dname, len, "%s%lu", name, i);
-					oldnod = find_dir(fs, nod, dname);
-					if(oldnod)
-						chmod_fs(fs, oldnod, mode, uid, gid);
-					else
-						mknod_fs(fs, nod, dname, mode, uid, gid, major, minor + (i * increment - start), ctime, mtime);
-				}
-				free(dname);
-			}
-			else
-			{
-				uint32 oldnod = find_dir(fs, nod, name);
-				if(oldnod)
-					chmod_fs(fs, oldnod, mode, uid, gid);
-				else
-					mknod_fs(fs, nod, name, mode, uid, gid, major, minor, ctime, mtime);
-			}
-		}
-	}
-	if (line)
-		free(line);
-	if (path) 
-		free(path);
-	if (path2)
-		free(path2);
+	if (!bk)
+		return;
+	seek_read(ss, bk);
+	if (!depth)
+		return;
+	b = get_blkmap(fs, bk, &bmi);
+	for (i = 0; i < BLOCKSIZE / 4; i++)
+		seek_ind(fs, ss, b[i], depth - 1);
+	put_blkmap(bmi);
 }
 
-// adds a tree of entries to the filesystem from current dir
+// a regular file, reading each indirect block before the blocks it maps
 static void
-add2fs_from_dir(filesystem *fs, uint32 this_nod, int squash_uids, int squash_perms, uint32 fs_timestamp, struct stats *stats)
+seek_data(filesystem *fs, seek_stats *ss, uint32 nod)
 {
-	uint32 nod;
-	uint32 uid, gid, mode, ctime, mtime;
-	const char *name;
-	FILE *fh;
-	DIR *dh;
-	struct dirent *dent;
-	struct stat st;
-	char *lnk;
-	uint32 save_nod;
+	uint32 blks[EXT2_TIND_BLOCK + 1];
+	nod_info *ni;
+	int i;
 
-	if(!(dh = opendir(".")))
-		perror_msg_and_die(".");
-	while((dent = readdir(dh)))
-	{
-		if((!strcmp(dent->d_name, ".")) || (!strcmp(dent->d_name, "..")))
-			continue;
-		lstat(dent->d_name, &st);
-		uid = st.st_uid;
-		gid = st.st_gid;
-		ctime = fs_timestamp;
-		mtime = st.st_mtime;
-		name = dent->d_name;
-		mode = get_mode(&st);
-		if(squash_uids)
-			uid = gid = 0;
-		if(squash_perms)
-			mode &= ~(FM_IRWXG | FM_IRWXO);
-		if(stats)
-			switch(st.st_mode & S_IFMT)
-			{
-				case S_IFLNK:
-					if((st.st_mode & S_IFMT) == S_IFREG || st.st_size >= 4 * (EXT2_TIND_BLOCK+1))
-						stats->nblocks += (st.st_size + BLOCKSIZE - 1) / BLOCKSIZE;
-					stats->ninodes++;
-					break;
-				case S_IFREG:
-					if((st.st_mode & S_IFMT) == S_IFREG || st.st_size > 4 * (EXT2_TIND_BLOCK+1))
-						stats->nblocks += (st.st_size + BLOCKSIZE - 1) / BLOCKSIZE;
-				case S_IFCHR:
-				case S_IFBLK:
-				case S_IFIFO:
-				case S_IFSOCK:
-					stats->ninodes++;
-					break;
-				case S_IFDIR:
-					stats->ninodes++;
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(dent->d_name);
-					add2fs_from_dir(fs, this_nod, squash_uids, squash_perms, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
+	memcpy(blks, get_nod(fs, nod, &ni)->i_block, sizeof(blks));
+	put_nod(ni);
+	ss->files++;
+	ss->back = -1;
+	for (i = 0; i < EXT2_IND_BLOCK; i++)
+		seek_ind(fs, ss, blks[i], 0);
+	seek_ind(fs, ss, blks[EXT2_IND_BLOCK], 1);
+	seek_ind(fs, ss, blks[EXT2_DIND_BLOCK], 2);
+	seek_ind(fs, ss, blks[EXT2_TIND_BLOCK], 3);
+	if (ss->back > 0)
+		ss->backward++;
+}
 
-					break;
-				default:
-					break;
-			}
-		else
-		{
-			if((nod = find_dir(fs, this_nod, name)))
-			{
-				error_msg("ignoring duplicate entry %s", name);
-				if(S_ISDIR(st.st_mode)) {
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(name);
-					add2fs_from_dir(fs, nod, squash_uids, squash_perms, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
-				}
+static void
+seek_dir(filesystem *fs, seek_stats *ss, uint32 dir)
+{
+	uint32 *nods = NULL, n = 0, max = 0, bk, i;
+	uint16 *modes = NULL;
+	blockwalker bw;
+	dirwalker dw;
+	directory *d;
+	nod_info *ni;
+	char *name;
+
+	// the directory itself, collecting its entries
+	init_bw(&bw);
+	while ((bk = walk_bw(fs, dir, &bw, 0, 0)) != WALK_END) {
+		seek_read(ss, bk);
+		for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw)) {
+			name = dir_name(&dw);
+			if (!d->d_inode ||
+			    (d->d_name_len == 1 && name[0] == '.') ||
+			    (d->d_name_len == 2 && !strncmp(name, "..", 2)))
 				continue;
+			if (n == max) {
+				max = max ? max * 2 : 64;
+				nods = realloc(nods, max * sizeof(*nods));
+				modes = realloc(modes, max * sizeof(*modes));
+				if (!nods || !modes)
+					error_msg_and_die(memory_exhausted);
 			}
-			save_nod = 0;
-			/* Check for hardlinks */
-			if (!S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode) && st.st_nlink > 1) {
-				int32 hdlink = is_hardlink(fs, st.st_ino);
-				if (hdlink >= 0) {
-					add2dir(fs, this_nod, fs->hdlinks.hdl[hdlink].dst_nod, name);
-					continue;
-				} else {
-					save_nod = 1;
-				}
-			}
-			switch(st.st_mode & S_IFMT)
-			{
-#if HAVE_STRUCT_STAT_ST_RDEV
-				case S_IFCHR:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFCHR, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
-					break;
-				case S_IFBLK:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFBLK, uid, gid, major(st.st_rdev), minor(st.st_rdev), ctime, mtime);
-					break;
-#endif
-				case S_IFIFO:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFIFO, uid, gid, 0, 0, ctime, mtime);
-					break;
-				case S_IFSOCK:
-					nod = mknod_fs(fs, this_nod, name, mode|FM_IFSOCK, uid, gid, 0, 0, ctime, mtime);
-					break;
-				case S_IFLNK:
-					lnk = calloc(1, rndup(st.st_size, BLOCKSIZE));
-					if (lnk == NULL)
-						error_msg_and_die(memory_exhausted);
-					if (readlink(dent->d_name, lnk, st.st_size) > 0)
-						mklink_fs(fs, this_nod, name, st.st_size, (uint8*)lnk, uid, gid, ctime, mtime);
-					else
-						error_msg("readlink: %s", dent->d_name);
-					free(lnk);
-					break;
-				case S_IFREG:
-					fh = fopen(dent->d_name, "rb");
-					if (!fh) {
-						error_msg("Unable to open file %s", dent->d_name);
-						break;
-					}
-					nod = mkfile_fs(fs, this_nod, name, mode, fh, uid, gid, ctime, mtime);
-					fclose(fh);
-					break;
-				case S_IFDIR:
-					nod = mkdir_fs(fs, this_nod, name, mode, uid, gid, ctime, mtime);
-					if(chdir(dent->d_name) < 0)
-						perror_msg_and_die(name);
-					add2fs_from_dir(fs, nod, squash_uids, squash_perms, fs_timestamp, stats);
-					if (chdir("..") == -1)
-						perror_msg_and_die("..");
-					break;
-				default:
-					error_msg("ignoring entry %s", name);
-			}
-			if (save_nod) {
-				if (fs->hdlinks.count == fs->hdlink_cnt) {
-					if ((fs->hdlinks.hdl =
-						 realloc (fs->hdlinks.hdl, (fs->hdlink_cnt + HDLINK_CNT) *
-								  sizeof (struct hdlink_s))) == NULL) {
-						error_msg_and_die("Not enough memory");
-					}
-					fs->hdlink_cnt += HDLINK_CNT;
-				}
-				fs->hdlinks.hdl[fs->hdlinks.count].src_inode = st.st_ino;
-				fs->hdlinks.hdl[fs->hdlinks.count].dst_nod = nod;
-				fs->hdlinks.count++;
-			}
+			nods[n++] = d->d_inode;
 		}
+		put_dir(&dw);
 	}
-	closedir(dh);
+	// the attributes of the entries
+	for (i = 0; i < n; i++) {
+		seek_read(ss, seek_inode_blk(fs, nods[i]));
+		modes[i] = get_nod(fs, nods[i], &ni)->i_mode & FM_IFMT;
+		put_nod(ni);
+	}
+	for (i = 0; i < n; i++)
+		if (modes[i] == FM_IFREG)
+			seek_data(fs, ss, nods[i]);
+	for (i = 0; i < n; i++)
+		if (modes[i] == FM_IFDIR)
+			seek_dir(fs, ss, nods[i]);
+	free(nods);
+	free(modes);
 }
 
-// Copy size blocks from src to dst, putting holes in the output
-// file (if possible) if the input block is all zeros.
-// Copy size blocks from src to dst, putting holes in the output
-// file (if possible) if the input block is all zeros.
 static void
-copy_file(filesystem *fs, FILE *dst, FILE *src, size_t size)
+report_layout(filesystem *fs, FILE *out)
 {
-	uint8 *b;
+	seek_stats ss;
+
+	memset(&ss, 0, sizeof(ss));
+	seek_read(&ss, seek_inode_blk(fs, EXT2_ROOT_INO));
+	seek_dir(fs, &ss, EXT2_ROOT_INO);
+	fprintf(out, "layout: %llu blocks read, %llu seeks, %llu blocks of seek distance"
+		" (%.1f per block read)\n", (unsigned long long) ss.reads,
+		(unsigned long long) ss.seeks, (unsigned long long) ss.dist,
+		ss.reads ? (double) ss.dist / ss.reads : 0.0);
+	fprintf(out, "layout: %llu of %llu files not read in one forward sweep\n",
+		(unsigned long long) ss.backward, (unsigned long long) ss.files);
+}
 
-	b = malloc(BLOCKSIZE);
-	if (!b)
-		error_msg_and_die("copy_file: out of memory");
-	if (fseek(src, 0, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (ftruncate(fileno(dst), 0))
-		perror_msg_and_die("copy_file: ftruncate");
-	while (size > 0) {
-		if (fread(b, BLOCKSIZE, 1, src) != 1)
-			perror_msg_and_die("copy failed on read");
-		if ((dst != stdout) && fs->holes && is_blk_empty(b)) {
-			/* Empty block, just skip it */
-			if (fseek(dst, BLOCKSIZE, SEEK_CUR))
-				perror_msg_and_die("fseek");
-		} else {
-			if (fwrite(b, BLOCKSIZE, 1, dst) != 1)
-				perror_msg_and_die("copy failed on write");
-		}
-		size--;
-	}
-	free(b);
+// the files that --align did align, and the free blocks left in the
+// alignment unit in front of them, that only later files can still use
+static void
+report_align(filesystem *fs, FILE *out)
+{
+	uint32 i, bk, gap = 0;
+
+	for (i = 0; i < aligned.count; i++)
+		for (bk = aligned.starts[i]; bk > aligned.starts[i] - align / BLOCKSIZE &&
+		     blks_free(fs, bk - 1, 1); bk--)
+			gap++;
+	fprintf(out, "align: %u of %u files aligned, %u free blocks in front of them"
+		" (%.2f%% of the image)\n", aligned.count, aligned.files, gap,
+		100.0 * gap / fs->sb->s_blocks_count);
+	free(aligned.starts);
 }
 
-// Allocate a new filesystem structure, allocate internal memory,
-// and initialize the contents.
-static filesystem *
-alloc_fs(int swapit, char *fname, uint32 nbblocks, FILE *srcfile)
+static int
+blk_info_cmp(const void *a, const void *b)
 {
-	filesystem *fs;
-	struct stat srcstat, dststat;
+	uint32 ba = (*(blk_info **) a)->blk, bb = (*(blk_info **) b)->blk;
+	return (ba > bb) - (ba < bb);
+}
 
-	fs = malloc(sizeof(*fs));
-	if (!fs)
-		error_msg_and_die("not enough memory for filesystem");
-	memset(fs, 0, sizeof(*fs));
-	fs->swapit = swapit;
-	cache_init(&fs->blks, MAX_FREE_CACHE_BLOCKS, blk_elem_val, blk_freed);
-	cache_init(&fs->gds, MAX_FREE_CACHE_GDS, gd_elem_val, gd_freed);
-	cache_init(&fs->blkmaps, MAX_FREE_CACHE_BLOCKMAPS,
-		   blkmap_elem_val, blkmap_freed);
-	cache_init(&fs->inodes, MAX_FREE_CACHE_INODES,
-		   inode_elem_val, inode_freed);
-	fs->hdlink_cnt = HDLINK_CNT;
-	fs->hdlinks.hdl = calloc(sizeof(struct hdlink_s), fs->hdlink_cnt);
-	if (!fs->hdlinks.hdl)
-		error_msg_and_die("Not enough memory");
-	fs->hdlinks.count = 0 ;
+#define FLUSH_IOV 64
 
-	if (strcmp(fname, "-") == 0)
-		fs->f = tmpfile();
-	else if (srcfile) {
-		if (fstat(fileno(srcfile), &srcstat))
-			perror_msg_and_die("fstat srcfile");
-		if (stat(fname, &dststat) == 0
-		    && srcstat.st_ino == dststat.st_ino
-		    && srcstat.st_dev == dststat.st_dev)
-		  {
-			// source and destination are the same file, don't
-			// truncate or copy, just use the file.
-			fs->f = fopen(fname, "r+b");
-		} else {
-			fs->f = fopen(fname, "w+b");
-			if (fs->f)
-				copy_file(fs, fs->f, srcfile, nbblocks);
+// Write back all the cached blocks in block order, merging consecutive
+// blocks into a single write.  The cache must be flushed right after
+// this, without writing the blocks again.
+static void
+write_blks(filesystem *fs)
+{
+	blk_info **bis;
+	struct iovec iov[FLUSH_IOV];
+	list_elem *elem;
+	uint32 i, n = 0, first = 0;
+	int cnt = 0;
+
+	bis = malloc(fs->blks.entries * sizeof(*bis));
+	if (fs->blks.entries && !bis)
+		error_msg_and_die("write_blks: out of memory");
+	for (i = 0; i < CACHE_LISTS; i++)
+		list_for_each_elem(&fs->blks.lists[i], elem)
+			bis[n++] = container_of(elem, blk_info, link.link);
+	qsort(bis, n, sizeof(*bis), blk_info_cmp);
+	for (i = 0; i <= n; i++) {
+		if (cnt && (i == n || cnt == FLUSH_IOV ||
+			    bis[i]->blk != bis[first]->blk + cnt)) {
+			io_writev(fs->io, iov, cnt, ((off_t) bis[first]->blk) * BLOCKSIZE);
+			cnt = 0;
 		}
-	} else
-		fs->f = fopen(fname, "w+b");
-	if (!fs->f)
-		perror_msg_and_die("opening %s", fname);
-	return fs;
+		if (i == n)
+			break;
+		if (!cnt)
+			first = i;
+		iov[cnt].iov_base = bis[i]->b;
+		iov[cnt].iov_len = BLOCKSIZE;
+		cnt++;
+	}
+	free(bis);
+	fs->blks_clean = 1;
 }
 
-/* Make sure the output file is the right size */
+// Write everything cached to the image and empty the caches, so the
+// image itself is up to date
 static void
-set_file_size(filesystem *fs)
+flush_fs(filesystem *fs)
 {
-	if (ftruncate(fileno(fs->f),
-		      ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE))
-		perror_msg_and_die("set_file_size: ftruncate");
+	if (cache_flush(&fs->inodes))
+		error_msg_and_die("entry mismatch on inode cache flush");
+	if (cache_flush(&fs->blkmaps))
+		error_msg_and_die("entry mismatch on blockmap cache flush");
+	if (cache_flush(&fs->gds))
+		error_msg_and_die("entry mismatch on gd cache flush");
+	wb_barrier(fs->wb);
+	write_blks(fs);
+	if (cache_flush(&fs->blks))
+		error_msg_and_die("entry mismatch on block cache flush");
+	fs->blks_clean = 0;
 }
 
-// initialize an empty filesystem
-static filesystem *
-init_fs(int nbblocks, int nbinodes, int nbresrvd, int holes,
-	uint32 fs_timestamp, uint32 creator_os, int swapit, char *fname)
+// die unless each group has its metadata where init_fs puts it, after
+// gdsz descriptor blocks, as what needs
+static void
+check_groups(filesystem *fs, uint32 gdsz, const char *what)
 {
-	uint32 i;
-	filesystem *fs;
-	dirwalker dw;
-	uint32 nod, first_block;
-	uint32 nbgroups,nbinodes_per_group,overhead_per_group,free_blocks,
-		free_blocks_per_group,nbblocks_per_group,min_nbgroups;
-	uint32 gdsz,itblsz,bbmpos,ibmpos,itblpos;
-	uint32 j;
-	uint8 *bbm,*ibm;
-	inode *itab0;
-	blk_info *bi;
-	nod_info *ni;
+	uint32 grp, start;
 	groupdescriptor *gd;
 	gd_info *gi;
-	inode_pos ipos;
-	
-	if(nbresrvd < 0)
-		error_msg_and_die("reserved blocks value is invalid. Note: options have changed, see --help or the man page.");
-	if(nbinodes < EXT2_FIRST_INO - 1 + (nbresrvd ? 1 : 0))
-		error_msg_and_die("too few inodes. Note: options have changed, see --help or the man page.");
-	if(nbblocks < 8)
-		error_msg_and_die("too few blocks. Note: options have changed, see --help or the man page.");
-
-	/* nbinodes is the total number of inodes in the system.
-	 * a block group can have no more than 8192 inodes.
-	 */
-	min_nbgroups = (nbinodes + INODES_PER_GROUP - 1) / INODES_PER_GROUP;
-
-	/* On filesystems with 1k block size, the bootloader area uses a full
-	 * block. For 2048 and up, the superblock can be fitted into block 0.
-	 */
-	first_block = (BLOCKSIZE == 1024);
-
-	/* nbblocks is the total number of blocks in the filesystem.
-	 * a block group can have no more than 8192 blocks.
-	 */
-	nbgroups = (nbblocks - first_block + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
-	if(nbgroups < min_nbgroups) nbgroups = min_nbgroups;
-	nbblocks_per_group = rndup((nbblocks - first_block + nbgroups - 1)/nbgroups, 8);
-	nbinodes_per_group = rndup((nbinodes + nbgroups - 1)/nbgroups,
-						(BLOCKSIZE/sizeof(inode)));
-	if (nbinodes_per_group < 16)
-		nbinodes_per_group = 16; //minimum number b'cos the first 10 are reserved
 
-	gdsz = rndup(nbgroups*sizeof(groupdescriptor),BLOCKSIZE)/BLOCKSIZE;
-	itblsz = nbinodes_per_group * sizeof(inode)/BLOCKSIZE;
-	overhead_per_group = 3 /*sb,bbm,ibm*/ + gdsz + itblsz;
-	free_blocks = nbblocks - overhead_per_group*nbgroups - first_block;
-	free_blocks_per_group = nbblocks_per_group - overhead_per_group;
-
-	fs = alloc_fs(swapit, fname, nbblocks, NULL);
-	fs->sb = calloc(1, SUPERBLOCK_SIZE);
-	if (!fs->sb)
-		error_msg_and_die("error allocating header memory");
+	for (grp = 0; grp < GRP_NBGROUPS(fs); grp++) {
+		start = fs->sb->s_first_data_block + grp * fs->sb->s_blocks_per_group;
+		gd = get_gd(fs, grp, &gi);
+		if (gd->bg_block_bitmap != start + 1 + gdsz ||
+		    gd->bg_inode_bitmap != start + 2 + gdsz ||
+		    gd->bg_inode_table != start + 3 + gdsz)
+			error_msg_and_die("%s: the image isn't laid out as genext2fs does it", what);
+		put_gd(gi);
+	}
+}
 
-	// create the superblock for an empty filesystem
-	fs->sb->s_inodes_count = nbinodes_per_group * nbgroups;
+/* A -x image with a larger -b grows in place: the last group is
+   extended and groups are added after it, laid out as init_fs does
+   with the same size and number of inodes, so nothing already there
+   moves.  Only as many groups as the descriptor blocks already in
+   each group have room for can be added. */
+static void
+grow_fs(filesystem *fs, uint32 nbblocks)
+{
+	uint32 first = fs->sb->s_first_data_block;
+	uint32 bpg = fs->sb->s_blocks_per_group, ipg = fs->sb->s_inodes_per_group;
+	uint32 nbgroups = GRP_NBGROUPS(fs), ngroups, grp, start, size, i;
+	uint32 gdsz = rndup(nbgroups * sizeof(groupdescriptor), BLOCKSIZE) / BLOCKSIZE;
+	uint32 overhead = 3 + gdsz + ipg * sizeof(inode) / BLOCKSIZE;
+	uint32 oldblocks = fs->sb->s_blocks_count;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	uint8 *bm;
+
+	check_groups(fs, gdsz, "-x with a larger -b");
+	ngroups = (nbblocks - first + bpg - 1) / bpg;
+	if (ngroups > gdsz * GDS_PER_BLOCK)
+		error_msg_and_die("-x image can't grow past %u blocks without moving data",
+				  first + gdsz * GDS_PER_BLOCK * bpg);
+	// a last group too small for its own metadata is left out
+	if (ngroups > nbgroups &&
+	    nbblocks - first - (ngroups - 1) * bpg <= overhead) {
+		ngroups--;
+		nbblocks = first + ngroups * bpg;
+		error_msg("last group too small, growing to %u blocks", nbblocks);
+	}
+	if (nbblocks <= oldblocks)
+		return;
 	fs->sb->s_blocks_count = nbblocks;
-	fs->sb->s_r_blocks_count = nbresrvd;
-	fs->sb->s_free_blocks_count = free_blocks;
-	fs->sb->s_free_inodes_count = fs->sb->s_inodes_count - EXT2_FIRST_INO + 1;
-	fs->sb->s_first_data_block = first_block;
-	fs->sb->s_log_block_size = BLOCKSIZE >> 11;
-	fs->sb->s_log_frag_size = BLOCKSIZE >> 11;
-	fs->sb->s_blocks_per_group = nbblocks_per_group;
-	fs->sb->s_frags_per_group = nbblocks_per_group;
-	fs->sb->s_inodes_per_group = nbinodes_per_group;
-	fs->sb->s_wtime = fs_timestamp;
-	fs->sb->s_magic = EXT2_MAGIC_NUMBER;
-	fs->sb->s_lastcheck = fs_timestamp;
-	fs->sb->s_creator_os = creator_os;
-
+	fs->sb->s_inodes_count = ngroups * ipg;
+	fs->sb->s_r_blocks_count = (unsigned long long) fs->sb->s_r_blocks_count
+				   * nbblocks / oldblocks;
 	set_file_size(fs);
 
-	// set up groupdescriptors
-	for(i=0, bbmpos=first_block+1+gdsz, ibmpos=bbmpos+1, itblpos=ibmpos+1;
-		i<nbgroups;
-		i++, bbmpos+=nbblocks_per_group, ibmpos+=nbblocks_per_group, itblpos+=nbblocks_per_group)
-	{
-		gd = get_gd(fs, i, &gi);
+	for (grp = nbgroups - 1; grp < ngroups; grp++) {
+		start = first + grp * bpg;
+		size = nbblocks - start;
+		if (size > bpg)
+			size = bpg;
+		gd = get_gd(fs, grp, &gi);
+		if (grp < nbgroups) {
+			// the blocks past the old end, that the bitmap padded
+			bm = GRP_GET_GROUP_BBM(fs, gd, &bi);
+			i = oldblocks - start;
+			deallocate_range(bm, i + 1, size);
+			GRP_PUT_GROUP_BBM(bi);
+			gd->bg_free_blocks_count += size - i;
+			fs->sb->s_free_blocks_count += size - i;
+			put_gd(gi);
+			continue;
+		}
+		memset(gd, 0, sizeof(*gd));
+		gd->bg_block_bitmap = start + 1 + gdsz;
+		gd->bg_inode_bitmap = start + 2 + gdsz;
+		gd->bg_inode_table = start + 3 + gdsz;
+		gd->bg_free_blocks_count = size - overhead;
+		gd->bg_free_inodes_count = ipg;
+		fs->sb->s_free_blocks_count += size - overhead;
+		fs->sb->s_free_inodes_count += ipg;
+		bm = get_blk_op(fs, gd->bg_block_bitmap, &bi, BLK_ZERO);
+		allocate_range(bm, 1, overhead);
+		allocate_range(bm, size + 1, BLOCKSIZE * 8);
+		put_blk(bi);
+		bm = get_blk_op(fs, gd->bg_inode_bitmap, &bi, BLK_ZERO);
+		allocate_range(bm, ipg + 1, BLOCKSIZE * 8);
+		put_blk(bi);
+		put_gd(gi);
+	}
+}
 
-		if(free_blocks > free_blocks_per_group) {
-			gd->bg_free_blocks_count = free_blocks_per_group;
-			free_blocks -= free_blocks_per_group;
+/* --shrink: once the tree is in, cut the image down to the fewest
+   groups, and blocks in the last one, that still hold it, as
+   resize2fs -M does.  The groups keep their size and layout, so the
+   inodes of the groups dropped get new numbers in the ones kept and
+   the blocks past the new end are copied to free ones before it. */
+
+// move a block, and for depth > 0 the blocks it maps, to before end
+static void
+shrink_ind(filesystem *fs, uint32 *bk, int depth, uint32 end, uint32 *next)
+{
+	blkmap_info *bmi, *nbmi;
+	blk_info *bi, *nbi;
+	uint32 *b, nbk;
+	int i;
+
+	if (!*bk)
+		return;
+	if (*bk >= end) {
+		if (!(nbk = alloc_after(fs, *next, 0)) &&
+		    !(nbk = alloc_after(fs, 0, 0)))
+			error_msg_and_die("--shrink: no room left to move a block");
+		// an indirect block is copied as a block map, as it's cached
+		if (depth) {
+			memcpy(get_blkmap_op(fs, nbk, &nbmi, BLK_ZERO),
+			       get_blkmap(fs, *bk, &bmi), BLOCKSIZE);
+			put_blkmap(bmi);
+			put_blkmap(nbmi);
 		} else {
-			gd->bg_free_blocks_count = free_blocks;
-			free_blocks = 0; // this is the last block group
+			memcpy(get_blk_op(fs, nbk, &nbi, BLK_ZERO),
+			       get_blk(fs, *bk, &bi), BLOCKSIZE);
+			put_blk(bi);
+			put_blk(nbi);
 		}
-		if(i)
-			gd->bg_free_inodes_count = nbinodes_per_group;
-		else
-			gd->bg_free_inodes_count = nbinodes_per_group -
-							EXT2_FIRST_INO + 2;
-		gd->bg_used_dirs_count = 0;
-		gd->bg_block_bitmap = bbmpos;
-		gd->bg_inode_bitmap = ibmpos;
-		gd->bg_inode_table = itblpos;
-		put_gd(gi);
+		*bk = nbk;
+		*next = nbk + 1;
 	}
+	if (!depth)
+		return;
+	b = get_blkmap(fs, *bk, &bmi);
+	for (i = 0; i < BLOCKSIZE / 4; i++)
+		shrink_ind(fs, &b[i], depth - 1, end, next);
+	put_blkmap(bmi);
+}
 
-	/* Mark non-filesystem blocks and inodes as allocated */
-	/* Mark system blocks and inodes as allocated         */
-	for(i = 0; i<nbgroups;i++) {
-		/* Block bitmap */
-		gd = get_gd(fs, i, &gi);
-		bbm = GRP_GET_GROUP_BBM(fs, gd, &bi);
-		//non-filesystem blocks
-		for(j = gd->bg_free_blocks_count
-		        + overhead_per_group + 1; j <= BLOCKSIZE * 8; j++)
-			allocate(bbm, j); 
-		//system blocks
-		for(j = 1; j <= overhead_per_group; j++)
-			allocate(bbm, j); 
-		GRP_PUT_GROUP_BBM(bi);
+// the inodes in use, in the first nbgroups groups, in an array to free
+static uint32 *
+shrink_inodes(filesystem *fs, uint32 nbgroups, uint32 *count)
+{
+	uint32 ipg = fs->sb->s_inodes_per_group, grp, i, n = 0, *nods;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	uint8 *ibm;
 
-		/* Inode bitmap */
+	if (!(nods = malloc((fs->sb->s_inodes_count - fs->sb->s_free_inodes_count)
+			    * sizeof(*nods))))
+		error_msg_and_die(memory_exhausted);
+	for (grp = 0; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
 		ibm = GRP_GET_GROUP_IBM(fs, gd, &bi);
-		//non-filesystem inodes
-		for(j = fs->sb->s_inodes_per_group+1; j <= BLOCKSIZE * 8; j++)
-			allocate(ibm, j);
-
-		//system inodes
-		if(i == 0)
-			for(j = 1; j < EXT2_FIRST_INO; j++)
-				allocate(ibm, j);
+		for (i = 1; i <= ipg; i++)
+			if (allocated(ibm, i))
+				nods[n++] = grp * ipg + i;
 		GRP_PUT_GROUP_IBM(bi);
 		put_gd(gi);
 	}
+	*count = n;
+	return nods;
+}
 
-	// make root inode and directory
-	/* We have groups now. Add the root filesystem in group 0 */
-	/* Also increment the directory count for group 0 */
-	gd = get_gd(fs, 0, &gi);
-	gd->bg_free_inodes_count--;
-	gd->bg_used_dirs_count = 1;
-	put_gd(gi);
-	itab0 = get_nod(fs, EXT2_ROOT_INO, &ni);
-	itab0->i_mode = FM_IFDIR | FM_IRWXU | FM_IRGRP | FM_IROTH | FM_IXGRP | FM_IXOTH;
-	itab0->i_ctime = fs_timestamp;
-	itab0->i_mtime = fs_timestamp;
-	itab0->i_atime = fs_timestamp;
-	itab0->i_size = BLOCKSIZE;
-	itab0->i_links_count = 2;
-	put_nod(ni);
+// give the entries of the directories the new numbers of the inodes
+// moved, map[old - first]
+static void
+shrink_renumber(filesystem *fs, uint32 *nods, uint32 n, uint32 first, uint32 *map)
+{
+	uint32 i, bk;
+	blockwalker bw;
+	dirwalker dw;
+	directory *d;
+	nod_info *ni;
+	int dir;
 
-	new_dir(fs, EXT2_ROOT_INO, ".", 1, &dw);
-	shrink_dir(&dw, EXT2_ROOT_INO, "..", 2);
-	next_dir(&dw); // Force the data into the buffer
-	inode_pos_init(fs, &ipos, EXT2_ROOT_INO, INODE_POS_EXTEND, NULL);
-	extend_inode_blk(fs, &ipos, dir_data(&dw), 1);
-	inode_pos_finish(fs, &ipos);
-	put_dir(&dw);
+	for (i = 0; i < n; i++) {
+		dir = (get_nod(fs, nods[i], &ni)->i_mode & FM_IFMT) == FM_IFDIR;
+		put_nod(ni);
+		if (!dir)
+			continue;
+		init_bw(&bw);
+		while ((bk = walk_bw(fs, nods[i], &bw, 0, 0)) != WALK_END) {
+			for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
+				if (d->d_inode >= first)
+					d->d_inode = map[d->d_inode - first];
+			put_dir(&dw);
+		}
+	}
+}
 
-	// make lost+found directory
-	if(fs->sb->s_r_blocks_count)
-	{
-		inode *node;
-		uint8 *b;
+// shrink the image, leaving headroom percent of what's used free
+static void
+shrink_fs(filesystem *fs, float headroom)
+{
+	uint32 first = fs->sb->s_first_data_block;
+	uint32 bpg = fs->sb->s_blocks_per_group, ipg = fs->sb->s_inodes_per_group;
+	uint32 nbgroups = GRP_NBGROUPS(fs), ngroups, grp, i, nod, end, last, next;
+	uint32 gdsz = rndup(nbgroups * sizeof(groupdescriptor), BLOCKSIZE) / BLOCKSIZE;
+	uint32 itblsz = ipg * sizeof(inode) / BLOCKSIZE, ngdsz, overhead;
+	uint32 *nods, *map = NULL, n;
+	unsigned long nblocks, ninodes;
+	groupdescriptor *gd;
+	gd_info *gi;
+	blk_info *bi;
+	nod_info *ni, *nni;
+	inode *node;
+	uint8 *bm;
+	int j;
+
+	// what's in the groups past the metadata genext2fs puts in each
+	check_groups(fs, gdsz, "--shrink");
+	nblocks = fs->sb->s_blocks_count - first - fs->sb->s_free_blocks_count
+		  - nbgroups * (3 + gdsz + itblsz);
+	nblocks += percent_of(nblocks, headroom);
+	ninodes = fs->sb->s_inodes_count - fs->sb->s_free_inodes_count;
+	ninodes += percent_of(ninodes - (EXT2_FIRST_INO - 1), headroom);
+
+	// the fewest groups that hold it, the last one just big enough,
+	// but still with its inode table where it is
+	for (ngroups = 1; ngroups < nbgroups; ngroups++) {
+		ngdsz = rndup(ngroups * sizeof(groupdescriptor), BLOCKSIZE) / BLOCKSIZE;
+		overhead = 3 + ngdsz + itblsz;
+		if ((unsigned long) ngroups * ipg < ninodes ||
+		    nblocks + ngroups * overhead > ngroups * bpg)
+			continue;
+		break;
+	}
+	ngdsz = rndup(ngroups * sizeof(groupdescriptor), BLOCKSIZE) / BLOCKSIZE;
+	overhead = 3 + ngdsz + itblsz;
+	// more groups than the blocks need may be there for the inodes
+	last = 3 + gdsz + itblsz + 1;
+	if (nblocks + ngroups * overhead > (ngroups - 1) * bpg + last)
+		last = nblocks + ngroups * overhead - (ngroups - 1) * bpg;
+	end = first + (ngroups - 1) * bpg + last;
+	if (end >= fs->sb->s_blocks_count)
+		return;
+
+	// nothing can be allocated past end from now on: the tail of the
+	// last group is taken, which is how the bitmap pads it anyway,
+	// and the groups after it have nothing free
+	gd = get_gd(fs, ngroups - 1, &gi);
+	bm = GRP_GET_GROUP_BBM(fs, gd, &bi);
+	for (i = last + 1; i <= bpg; i++)
+		if (!allocated(bm, i)) {
+			gd->bg_free_blocks_count--;
+			fs->sb->s_free_blocks_count--;
+		}
+	allocate_range(bm, last + 1, BLOCKSIZE * 8);
+	GRP_PUT_GROUP_BBM(bi);
+	put_gd(gi);
+	for (grp = ngroups; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		fs->sb->s_free_blocks_count -= gd->bg_free_blocks_count;
+		fs->sb->s_free_inodes_count -= gd->bg_free_inodes_count;
+		gd->bg_free_blocks_count = 0;
+		gd->bg_free_inodes_count = 0;
+		put_gd(gi);
+	}
 
-		nod = mkdir_fs(fs, EXT2_ROOT_INO, "lost+found", FM_IRWXU,
-			       0, 0, fs_timestamp, fs_timestamp);
-		b = get_workblk();
-		memset(b, 0, BLOCKSIZE);
-		((directory*)b)->d_rec_len = swapit ? swab16(BLOCKSIZE) : BLOCKSIZE;
-		inode_pos_init(fs, &ipos, nod, INODE_POS_EXTEND, NULL);
-		// It is always 16 blocks to start out with
-		for(i = 1; i < 16; i++)
-			extend_inode_blk(fs, &ipos, b, 1);
-		inode_pos_finish(fs, &ipos);
-		free_workblk(b);
-		node = get_nod(fs, nod, &ni);
-		node->i_size = 16 * BLOCKSIZE;
+	// the inodes of the groups dropped go to the first free ones
+	nods = shrink_inodes(fs, nbgroups, &n);
+	for (i = 0; i < n && nods[i] <= ngroups * ipg; i++)
+		;
+	if (i < n) {
+		if (!(map = calloc((nbgroups - ngroups) * ipg, sizeof(*map))))
+			error_msg_and_die(memory_exhausted);
+		for (; i < n; i++) {
+			if (!(nod = alloc_after(fs, 1, 1)))
+				error_msg_and_die("--shrink: no inode left to move one to");
+			node = get_nod(fs, nod, &nni);
+			memcpy(node, get_nod(fs, nods[i], &ni), sizeof(inode));
+			put_nod(ni);
+			if ((node->i_mode & FM_IFMT) == FM_IFDIR) {
+				gd = get_gd(fs, GRP_GROUP_OF_INODE(fs, nod), &gi);
+				gd->bg_used_dirs_count++;
+				put_gd(gi);
+			}
+			put_nod(nni);
+			map[nods[i] - ngroups * ipg - 1] = nod;
+		}
+		free(nods);
+		nods = shrink_inodes(fs, ngroups, &n);
+		shrink_renumber(fs, nods, n, ngroups * ipg + 1, map);
+		free(map);
+	}
+
+	// the descriptors of the groups dropped go, and with them the
+	// descriptor blocks no longer needed, in each group kept
+	for (grp = ngroups; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		memset(gd, 0, sizeof(*gd));
+		put_gd(gi);
+	}
+	if (cache_flush(&fs->gds))
+		error_msg_and_die("entry mismatch on gd cache flush");
+	for (grp = 0; grp < ngroups; grp++)
+		for (i = ngdsz; i < gdsz; i++)
+			free_blk(fs, first + grp * bpg + 1 + i);
+
+	// then the blocks past the end, kept together as they were
+	next = 0;
+	for (i = 0; i < n; i++) {
+		node = get_nod(fs, nods[i], &ni);
+		if (node->i_blocks) {
+			for (j = 0; j < EXT2_IND_BLOCK; j++)
+				shrink_ind(fs, &node->i_block[j], 0, end, &next);
+			shrink_ind(fs, &node->i_block[EXT2_IND_BLOCK], 1, end, &next);
+			shrink_ind(fs, &node->i_block[EXT2_DIND_BLOCK], 2, end, &next);
+			shrink_ind(fs, &node->i_block[EXT2_TIND_BLOCK], 3, end, &next);
+		}
 		put_nod(ni);
 	}
+	free(nods);
+
+	// everything past the end is written before it's cut off
+	flush_fs(fs);
+	fs->sb->s_r_blocks_count = (unsigned long long) fs->sb->s_r_blocks_count
+				   * end / fs->sb->s_blocks_count;
+	fs->sb->s_blocks_count = end;
+	fs->sb->s_inodes_count = ngroups * ipg;
+	set_file_size(fs);
+}
+
+#define FILL_CHUNK	(1 << 20)
+
+// what fill_group needs: the pattern (NULL to punch holes) and each
+// group's block bitmap
+struct fill_info
+{
+	uint8 *pattern;
+	uint32 *bbm;
+	int nopunch;	// the image can't have holes punched
+};
+
+// Fill the free blocks of a group, a run at a time.  Bit i of a group's
+// bitmap is block s_first_data_block + group * s_blocks_per_group + i - 1.
+static void
+fill_group(filesystem *fs, uint32 grp, void *arg)
+{
+	struct fill_info *fi = arg;
+	uint32 first, nblk, i, end, n;
+	uint8 *bbm;
+
+	first = fs->sb->s_first_data_block + grp * fs->sb->s_blocks_per_group;
+	nblk = fs->sb->s_blocks_count - first;
+	if(nblk > fs->sb->s_blocks_per_group)
+		nblk = fs->sb->s_blocks_per_group;
+	if(!(bbm = malloc(BLOCKSIZE)))
+		error_msg_and_die("fill_group: out of memory");
+	io_read(fs->io, bbm, BLOCKSIZE, ((off_t) fi->bbm[grp]) * BLOCKSIZE);
+	for(i = 1; i <= nblk; i = end + 1) {
+		i = bitmap_find(bbm, i, nblk, 0);
+		end = bitmap_find(bbm, i, nblk, 1) - 1;
+		if(!fi->pattern) {
+			if(i > end || fi->nopunch)
+				continue;
+			if(fs->io->punch(fs->io, ((off_t) first + i - 1) * BLOCKSIZE,
+					 ((off_t) end - i + 1) * BLOCKSIZE)) {
+				if(errno != EOPNOTSUPP && errno != ENOSYS)
+					perror_msg_and_die("punching holes in image");
+				fi->nopunch = 1;
+			}
+			continue;
+		}
+		for(; i <= end; i += n) {
+			n = end - i + 1;
+			if(n > FILL_CHUNK / BLOCKSIZE)
+				n = FILL_CHUNK / BLOCKSIZE;
+			io_write(fs->io, fi->pattern, n * BLOCKSIZE,
+				 ((off_t) first + i - 1) * BLOCKSIZE);
+		}
+	}
+	free(bbm);
+}
 
-	// administrative info
-	fs->sb->s_state = 1;
-	fs->sb->s_max_mnt_count = 20;
+// Return the block bitmap location of every group, in an array to free
+static uint32 *
+get_bbm_blocks(filesystem *fs)
+{
+	uint32 grp, nbgroups = GRP_NBGROUPS(fs), *bbm;
+	groupdescriptor *gd;
+	gd_info *gi;
 
-	// options for me
-	fs->holes = holes;
-	
-	return fs;
+	if(!(bbm = malloc(nbgroups * sizeof(*bbm))))
+		error_msg_and_die("get_bbm_blocks: out of memory");
+	for(grp = 0; grp < nbgroups; grp++) {
+		gd = get_gd(fs, grp, &gi);
+		bbm[grp] = gd->bg_block_bitmap;
+		put_gd(gi);
+	}
+	return bbm;
 }
 
-// loads a filesystem from disk
-static filesystem *
-load_fs(FILE *fh, int swapit, char *fname)
+// Fill all the free blocks with val.  The caches are flushed first, so
+// the groups can be filled in parallel straight from the image.  For a
+// val of 0 holes are punched instead where the image supports it: a
+// -x starting image or a reused output may have stale data there, and
+// a fresh image only has holes in free space anyway.
+static void
+fill_free_blks(filesystem *fs, int val)
 {
-	off_t fssize;
-	filesystem *fs;
-
-	if((fseek(fh, 0, SEEK_END) < 0) || ((fssize = ftello(fh)) == -1))
-		perror_msg_and_die("input filesystem image");
-	rewind(fh);
-	if ((fssize % BLOCKSIZE) != 0)
-		error_msg_and_die("Input file not a multiple of block size");
-	fssize /= BLOCKSIZE;
-	if(fssize < 16) // totally arbitrary
-		error_msg_and_die("too small filesystem");
-	fs = alloc_fs(swapit, fname, fssize, fh);
+	struct fill_info fi;
+
+	fi.pattern = val ? malloc(FILL_CHUNK) : NULL;
+	fi.nopunch = 0;
+	if(val && !fi.pattern)
+		error_msg_and_die("fill_free_blks: out of memory");
+	if(val)
+		memset(fi.pattern, val, FILL_CHUNK);
+	fi.bbm = get_bbm_blocks(fs);
+	flush_fs(fs);
+	run_groups(fs, GRP_NBGROUPS(fs), fill_group, &fi);
+	// the free blocks are on disk now
+	drop_written(fs);
+	fs->free_fill = (val || !fi.nopunch) ? val : -1;
+	free(fi.pattern);
+	free(fi.bbm);
+}
 
-	/* Read and check the superblock, then read the superblock
-	 * and all the group descriptors */
-	fs->sb = malloc(SUPERBLOCK_SIZE);
-	if (!fs->sb)
-		error_msg_and_die("error allocating header memory");
-	if (fseek(fs->f, SUPERBLOCK_OFFSET, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if (fread(fs->sb, SUPERBLOCK_SIZE, 1, fs->f) != 1)
-		perror_msg_and_die("fread filesystem image superblock");
-	if(swapit)
+static void
+finish_fs(filesystem *fs)
+{
+	// everything must be on disk before the superblock
+	flush_fs(fs);
+	if(fs->swapit)
+		swap_sb(fs->sb);
+	io_write(fs->io, fs->sb, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET);
+	if(fs->swapit)
 		swap_sb(fs->sb);
+}
 
-	if((fs->sb->s_rev_level > 1) || (fs->sb->s_magic != EXT2_MAGIC_NUMBER))
-		error_msg_and_die("not a suitable ext2 filesystem");
-	if (fs->sb->s_rev_level > 0) {
-		if (fs->sb->s_first_ino != EXT2_GOOD_OLD_FIRST_INO)
-			error_msg_and_die("First inode incompatible");
-		if (fs->sb->s_inode_size != EXT2_GOOD_OLD_INODE_SIZE)
-			error_msg_and_die("inode size incompatible");
-		if (fs->sb->s_feature_compat)
-			error_msg_and_die("Unsupported compat features");
-		if (fs->sb->s_feature_incompat)
-			error_msg_and_die("Unsupported incompat features");
-		if (fs->sb->s_feature_ro_compat
-		    & ~EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
-			error_msg_and_die("Unsupported ro compat features");
-	}
+// Android sparse image output.  The image is described as a list of
+// chunks: DONT_CARE for free blocks, FILL for blocks made of a single
+// repeated 32-bit word (or free blocks with a fill value) and RAW for
+// the rest.  All fields are little endian.
+#define SIMG_MAGIC		0xed26ff3a
+#define SIMG_HDR_SIZE		28
+#define SIMG_CHUNK_HDR_SIZE	12
+#define SIMG_RAW		0xcac1
+#define SIMG_FILL		0xcac2
+#define SIMG_DONT_CARE		0xcac3
+#define SIMG_RAW_MAX		(64 * 1024 * 1024)	// bytes in a RAW chunk
 
-	set_file_size(fs);
-	return fs;
-}
+typedef struct
+{
+	uint32 type;
+	uint32 count;	// blocks
+	uint32 fill;
+} simg_chunk;
+
+typedef struct
+{
+	simg_chunk *chunks;
+	uint32 nchunks, maxchunks;
+} simg_list;
 
 static void
-free_fs(filesystem *fs)
+simg_add(simg_list *l, uint32 type, uint32 count, uint32 fill)
 {
-	free(fs->hdlinks.hdl);
-	fclose(fs->f);
-	free(fs->sb);
-	free(fs);
+	simg_chunk *c = l->nchunks ? &l->chunks[l->nchunks - 1] : NULL;
+
+	if (c && c->type == type && (type != SIMG_FILL || c->fill == fill) &&
+	    (type != SIMG_RAW ||
+	     ((size_t) c->count + count) * BLOCKSIZE <= SIMG_RAW_MAX)) {
+		c->count += count;
+		return;
+	}
+	if (l->nchunks == l->maxchunks) {
+		l->maxchunks = l->maxchunks ? l->maxchunks * 2 : 256;
+		l->chunks = realloc(l->chunks, l->maxchunks * sizeof(*l->chunks));
+		if (!l->chunks)
+			error_msg_and_die("simg: out of memory");
+	}
+	c = &l->chunks[l->nchunks++];
+	c->type = type;
+	c->count = count;
+	c->fill = fill;
 }
 
-// just walk through blocks list
+// add count allocated blocks from blk on, looking at their contents
 static void
-flist_blocks(filesystem *fs, uint32 nod, FILE *fh)
+simg_add_used(filesystem *fs, simg_list *l, uint32 blk, uint32 count, uint8 *buf)
 {
-	blockwalker bw;
-	uint32 bk;
-	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-		fprintf(fh, " %d", bk);
-	fprintf(fh, "\n");
+	uint32 i, j, n, *w;
+
+	for (; count; blk += n, count -= n) {
+		n = count;
+		if (n > PLAN_BUFSIZE / BLOCKSIZE)
+			n = PLAN_BUFSIZE / BLOCKSIZE;
+		io_read(fs->io, buf, (size_t) n * BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+		for (i = 0; i < n; i++) {
+			w = (uint32 *) (buf + (size_t) i * BLOCKSIZE);
+			for (j = 1; j < BLOCKSIZE / 4 && w[j] == w[0]; j++)
+				;
+			if (j == BLOCKSIZE / 4)
+				simg_add(l, SIMG_FILL, 1, w[0]);
+			else
+				simg_add(l, SIMG_RAW, 1, 0);
+		}
+	}
 }
 
-// walk through blocks list
 static void
-list_blocks(filesystem *fs, uint32 nod)
+simg_write(io_backend *out, off_t *pos, const void *buf, size_t len)
 {
-	int bn = 0;
-	blockwalker bw;
-	uint32 bk;
-	init_bw(&bw);
-	printf("blocks in inode %d:", nod);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-		printf(" %d", bk), bn++;
-	printf("\n%d blocks (%d bytes)\n", bn, bn * BLOCKSIZE);
+	io_write(out, buf, len, *pos);
+	*pos += len;
 }
 
-// saves blocks to FILE*
+// Write the finished image to out as a sparse image.  Free blocks are
+// DONT_CARE, or FILL chunks of val if it isn't 0.
 static void
-write_blocks(filesystem *fs, uint32 nod, FILE* f)
+simg_emit(filesystem *fs, io_backend *out, int val)
 {
-	blockwalker bw;
-	uint32 bk;
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
-	int32 fsize = node->i_size;
-	blk_info *bi;
+	uint32 grp, first, nblk, i, n, end, nbgroups = GRP_NBGROUPS(fs);
+	uint32 *bbms = get_bbm_blocks(fs), fill;
+	uint8 *bbm, *buf, hdr[SIMG_HDR_SIZE];
+	simg_list l = { NULL, 0, 0 };
+	simg_chunk *c;
+	off_t pos = 0, blk = 0;
+
+	flush_fs(fs);
+	fill = (uint8) val * 0x01010101U;
+	bbm = malloc(BLOCKSIZE);
+	buf = malloc(PLAN_BUFSIZE);
+	if (!bbm || !buf)
+		error_msg_and_die("simg: out of memory");
+	// blocks before the first group (the boot block)
+	if (fs->sb->s_first_data_block)
+		simg_add_used(fs, &l, 0, fs->sb->s_first_data_block, buf);
+	for (grp = 0; grp < nbgroups; grp++) {
+		first = fs->sb->s_first_data_block + grp * fs->sb->s_blocks_per_group;
+		nblk = fs->sb->s_blocks_count - first;
+		if (nblk > fs->sb->s_blocks_per_group)
+			nblk = fs->sb->s_blocks_per_group;
+		io_read(fs->io, bbm, BLOCKSIZE, ((off_t) bbms[grp]) * BLOCKSIZE);
+		for (i = 1; i <= nblk; i = end + 1) {
+			end = bitmap_find(bbm, i, nblk, 0) - 1;
+			if (end >= i)
+				simg_add_used(fs, &l, first + i - 1, end - i + 1, buf);
+			i = end + 1;
+			if (i > nblk)
+				break;
+			end = bitmap_find(bbm, i, nblk, 1) - 1;
+			simg_add(&l, val ? SIMG_FILL : SIMG_DONT_CARE,
+				 end - i + 1, fill);
+		}
+	}
 
-	init_bw(&bw);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-	{
-		if(fsize <= 0)
-			error_msg_and_die("wrong size while saving inode %d", nod);
-		if(fwrite(get_blk(fs, bk, &bi),
-			  (fsize > BLOCKSIZE) ? BLOCKSIZE : fsize, 1, f) != 1)
-			error_msg_and_die("error while saving inode %d", nod);
-		put_blk(bi);
-		fsize -= BLOCKSIZE;
+	put_le32(hdr, SIMG_MAGIC);
+	hdr[4] = 1;	// major version
+	hdr[5] = 0;
+	hdr[6] = 0;	// minor version
+	hdr[7] = 0;
+	hdr[8] = SIMG_HDR_SIZE;
+	hdr[9] = 0;
+	hdr[10] = SIMG_CHUNK_HDR_SIZE;
+	hdr[11] = 0;
+	put_le32(hdr + 12, BLOCKSIZE);
+	put_le32(hdr + 16, fs->sb->s_blocks_count);
+	put_le32(hdr + 20, l.nchunks);
+	put_le32(hdr + 24, 0);	// no checksum
+	simg_write(out, &pos, hdr, SIMG_HDR_SIZE);
+	for (c = l.chunks; c < l.chunks + l.nchunks; blk += c->count, c++) {
+		uint8 ch[SIMG_CHUNK_HDR_SIZE + 4];
+		uint32 len = SIMG_CHUNK_HDR_SIZE;
+
+		if (c->type == SIMG_RAW)
+			len += c->count * BLOCKSIZE;
+		else if (c->type == SIMG_FILL)
+			len += 4;
+		ch[0] = c->type;
+		ch[1] = c->type >> 8;
+		ch[2] = ch[3] = 0;
+		put_le32(ch + 4, c->count);
+		put_le32(ch + 8, len);
+		// the fill word is kept as it is in the image
+		memcpy(ch + 12, &c->fill, 4);
+		simg_write(out, &pos, ch, c->type == SIMG_FILL ?
+			   sizeof(ch) : SIMG_CHUNK_HDR_SIZE);
+		for (i = 0; c->type == SIMG_RAW && i < c->count; i += n) {
+			n = c->count - i;
+			if (n > PLAN_BUFSIZE / BLOCKSIZE)
+				n = PLAN_BUFSIZE / BLOCKSIZE;
+			io_read(fs->io, buf, (size_t) n * BLOCKSIZE,
+				(blk + i) * BLOCKSIZE);
+			simg_write(out, &pos, buf, (size_t) n * BLOCKSIZE);
+		}
 	}
-	put_nod(ni);
+	if (!out->stream && out->truncate(out, pos))
+		perror_msg_and_die("simg: ftruncate");
+	free(l.chunks);
+	free(bbms);
+	free(bbm);
+	free(buf);
 }
 
+// Scanning the finished image for the blocks in use, so the free ones,
+// which hold the fill, don't have to be read
+typedef struct
+{
+	filesystem *fs;
+	uint32 *bbms;		// the block bitmap of each group
+	int fill;		// what the free blocks hold, -1 if unknown
+} image_scan;
+
+// a scan's position: the bitmap of group grp
+typedef struct
+{
+	uint8 *bbm;
+	uint32 grp;
+} scan_walk;
 
-// print block/char device minor and major
 static void
-print_dev(filesystem *fs, uint32 nod)
+scan_init(image_scan *is, filesystem *fs)
 {
-	int minor, major;
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
-	if (fs->swapit) {
-		minor = ((uint8*)node->i_block)[3];
-		major = ((uint8*)node->i_block)[2];
-	} else {
-		minor = ((uint8*)node->i_block)[0];
-		major = ((uint8*)node->i_block)[1];
+	is->fs = fs;
+	is->bbms = get_bbm_blocks(fs);
+	is->fill = fs->free_fill;
+}
+
+// The number of blocks from blk (up to end) that are all in use, or
+// all free if *isfree is set on return.  The blocks before the first
+// group count as used, and so do all of them if the fill is unknown.
+static uint32
+scan_run(image_scan *is, scan_walk *w, uint32 blk, uint32 end, int *isfree)
+{
+	superblock *sb = is->fs->sb;
+	uint32 grp, first, nblk, i, last;
+
+	if (blk < sb->s_first_data_block) {
+		*isfree = 0;
+		return ((end < sb->s_first_data_block) ? end : sb->s_first_data_block) - blk;
 	}
-	put_nod(ni);
-	printf("major: %d, minor: %d\n", major, minor);
+	grp = (blk - sb->s_first_data_block) / sb->s_blocks_per_group;
+	first = sb->s_first_data_block + grp * sb->s_blocks_per_group;
+	nblk = sb->s_blocks_count - first;
+	if (nblk > sb->s_blocks_per_group)
+		nblk = sb->s_blocks_per_group;
+	if (nblk > end - first)
+		nblk = end - first;
+	i = blk - first + 1;
+	if (is->fill < 0) {
+		*isfree = 0;
+		return nblk + 1 - i;
+	}
+	if (grp != w->grp) {
+		io_read(is->fs->io, w->bbm, BLOCKSIZE, ((off_t) is->bbms[grp]) * BLOCKSIZE);
+		w->grp = grp;
+	}
+	*isfree = !allocated(w->bbm, i);
+	last = bitmap_find(w->bbm, i, nblk, *isfree);
+	return last - i;
 }
 
-// print an inode as a directory
+// whether the count blocks from blk are all free
+static int
+scan_free(image_scan *is, uint32 blk, uint32 count)
+{
+	scan_walk w = { NULL, (uint32) -1 };
+	int isfree;
+
+	if (is->fill < 0)
+		return 0;
+	if (!(w.bbm = malloc(BLOCKSIZE)))
+		error_msg_and_die("scan_free: out of memory");
+	if (scan_run(is, &w, blk, blk + count, &isfree) < count)
+		isfree = 0;
+	free(w.bbm);
+	return isfree;
+}
+
+// what digest_image's leaf jobs need
+typedef struct
+{
+	image_scan s;
+	image_digest *dg;
+	uint8 *leaves;		// tree mode: the digest of each leaf
+} dg_image;
+
+// Hash count blocks from blk into dg, reading only those in use
 static void
-print_dir(filesystem *fs, uint32 nod)
+dg_blocks(dg_image *di, image_digest *dg, uint32 blk, uint32 count)
 {
-	blockwalker bw;
-	uint32 bk;
-	init_bw(&bw);
-	printf("directory for inode %d:\n", nod);
-	while((bk = walk_bw(fs, nod, &bw, 0, 0)) != WALK_END)
-	{
-		directory *d;
-		dirwalker dw;
-		for (d = get_dir(fs, bk, &dw); d; d = next_dir(&dw))
-			if(d->d_inode)
-			{
-				printf("entry '");
-				fwrite(dir_name(&dw), 1, d->d_name_len, stdout);
-				printf("' (inode %d): rec_len: %d (name_len: %d)\n", d->d_inode, d->d_rec_len, d->d_name_len);
-			}
-		put_dir(&dw);
+	uint32 end = blk + count, n, i, m;
+	scan_walk w = { NULL, (uint32) -1 };
+	uint8 *buf;
+	int isfree;
+
+	w.bbm = malloc(BLOCKSIZE);
+	buf = malloc(DG_LEAF);
+	if (!w.bbm || !buf)
+		error_msg_and_die("digest: out of memory");
+	for (; blk < end; blk += n) {
+		n = scan_run(&di->s, &w, blk, end, &isfree);
+		if (isfree) {
+			dg_fill(dg, di->s.fill, ((off_t) n) * BLOCKSIZE);
+			continue;
+		}
+		for (i = 0; i < n; i += m) {
+			m = n - i;
+			if (m > DG_LEAF / BLOCKSIZE)
+				m = DG_LEAF / BLOCKSIZE;
+			io_read(di->s.fs->io, buf, (size_t) m * BLOCKSIZE,
+				((off_t) blk + i) * BLOCKSIZE);
+			dg_update(dg, buf, (size_t) m * BLOCKSIZE);
+		}
 	}
+	free(w.bbm);
+	free(buf);
 }
 
-// print a symbolic link
 static void
-print_link(filesystem *fs, uint32 nod)
+dg_leaf_job(void *arg, uint32 leaf)
 {
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
+	dg_image *di = arg;
+	uint32 per = DG_LEAF / BLOCKSIZE, blk = leaf * per;
+	image_digest dg;
+
+	if (scan_free(&di->s, blk, per)) {
+		memcpy(di->leaves + (size_t) leaf * digest_size(di->dg->alg),
+		       di->dg->fillleaf, digest_size(di->dg->alg));
+		return;
+	}
+	// a leaf digest is a plain digest of the leaf, with the shared fill
+	dg_init(&dg, di->dg->alg, 0);
+	dg.fill = di->dg->fill;
+	dg.fillbuf = di->dg->fillbuf;
+	dg_blocks(di, &dg, blk, per);
+	dg.fillbuf = NULL;
+	dg_final(&dg, di->leaves + (size_t) leaf * digest_size(dg.alg));
+}
 
-	if (!node->i_blocks) {
-		if (fs->swapit) {
-			uint32 *buf = malloc(4 * (EXT2_TIND_BLOCK + 1));
-			if (buf == NULL)
-				error_msg_and_die(memory_exhausted);
-			swab32_into(buf, node->i_block, EXT2_TIND_BLOCK + 1);
-			printf("links to '%s'\n", (char*) buf);
-			free(buf);
-		} else {
-			printf("links to '%s'\n", (char*) node->i_block);
-		}
-	} else {
-		printf("links to '");
-		write_blocks(fs, nod, stdout);
-		printf("'\n");
+// Hash the finished image, built in place, into dg.  The blocks in use
+// are read back, most likely from the page cache, but the free blocks
+// hold the fill and aren't.  In tree mode the whole leaves are done in
+// parallel, where the image allows it; dg can take in more data after.
+static void
+digest_image(filesystem *fs, image_digest *dg)
+{
+	uint32 leaf, nleaves = 0, per = DG_LEAF / BLOCKSIZE;
+	size_t size = digest_size(dg->alg);
+	dg_image di;
+
+	scan_init(&di.s, fs);
+	di.dg = dg;
+	di.leaves = NULL;
+	if (di.s.fill >= 0)
+		dg_set_fill(dg, di.s.fill);
+	if (dg->tree) {
+		nleaves = fs->sb->s_blocks_count / per;
+		if (!(di.leaves = malloc((size_t) nleaves * size + 1)))
+			error_msg_and_die("digest: out of memory");
+		run_jobs(nleaves, fs->io->read_at == file_read_at, dg_leaf_job, &di);
+		for (leaf = 0; leaf < nleaves; leaf++)
+			digest_update(&dg->root, di.leaves + (size_t) leaf * size, size);
+		dg->pos = ((off_t) nleaves) * DG_LEAF;
+		free(di.leaves);
 	}
-	put_nod(ni);
+	// the rest, or everything for a plain digest
+	dg_blocks(&di, dg, nleaves * per, fs->sb->s_blocks_count - nleaves * per);
+	free(di.s.bbms);
 }
 
-// make a ls-like printout of permissions
 static void
-make_perms(uint32 mode, char perms[11])
+print_hex(FILE *fh, const uint8 *b, size_t len)
 {
-	strcpy(perms, "----------");
-	if(mode & FM_IRUSR)
-		perms[1] = 'r';
-	if(mode & FM_IWUSR)
-		perms[2] = 'w';
-	if(mode & FM_IXUSR)
-		perms[3] = 'x';
-	if(mode & FM_IRGRP)
-		perms[4] = 'r';
-	if(mode & FM_IWGRP)
-		perms[5] = 'w';
-	if(mode & FM_IXGRP)
-		perms[6] = 'x';
-	if(mode & FM_IROTH)
-		perms[7] = 'r';
-	if(mode & FM_IWOTH)
-		perms[8] = 'w';
-	if(mode & FM_IXOTH)
-		perms[9] = 'x';
-	if(mode & FM_ISUID)
-		perms[3] = 's';
-	if(mode & FM_ISGID)
-		perms[6] = 's';
-	if(mode & FM_ISVTX)
-		perms[9] = 't';
-	switch(mode & FM_IFMT)
-	{
-		case 0:
-			*perms = '0';
-			break;
-		case FM_IFSOCK:
-			*perms = 's';
-			break;
-		case FM_IFLNK:
-			*perms = 'l';
-			break;
-		case FM_IFREG:
-			*perms = '-';
-			break;
-		case FM_IFBLK:
-			*perms = 'b';
-			break;
-		case FM_IFDIR:
-			*perms = 'd';
-			break;
-		case FM_IFCHR:
-			*perms = 'c';
-			break;
-		case FM_IFIFO:
-			*perms = 'p';
-			break;
-		default:
-			*perms = '?';
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		fprintf(fh, "%02x", b[i]);
+}
+
+// Write the checksum file for the image fsout: the digest and the
+// image's name, like md5sum and sha256sum do
+static void
+write_digest(image_digest *dg, const char *fsout)
+{
+	uint8 d[DIGEST_MAX_SIZE];
+	const char *name = strrchr(fsout, '/');
+	char *fname = NULL;
+	FILE *fh;
+
+	dg_final(dg, d);
+	if (!digest_file) {
+		if (!(fname = malloc(strlen(fsout) + strlen(digest_name) + 2)))
+			error_msg_and_die(memory_exhausted);
+		sprintf(fname, "%s.%s", fsout, digest_name);
 	}
+	fh = xfopen(fname ? fname : digest_file, "w");
+	print_hex(fh, d, digest_size(dg->alg));
+	fprintf(fh, "  %s\n", name ? name + 1 : fsout);
+	if (fclose(fh))
+		perror_msg_and_die("writing digest");
+	free(fname);
 }
 
-// print an inode
+/* dm-verity hash tree (--verity), as veritysetup format makes it: the
+   salted SHA-256 of every data block (the blocks of the image), then of
+   every block of those hashes, and so on up to a single block, whose
+   hash is the root hash.  On disk the verity superblock comes first,
+   then the levels from the top one down.  Data and hash blocks are the
+   image's blocks.  The data blocks are hashed in parallel, and the free
+   ones, which all hold the fill, share a precomputed hash. */
+
+#define VERITY_SB_SIZE		512
+#define VERITY_SALT_MAX		256
+#define VERITY_HASH_SIZE	32	// sha256
+#define VERITY_LEVELS_MAX	16
+#define VERITY_JOB		256	// data blocks hashed by a job
+
+// set by --verity, --verity-file and --verity-salt
+static int verity;
+static const char *verity_file;
+static const char *verity_salt;
+
+typedef struct
+{
+	image_scan s;
+	uint8 salt[VERITY_SALT_MAX];
+	uint32 saltlen;
+	uint8 fillhash[VERITY_HASH_SIZE];	// of a free block
+	uint8 *buf;	// the superblock, then the levels, as on disk
+	size_t len;
+	uint8 *level0;	// in buf, the hash of each data block
+	uint8 root[VERITY_HASH_SIZE];
+} verity_tree;
+
 static void
-print_inode(filesystem *fs, uint32 nod)
+verity_hash(verity_tree *vt, const uint8 *b, uint8 *out)
 {
-	char *s;
-	char perms[11];
-	nod_info *ni;
-	inode *node = get_nod(fs, nod, &ni);
-	blk_info *bi;
-	gd_info *gi;
+	digest_ctx c;
 
-	if(!node->i_mode)
-		goto out;
-	switch(nod)
-	{
-		case EXT2_BAD_INO:
-			s = "bad blocks";
-			break;
-		case EXT2_ROOT_INO:
-			s = "root";
-			break;
-		case EXT2_ACL_IDX_INO:
-		case EXT2_ACL_DATA_INO:
-			s = "ACL";
-			break;
-		case EXT2_BOOT_LOADER_INO:
-			s = "boot loader";
-			break;
-		case EXT2_UNDEL_DIR_INO:
-			s = "undelete directory";
-			break;
-		default:
-			s = (nod >= EXT2_FIRST_INO) ? "normal" : "unknown reserved"; 
+	digest_init(&c, DIGEST_SHA256);
+	digest_update(&c, vt->salt, vt->saltlen);
+	digest_update(&c, b, BLOCKSIZE);
+	digest_final(&c, out);
+}
+
+static void
+verity_job(void *arg, uint32 job)
+{
+	verity_tree *vt = arg;
+	uint32 blk = job * VERITY_JOB, end = blk + VERITY_JOB, n, i;
+	scan_walk w = { NULL, (uint32) -1 };
+	uint8 *buf;
+	int isfree;
+
+	if (end > vt->s.fs->sb->s_blocks_count)
+		end = vt->s.fs->sb->s_blocks_count;
+	w.bbm = malloc(BLOCKSIZE);
+	buf = malloc(VERITY_JOB * BLOCKSIZE);
+	if (!w.bbm || !buf)
+		error_msg_and_die("verity: out of memory");
+	for (; blk < end; blk += n) {
+		n = scan_run(&vt->s, &w, blk, end, &isfree);
+		if (isfree) {
+			for (i = 0; i < n; i++)
+				memcpy(vt->level0 + (size_t) (blk + i) * VERITY_HASH_SIZE,
+				       vt->fillhash, VERITY_HASH_SIZE);
+			continue;
+		}
+		io_read(vt->s.fs->io, buf, (size_t) n * BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+		for (i = 0; i < n; i++)
+			verity_hash(vt, buf + (size_t) i * BLOCKSIZE,
+				    vt->level0 + (size_t) (blk + i) * VERITY_HASH_SIZE);
 	}
-	printf("inode %d (%s, %d links): ", nod, s, node->i_links_count);
-	if(!allocated(GRP_GET_INODE_BITMAP(fs,nod,&bi,&gi), GRP_IBM_OFFSET(fs,nod)))
-	{
-		GRP_PUT_INODE_BITMAP(bi,gi);
-		printf("unallocated\n");
-		goto out;
+	free(w.bbm);
+	free(buf);
+}
+
+// the salt: --verity-salt in hex ("-" for none), or random
+static void
+verity_set_salt(verity_tree *vt)
+{
+	const char *p = verity_salt;
+	unsigned int v;
+	int fd;
+
+	if (!p) {
+		vt->saltlen = VERITY_HASH_SIZE;
+		if ((fd = open("/dev/urandom", O_RDONLY)) < 0 ||
+		    read(fd, vt->salt, vt->saltlen) != (ssize_t) vt->saltlen)
+			perror_msg_and_die("/dev/urandom");
+		close(fd);
+		return;
 	}
-	GRP_PUT_INODE_BITMAP(bi,gi);
-	make_perms(node->i_mode, perms);
-	printf("%s,  size: %d byte%s (%d block%s)\n", perms,
-	       plural(node->i_size), plural(node->i_blocks / INOBLK));
-	switch(node->i_mode & FM_IFMT)
+	if (!strcmp(p, "-"))
+		return;
+	for (; *p; p += 2) {
+		if (vt->saltlen == VERITY_SALT_MAX || !isxdigit(p[0]) ||
+		    !isxdigit(p[1]) || sscanf(p, "%2x", &v) != 1)
+			error_msg_and_die("Invalid verity salt '%s'.", verity_salt);
+		vt->salt[vt->saltlen++] = v;
+	}
+}
+
+static void
+verity_superblock(verity_tree *vt, uint8 *sb)
+{
+	uint64 nblocks = vt->s.fs->sb->s_blocks_count;
+	uint8 uuid[VERITY_HASH_SIZE];
+	digest_ctx c;
+
+	// the uuid comes from the salt and the root hash, so the tree only
+	// changes with them
+	digest_init(&c, DIGEST_SHA256);
+	digest_update(&c, vt->salt, vt->saltlen);
+	digest_update(&c, vt->root, VERITY_HASH_SIZE);
+	digest_final(&c, uuid);
+	uuid[6] = (uuid[6] & 0x0f) | 0x40;
+	uuid[8] = (uuid[8] & 0x3f) | 0x80;
+
+	memcpy(sb, "verity\0\0", 8);
+	put_le32(sb + 8, 1);		// superblock version
+	put_le32(sb + 12, 1);		// hash type: normal, salt first
+	memcpy(sb + 16, uuid, 16);
+	strcpy((char *) sb + 32, "sha256");
+	put_le32(sb + 64, BLOCKSIZE);	// data block size
+	put_le32(sb + 68, BLOCKSIZE);	// hash block size
+	put_le32(sb + 72, nblocks);
+	put_le32(sb + 76, nblocks >> 32);
+	sb[80] = vt->saltlen;
+	sb[81] = vt->saltlen >> 8;
+	memcpy(sb + 88, vt->salt, vt->saltlen);
+}
+
+// Build the hash tree of the finished image
+static verity_tree *
+verity_build(filesystem *fs)
+{
+	uint32 nblocks = fs->sb->s_blocks_count, bits, levels = 0, i;
+	uint64 lvlblk[VERITY_LEVELS_MAX], lvlsize[VERITY_LEVELS_MAX], m, pos;
+	verity_tree *vt;
+	uint8 *b;
+
+	if (!(vt = calloc(1, sizeof(*vt))))
+		error_msg_and_die(memory_exhausted);
+	verity_set_salt(vt);
+	scan_init(&vt->s, fs);
+	// the hashes in a block, a power of two
+	for (bits = 0; (2U << bits) * VERITY_HASH_SIZE <= BLOCKSIZE; bits++)
+		;
+	while (bits * levels < 64 && ((uint64) nblocks - 1) >> (bits * levels))
+		levels++;
+	if (!levels || levels > VERITY_LEVELS_MAX)
+		error_msg_and_die("verity: unsupported image size");
+	// the superblock takes the first block, then the top level
+	for (pos = 1, i = levels; i-- > 0; pos += lvlsize[i]) {
+		lvlblk[i] = pos;
+		lvlsize[i] = (nblocks + ((uint64) 1 << ((i + 1) * bits)) - 1) >>
+			     ((i + 1) * bits);
+	}
+	vt->len = pos * BLOCKSIZE;
+	if (!(vt->buf = calloc(1, vt->len)))
+		error_msg_and_die("verity: out of memory");
+	vt->level0 = vt->buf + lvlblk[0] * BLOCKSIZE;
+	if (vt->s.fill >= 0) {
+		if (!(b = malloc(BLOCKSIZE)))
+			error_msg_and_die("verity: out of memory");
+		memset(b, vt->s.fill, BLOCKSIZE);
+		verity_hash(vt, b, vt->fillhash);
+		free(b);
+	}
+	run_jobs((nblocks + VERITY_JOB - 1) / VERITY_JOB,
+		 fs->io->read_at == file_read_at, verity_job, vt);
+	for (i = 1; i < levels; i++)
+		for (m = 0; m < lvlsize[i - 1]; m++)
+			verity_hash(vt, vt->buf + (lvlblk[i - 1] + m) * BLOCKSIZE,
+				    vt->buf + lvlblk[i] * BLOCKSIZE + m * VERITY_HASH_SIZE);
+	verity_hash(vt, vt->buf + lvlblk[levels - 1] * BLOCKSIZE, vt->root);
+	verity_superblock(vt, vt->buf);
+	free(vt->s.bbms);
+	return vt;
+}
+
+// What veritysetup open needs: the root hash, and where the tree is
+static void
+verity_report(verity_tree *vt, FILE *fh, off_t offset)
+{
+	if (verity_file)
+		fprintf(fh, "Hash file:\t%s\n", verity_file);
+	else
+		fprintf(fh, "Hash offset:\t%lld\n", (long long) offset);
+	fprintf(fh, "Data blocks:\t%lu\n", (unsigned long) vt->s.fs->sb->s_blocks_count);
+	fprintf(fh, "Data block size:\t%d\n", BLOCKSIZE);
+	fprintf(fh, "Hash block size:\t%d\n", BLOCKSIZE);
+	fprintf(fh, "Hash algorithm:\tsha256\n");
+	fprintf(fh, "Salt:\t");
+	if (vt->saltlen)
+		print_hex(fh, vt->salt, vt->saltlen);
+	else
+		fprintf(fh, "-");
+	fprintf(fh, "\nRoot hash:\t");
+	print_hex(fh, vt->root, VERITY_HASH_SIZE);
+	fprintf(fh, "\n");
+}
+
+static void
+verity_free(verity_tree *vt)
+{
+	free(vt->buf);
+	free(vt);
+}
+
+/* Block delta against a previous image (--delta-from), for updates: a
+   patch in the --patch format that turns the old image into this one.
+   The images are compared a chunk at a time, in parallel, and neither
+   is read where it's known to be empty: holes of the old image are
+   zeros and the free blocks of the new one hold the fill.  Unchanged
+   blocks are left out of the patch, and blocks that became zeros are
+   zero records, which can be applied as trims. */
+
+#define DELTA_JOB	256	// blocks compared by a job
+
+// set by --delta-from
+static const char *delta_from;
+
+typedef struct
+{
+	image_scan s;
+	io_backend *old;
+	uint8 *state;	// for each block, PATCH_END if unchanged
+} delta_info;
+
+static void
+delta_job(void *arg, uint32 job)
+{
+	delta_info *di = arg;
+	uint32 blk = job * DELTA_JOB, end = blk + DELTA_JOB, n, i;
+	scan_walk w = { NULL, (uint32) -1 };
+	uint8 *ob, *nb, *b;
+	off_t off = ((off_t) blk) * BLOCKSIZE;
+	size_t len;
+	int isfree, oldzero = 0;
+
+	if (end > di->s.fs->sb->s_blocks_count)
+		end = di->s.fs->sb->s_blocks_count;
+	len = (size_t) (end - blk) * BLOCKSIZE;
+#ifdef SEEK_DATA
 	{
-		case FM_IFSOCK:
-			list_blocks(fs, nod);
-			break;
-		case FM_IFLNK:
-			print_link(fs, nod);
-			break;
-		case FM_IFREG:
-			list_blocks(fs, nod);
-			break;
-		case FM_IFBLK:
-			print_dev(fs, nod);
-			break;
-		case FM_IFDIR:
-			list_blocks(fs, nod);
-			print_dir(fs, nod);
-			break;
-		case FM_IFCHR:
-			print_dev(fs, nod);
-			break;
-		case FM_IFIFO:
-			list_blocks(fs, nod);
-			break;
-		default:
-			list_blocks(fs, nod);
+		off_t data = lseek(di->old->fd, off, SEEK_DATA);
+		oldzero = (data < 0 && errno == ENXIO) || data >= off + (off_t) len;
 	}
-	printf("Done with inode %d\n",nod);
-out:
-	put_nod(ni);
+#endif
+	// empty in both, without looking
+	if (oldzero && !di->s.fill && scan_free(&di->s, blk, end - blk)) {
+		memset(di->state + blk, PATCH_END, end - blk);
+		return;
+	}
+	w.bbm = malloc(BLOCKSIZE);
+	ob = malloc(len);
+	nb = malloc(len);
+	if (!w.bbm || !ob || !nb)
+		error_msg_and_die("delta: out of memory");
+	if (oldzero)
+		memset(ob, 0, len);
+	else
+		io_read(di->old, ob, len, off);
+	for (i = blk; i < end; i += n) {
+		n = scan_run(&di->s, &w, i, end, &isfree);
+		b = nb + (size_t) (i - blk) * BLOCKSIZE;
+		if (isfree)
+			memset(b, di->s.fill, (size_t) n * BLOCKSIZE);
+		else
+			io_read(di->s.fs->io, b, (size_t) n * BLOCKSIZE,
+				((off_t) i) * BLOCKSIZE);
+	}
+	for (i = blk; i < end; i++) {
+		b = nb + (size_t) (i - blk) * BLOCKSIZE;
+		if (!memcmp(b, ob + (size_t) (i - blk) * BLOCKSIZE, BLOCKSIZE))
+			di->state[i] = PATCH_END;
+		else
+			di->state[i] = is_blk_empty(b) ? PATCH_ZERO : PATCH_DATA;
+	}
+	free(w.bbm);
+	free(ob);
+	free(nb);
 }
 
-// describes various fields in a filesystem
+// Write the patch from the --delta-from image to the finished image
 static void
-print_fs(filesystem *fs)
+delta_patch(filesystem *fs, FILE *fh)
 {
-	uint32 i;
-	blk_info *bi;
-	groupdescriptor *gd;
-	gd_info *gi;
-	uint8 *ibm;
+	uint32 blk, nblocks = fs->sb->s_blocks_count;
+	patch_writer pw;
+	delta_info di;
+	uint8 *b;
+	int fd;
 
-	printf("%d blocks (%d free, %d reserved), first data block: %d\n",
-	       fs->sb->s_blocks_count, fs->sb->s_free_blocks_count,
-	       fs->sb->s_r_blocks_count, fs->sb->s_first_data_block);
-	printf("%d inodes (%d free)\n", fs->sb->s_inodes_count,
-	       fs->sb->s_free_inodes_count);
-	printf("block size = %d, frag size = %d\n",
-	       fs->sb->s_log_block_size ? (fs->sb->s_log_block_size << 11) : 1024,
-	       fs->sb->s_log_frag_size ? (fs->sb->s_log_frag_size << 11) : 1024);
-	printf("number of groups: %d\n",GRP_NBGROUPS(fs));
-	printf("%d blocks per group,%d frags per group,%d inodes per group\n",
-	     fs->sb->s_blocks_per_group, fs->sb->s_frags_per_group,
-	     fs->sb->s_inodes_per_group);
-	printf("Size of inode table: %d blocks\n",
-		(int)(fs->sb->s_inodes_per_group * sizeof(inode) / BLOCKSIZE));
-	for (i = 0; i < GRP_NBGROUPS(fs); i++) {
-		printf("Group No: %d\n", i+1);
-		gd = get_gd(fs, i, &gi);
-		printf("block bitmap: block %d,inode bitmap: block %d, inode table: block %d\n",
-		     gd->bg_block_bitmap,
-		     gd->bg_inode_bitmap,
-		     gd->bg_inode_table);
-		printf("block bitmap allocation:\n");
-		print_bm(GRP_GET_GROUP_BBM(fs, gd, &bi),fs->sb->s_blocks_per_group);
-		GRP_PUT_GROUP_BBM(bi);
-		printf("inode bitmap allocation:\n");
-		ibm = GRP_GET_GROUP_IBM(fs, gd, &bi);
-		print_bm(ibm, fs->sb->s_inodes_per_group);
-		for (i = 1; i <= fs->sb->s_inodes_per_group; i++)
-			if (allocated(ibm, i))
-				print_inode(fs, i);
-		GRP_PUT_GROUP_IBM(bi);
-		put_gd(gi);
+	if ((fd = open(delta_from, O_RDONLY)) < 0)
+		perror_msg_and_die(delta_from);
+	di.old = io_open_fd(fd);
+	scan_init(&di.s, fs);
+	di.state = malloc(nblocks);
+	b = malloc(BLOCKSIZE);
+	if (!di.state || !b)
+		error_msg_and_die("delta: out of memory");
+	run_jobs((nblocks + DELTA_JOB - 1) / DELTA_JOB,
+		 fs->io->read_at == file_read_at, delta_job, &di);
+	patch_begin(&pw, fh, nblocks);
+	for (blk = 0; blk < nblocks; blk++) {
+		if (di.state[blk] == PATCH_DATA)
+			io_read(fs->io, b, BLOCKSIZE, ((off_t) blk) * BLOCKSIZE);
+		if (di.state[blk] != PATCH_END)
+			patch_add(&pw, blk, di.state[blk], b);
 	}
+	patch_end(&pw);
+	di.old->close(di.old);
+	free(di.s.bbms);
+	free(di.state);
+	free(b);
 }
 
+// Write the finished image to fsout, unless it was built there.
+// emptyval is the -e fill value.  The verity tree vt, if any, goes
+// after the image unless it has a file of its own.
 static void
-finish_fs(filesystem *fs)
+write_output(filesystem *fs, const char *fsout, int emptyval, verity_tree *vt)
 {
-	if (cache_flush(&fs->inodes))
-		error_msg_and_die("entry mismatch on inode cache flush");
-	if (cache_flush(&fs->blkmaps))
-		error_msg_and_die("entry mismatch on blockmap cache flush");
-	if (cache_flush(&fs->gds))
-		error_msg_and_die("entry mismatch on gd cache flush");
-	if (cache_flush(&fs->blks))
-		error_msg_and_die("entry mismatch on block cache flush");
-	if(fs->swapit)
-		swap_sb(fs->sb);
-	if (fseek(fs->f, SUPERBLOCK_OFFSET, SEEK_SET))
-		perror_msg_and_die("fseek");
-	if(fwrite(fs->sb, SUPERBLOCK_SIZE, 1, fs->f) != 1)
-		perror_msg_and_die("output filesystem superblock");
-	if(fs->swapit)
-		swap_sb(fs->sb);
+	off_t size = ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE;
+	image_digest dg;
+	io_backend *out;
+
+	if(!fsout)
+		return;
+	dg_init(&dg, digest_alg, digest_tree);
+	if(strcmp(fsout, "-") == 0) {
+		fflush(stdout);
+		out = io_open_stream(STDOUT_FILENO);
+	} else if(overlay || streaming || OUTPUT_SEPARATE)
+		out = io_open(fsout, O_RDWR | O_CREAT | O_TRUNC);
+	else {
+		if(vt && !verity_file)
+			io_write(fs->io, vt->buf, vt->len, size);
+		if(digest_alg) {
+			digest_image(fs, &dg);
+			if(vt && !verity_file)
+				dg_update(&dg, vt->buf, vt->len);
+			write_digest(&dg, fsout);
+		}
+		return;
+	}
+	// the digest is that of the file written, compressed or not
+	if(digest_alg)
+		out = io_open_digest(out, &dg);
+	if(compress_method)
+		out = io_open_compress(out, compress_method);
+	if(output_format == FMT_SIMG)
+		simg_emit(fs, out, emptyval);
+	else if(overlay)
+		overlay_emit(fs->io, out);
+	else if(io_is_plan(fs->io))
+		plan_emit(fs->io, out);
+	else {
+		copy_data(out, fs->io, 0, size);
+		// zeros up to the end
+		if(out->write_at(out, "", 0, size) < 0)
+			perror_msg_and_die("write image");
+	}
+	if(vt && !verity_file)
+		io_write(out, vt->buf, vt->len, size);
+	out->close(out);
+	if(digest_alg)
+		write_digest(&dg, fsout);
 }
 
 static void
-populate_fs(filesystem *fs, char **dopt, int didx, int squash_uids, int squash_perms, uint32 fs_timestamp, struct stats *stats)
+populate_fs(filesystem *fs, char **dopt, src_dir **srcs, int didx, int squash_uids, int squash_perms, uint32 fs_timestamp, struct stats *stats)
 {
 	int i;
 	for(i = 0; i < didx; i++)
@@ -3096,16 +8539,16 @@ populate_fs(filesystem *fs, char **dopt, int didx, int squash_uids, int squash_p
 		struct stat st;
 		FILE *fh;
 		int pdir;
-		char *pdest;
+		char *pdest = NULL;
 		uint32 nod = EXT2_ROOT_INO;
-		if(fs)
-			if((pdest = strchr(dopt[i], ':')))
-			{
-				*(pdest++) = 0;
-				if(!(nod = find_path(fs, EXT2_ROOT_INO, pdest)))
-					error_msg_and_die("path %s not found in filesystem", pdest);
-			}
-		stat(dopt[i], &st);
+		if((pdest = strchr(dopt[i], ':')))
+		{
+			*(pdest++) = 0;
+			if(fs && !(nod = find_path(fs, EXT2_ROOT_INO, pdest)))
+				error_msg_and_die("path %s not found in filesystem", pdest);
+		}
+		if(stat(dopt[i], &st) < 0)
+			perror_msg_and_die(dopt[i]);
 		switch(st.st_mode & S_IFMT)
 		{
 			case S_IFREG:
@@ -3118,7 +8561,18 @@ populate_fs(filesystem *fs, char **dopt, int didx, int squash_uids, int squash_p
 					perror_msg_and_die(".");
 				if(chdir(dopt[i]) < 0)
 					perror_msg_and_die(dopt[i]);
-				add2fs_from_dir(fs, nod, squash_uids, squash_perms, fs_timestamp, stats);
+				if(!srcs[i])
+					srcs[i] = src_read(pdest ? pdest : "");
+				if(fs && order_count)
+					add2fs_order(fs, nod, srcs[i], squash_uids, squash_perms, fs_timestamp);
+				// the first time, the root's block is counted
+				// already, otherwise start over with "." and ".."
+				if(stats && !pdest && stats->root_used) {
+					stats->nblocks += dir_blocks(srcs[i], stats->root_used) - 1;
+					stats->root_used = 0;
+				} else if(stats)
+					stats->nblocks += dir_blocks(srcs[i], 24);
+				add2fs_from_dir(fs, nod, srcs[i], squash_uids, squash_perms, fs_timestamp, stats);
 				if(fchdir(pdir) < 0)
 					perror_msg_and_die("fchdir");
 				if(close(pdir) < 0)
@@ -3127,6 +8581,9 @@ populate_fs(filesystem *fs, char **dopt, int didx, int squash_uids, int squash_p
 			default:
 				error_msg_and_die("%s is neither a file nor a directory", dopt[i]);
 		}
+		// leave it whole for the next pass
+		if(!fs && pdest)
+			pdest[-1] = ':';
 	}
 }
 
@@ -3145,9 +8602,9 @@ showhelp(void)
 	"  -d, --root <directory>\n"
 	"  -D, --devtable <file>\n"
 	"  -B, --block-size <bytes>\n"
-	"  -b, --size-in-blocks <blocks>\n"
+	"  -b, --size-in-blocks <blocks>|auto\n"
 	"  -i, --bytes-per-inode <bytes per inode>\n"
-	"  -N, --number-of-inodes <number of inodes>\n"
+	"  -N, --number-of-inodes <number of inodes>|auto\n"
 	"  -L, --volume-label <string>\n"
 	"  -m, --reserved-percentage <percentage of blocks to reserve>\n"
 	"  -o, --creator-os <os>      'linux' (default), 'hurd', 'freebsd' or number.\n"
@@ -3158,6 +8615,38 @@ showhelp(void)
 	"  -q, --squash               Same as \"-U -P\".\n"
 	"  -U, --squash-uids          Squash owners making all files be owned by root.\n"
 	"  -P, --squash-perms         Squash permissions on all files.\n"
+	"      --io-backend <name>    Image I/O: 'file' (default), 'direct' or 'count'.\n"
+	"      --writeback <mode>     'auto' (default), 'uring', 'threads' or 'sync'.\n"
+	"      --threads <count>      Threads for parallel work (default: one per CPU).\n"
+	"      --overlay              Keep changes to the -x image apart, don't copy it.\n"
+	"      --patch <file>         Write the changes to the -x image as a block patch.\n"
+	"      --delta-from <image>   Make the --patch against this image instead.\n"
+	"      --layout-from <image>  Keep the inodes and blocks files had in this image.\n"
+	"      --sort <order>         Add directory entries in 'none' (readdir, default)\n"
+	"                             or 'name' order.\n"
+	"      --sort-file <file>     Add the paths listed in file first, in that order.\n"
+	"      --order-file <file>    Add the listed paths before all others, one after\n"
+	"                             the other on disk.\n"
+	"      --alloc-policy <name>  'spread' (default) or 'orlov' to keep files near\n"
+	"                             their directory.\n"
+	"      --layout-report        Print how far apart the blocks of the tree are.\n"
+	"      --align <bytes>        Start the data of large files on a multiple of this.\n"
+	"      --align-threshold <size>  Align files of at least this size (default: the\n"
+	"                             alignment).\n"
+	"      --inline-indirect      Allocate the blocks of a file one after the other,\n"
+	"                             indirect ones with the data they map.\n"
+	"      --headroom <percent>   Free blocks and inodes to leave with -b and -N auto\n"
+	"                             or --shrink.\n"
+	"      --shrink               Cut the image down to the least size that holds it.\n"
+	"      --streaming            Plan the image in memory, write it in block order.\n"
+	"      --output-format <fmt>  'raw' (default) or 'simg' (Android sparse image).\n"
+	"      --compress <method>    Compress the output with 'gzip' or 'zstd'.\n"
+	"      --digest <method>      Checksum the output: 'md5' or 'sha256', '-tree' suffix\n"
+	"                             for a tree of 1 MiB leaves.\n"
+	"      --digest-file <file>   Checksum file (default: the image with .<method>).\n"
+	"      --verity               Append a dm-verity hash tree to the image.\n"
+	"      --verity-file <file>   Write the dm-verity hash tree to file instead.\n"
+	"      --verity-salt <hex>    Salt for the hash tree, '-' for none (default: random).\n"
 	"  -h, --help\n"
 	"  -V, --version\n"
 	"  -v, --verbose\n\n"
@@ -3169,6 +8658,33 @@ showhelp(void)
 
 #define MAX_FILENAME 255
 
+// long options without a short equivalent
+#define OPT_IO_BACKEND		256
+#define OPT_WRITEBACK		257
+#define OPT_THREADS		258
+#define OPT_OVERLAY		259
+#define OPT_PATCH		260
+#define OPT_STREAMING		261
+#define OPT_OUTPUT_FORMAT	262
+#define OPT_COMPRESS		263
+#define OPT_DIGEST		264
+#define OPT_DIGEST_FILE		265
+#define OPT_VERITY		266
+#define OPT_VERITY_FILE		267
+#define OPT_VERITY_SALT		268
+#define OPT_DELTA_FROM		269
+#define OPT_LAYOUT_FROM		270
+#define OPT_SORT		271
+#define OPT_SORT_FILE		272
+#define OPT_ORDER_FILE		273
+#define OPT_ALLOC_POLICY	274
+#define OPT_LAYOUT_REPORT	275
+#define OPT_ALIGN		276
+#define OPT_ALIGN_THRESHOLD	277
+#define OPT_INLINE_INDIRECT	278
+#define OPT_HEADROOM		279
+#define OPT_SHRINK		280
+
 extern char* optarg;
 extern int optind, opterr, optopt;
 
@@ -3198,15 +8714,19 @@ main(int argc, char **argv)
 	int nbresrvd = -1;
 	float bytes_per_inode = -1;
 	float reserved_frac = -1;
+	float headroom = 0;
 	int fs_timestamp = -1;
 	int creator_os = CREATOR_OS;
 	char * fsout = "-";
 	char * fsin = 0;
 	char * dopt[MAX_DOPT];
+	src_dir * srcs[MAX_DOPT] = { 0 };
 	int didx = 0;
 	char * gopt[MAX_GOPT];
 	int gidx = 0;
 	int verbose = 0;
+	int layout_report = 0;
+	int shrink = 0;
 	int holes = 0;
 	int emptyval = 0;
 	int squash_uids = 0;
@@ -3214,6 +8734,8 @@ main(int argc, char **argv)
 	uint16 endian = 1;
 	int bigendian = !*(char*)&endian;
 	char *volumelabel = NULL;
+	char *patchfile = NULL;
+	verity_tree *vt = NULL;
 	filesystem *fs;
 	int i;
 	int c;
@@ -3238,6 +8760,31 @@ main(int argc, char **argv)
 	  { "squash",		no_argument,		NULL, 'q' },
 	  { "squash-uids",	no_argument,		NULL, 'U' },
 	  { "squash-perms",	no_argument,		NULL, 'P' },
+	  { "io-backend",	required_argument,	NULL, OPT_IO_BACKEND },
+	  { "writeback",	required_argument,	NULL, OPT_WRITEBACK },
+	  { "threads",		required_argument,	NULL, OPT_THREADS },
+	  { "overlay",		no_argument,		NULL, OPT_OVERLAY },
+	  { "patch",		required_argument,	NULL, OPT_PATCH },
+	  { "delta-from",	required_argument,	NULL, OPT_DELTA_FROM },
+	  { "layout-from",	required_argument,	NULL, OPT_LAYOUT_FROM },
+	  { "sort",		required_argument,	NULL, OPT_SORT },
+	  { "sort-file",	required_argument,	NULL, OPT_SORT_FILE },
+	  { "order-file",	required_argument,	NULL, OPT_ORDER_FILE },
+	  { "alloc-policy",	required_argument,	NULL, OPT_ALLOC_POLICY },
+	  { "layout-report",	no_argument,		NULL, OPT_LAYOUT_REPORT },
+	  { "align",		required_argument,	NULL, OPT_ALIGN },
+	  { "align-threshold",	required_argument,	NULL, OPT_ALIGN_THRESHOLD },
+	  { "inline-indirect",	no_argument,		NULL, OPT_INLINE_INDIRECT },
+	  { "headroom",		required_argument,	NULL, OPT_HEADROOM },
+	  { "shrink",		no_argument,		NULL, OPT_SHRINK },
+	  { "streaming",	no_argument,		NULL, OPT_STREAMING },
+	  { "output-format",	required_argument,	NULL, OPT_OUTPUT_FORMAT },
+	  { "compress",		required_argument,	NULL, OPT_COMPRESS },
+	  { "digest",		required_argument,	NULL, OPT_DIGEST },
+	  { "digest-file",	required_argument,	NULL, OPT_DIGEST_FILE },
+	  { "verity",		no_argument,		NULL, OPT_VERITY },
+	  { "verity-file",	required_argument,	NULL, OPT_VERITY_FILE },
+	  { "verity-salt",	required_argument,	NULL, OPT_VERITY_SALT },
 	  { "help",		no_argument,		NULL, 'h' },
 	  { "version",		no_argument,		NULL, 'V' },
 	  { "verbose",		no_argument,		NULL, 'v' },
@@ -3265,13 +8812,13 @@ main(int argc, char **argv)
 				blocksize = SI_atof(optarg);
 				break;
 			case 'b':
-				nbblocks = SI_atof(optarg);
+				nbblocks = strcmp(optarg, "auto") ? SI_atof(optarg) : -1;
 				break;
 			case 'i':
 				bytes_per_inode = SI_atof(optarg);
 				break;
 			case 'N':
-				nbinodes = SI_atof(optarg);
+				nbinodes = strcmp(optarg, "auto") ? SI_atof(optarg) : -1;
 				break;
 			case 'L':
 				volumelabel = optarg;
@@ -3304,6 +8851,157 @@ main(int argc, char **argv)
 			case 'P':
 				squash_perms = 1;
 				break;
+			case OPT_IO_BACKEND:
+				if (!strcmp(optarg, "file"))
+					io_type = IO_FILE;
+				else if (!strcmp(optarg, "direct"))
+					io_type = IO_DIRECT;
+				else if (!strcmp(optarg, "count"))
+					io_type = IO_COUNT;
+				else
+					error_msg_and_die("Unknown I/O backend '%s'.", optarg);
+				break;
+			case OPT_WRITEBACK:
+				if (!strcmp(optarg, "auto"))
+					wb_mode = WB_AUTO;
+				else if (!strcmp(optarg, "uring"))
+					wb_mode = WB_URING;
+				else if (!strcmp(optarg, "threads"))
+					wb_mode = WB_THREADS;
+				else if (!strcmp(optarg, "sync"))
+					wb_mode = WB_SYNC;
+				else
+					error_msg_and_die("Unknown writeback mode '%s'.", optarg);
+				break;
+			case OPT_THREADS:
+			{
+				char *end;
+				long n = strtol(optarg, &end, 10);
+
+				if (end == optarg || *end || n < 1)
+					error_msg_and_die("Invalid thread count '%s'.", optarg);
+				nthreads = n > JOB_THREADS_MAX ? JOB_THREADS_MAX : n;
+				break;
+			}
+			case OPT_OVERLAY:
+				overlay = 1;
+				break;
+			case OPT_PATCH:
+				patchfile = optarg;
+				break;
+			case OPT_DELTA_FROM:
+				delta_from = optarg;
+				break;
+			case OPT_LAYOUT_FROM:
+				layout_from = optarg;
+				break;
+			case OPT_SORT:
+				if (!strcmp(optarg, "none"))
+					sort_mode = SORT_NONE;
+				else if (!strcmp(optarg, "name"))
+					sort_mode = SORT_NAME;
+				else
+					error_msg_and_die("Unknown sort order '%s'.", optarg);
+				break;
+			case OPT_SORT_FILE:
+				sort_load(optarg);
+				sort_mode = SORT_NAME;
+				break;
+			case OPT_ORDER_FILE:
+				order_list = read_paths(optarg, &order_count);
+				break;
+			case OPT_ALLOC_POLICY:
+				if (!strcmp(optarg, "spread"))
+					alloc_policy = ALLOC_SPREAD;
+				else if (!strcmp(optarg, "orlov"))
+					alloc_policy = ALLOC_ORLOV;
+				else
+					error_msg_and_die("Unknown allocation policy '%s'.", optarg);
+				break;
+			case OPT_LAYOUT_REPORT:
+				layout_report = 1;
+				break;
+			case OPT_ALIGN:
+			{
+				float f = SI_atof(optarg);
+
+				if (f < 1 || f >= 4294967296.0 || f != (uint32)f)
+					error_msg_and_die("Invalid alignment '%s'.", optarg);
+				align = f;
+				break;
+			}
+			case OPT_ALIGN_THRESHOLD:
+			{
+				float f = SI_atof(optarg);
+
+				if (f < 1 || f != (off_t)f)
+					error_msg_and_die("Invalid alignment threshold '%s'.", optarg);
+				align_threshold = f;
+				break;
+			}
+			case OPT_INLINE_INDIRECT:
+				inline_indirect = 1;
+				break;
+			case OPT_HEADROOM:
+				headroom = SI_atof(optarg);
+				break;
+			case OPT_SHRINK:
+				shrink = 1;
+				break;
+			case OPT_STREAMING:
+				streaming = 1;
+				break;
+			case OPT_OUTPUT_FORMAT:
+				if (!strcmp(optarg, "raw"))
+					output_format = FMT_RAW;
+				else if (!strcmp(optarg, "simg"))
+					output_format = FMT_SIMG;
+				else
+					error_msg_and_die("Unknown output format '%s'.", optarg);
+				break;
+			case OPT_COMPRESS:
+				if (!strcmp(optarg, "none"))
+					compress_method = CZ_NONE;
+#if HAVE_ZLIB_H && HAVE_LIBZ
+				else if (!strcmp(optarg, "gzip"))
+					compress_method = CZ_GZIP;
+#endif
+#if HAVE_ZSTD_H && HAVE_LIBZSTD
+				else if (!strcmp(optarg, "zstd"))
+					compress_method = CZ_ZSTD;
+#endif
+				else
+					error_msg_and_die("Unknown or unsupported compression '%s'.", optarg);
+				break;
+			case OPT_DIGEST:
+			{
+				size_t len = strlen(optarg);
+
+				digest_name = optarg;
+				digest_tree = len > 5 && !strcmp(optarg + len - 5, "-tree");
+				if (digest_tree)
+					len -= 5;
+				if (len == 3 && !strncmp(optarg, "md5", 3))
+					digest_alg = DIGEST_MD5;
+				else if (len == 6 && !strncmp(optarg, "sha256", 6))
+					digest_alg = DIGEST_SHA256;
+				else
+					error_msg_and_die("Unknown digest '%s'.", optarg);
+				break;
+			}
+			case OPT_DIGEST_FILE:
+				digest_file = optarg;
+				break;
+			case OPT_VERITY:
+				verity = 1;
+				break;
+			case OPT_VERITY_FILE:
+				verity_file = optarg;
+				verity = 1;
+				break;
+			case OPT_VERITY_SALT:
+				verity_salt = optarg;
+				break;
 			case 'h':
 				showhelp();
 				exit(0);
@@ -3321,9 +9019,33 @@ main(int argc, char **argv)
 
 	if(optind < (argc - 1))
 		error_msg_and_die("Too many arguments. Try --help or else see the man page.");
-	if(optind > (argc - 1))
+	// with --patch, the image itself is optional
+	if(optind > (argc - 1) && !patchfile)
 		error_msg_and_die("Not enough arguments. Try --help or else see the man page.");
-	fsout = argv[optind];
+	fsout = (optind < argc) ? argv[optind] : NULL;
+	// the patch is against the starting image, unless there's another
+	if(patchfile && !delta_from)
+		overlay = 1;
+	if(delta_from && !patchfile)
+		error_msg_and_die("--delta-from needs --patch.");
+	if(delta_from && fsout && strcmp(fsout, "-")) {
+		struct stat st1, st2;
+		if(!stat(delta_from, &st1) && !stat(fsout, &st2) &&
+		   st1.st_ino == st2.st_ino && st1.st_dev == st2.st_dev)
+			error_msg_and_die("the output can't be the --delta-from image.");
+	}
+	if(overlay && !fsin)
+		error_msg_and_die("--overlay and --patch need a starting image (-x).");
+	if(layout_from && fsin)
+		error_msg_and_die("--layout-from can't be used with -x.");
+	if(streaming && fsin)
+		error_msg_and_die("--streaming can't start from an image, see --overlay.");
+	if(digest_alg && !fsout)
+		error_msg_and_die("--digest needs an output image.");
+	if(digest_alg && !strcmp(fsout, "-") && !digest_file)
+		error_msg_and_die("--digest with the image on stdout needs --digest-file.");
+	if(verity && !verity_file && (!fsout || output_format != FMT_RAW))
+		error_msg_and_die("--verity needs --verity-file without a raw output image.");
 
 	if(blocksize != 1024 && blocksize != 2048 && blocksize != 4096)
 		error_msg_and_die("Valid block sizes: 1024, 2048 or 4096.");
@@ -3340,19 +9062,45 @@ main(int argc, char **argv)
 		}
 		else
 			fs = load_fs(stdin, bigendian, fsout);
+		if(nbblocks != -1) {
+			if(nbblocks < fs->sb->s_blocks_count)
+				error_msg_and_die("-b can't be less than the %u blocks of the -x image, see --shrink.",
+						  fs->sb->s_blocks_count);
+			grow_fs(fs, nbblocks);
+		}
 	}
 	else
 	{
+		int lost_found;
+
 		if(reserved_frac == -1)
 			nbresrvd = nbblocks * RESERVED_BLOCKS;
 		else 
 			nbresrvd = nbblocks * reserved_frac;
-
-		stats.ninodes = EXT2_FIRST_INO - 1 + (nbresrvd ? 1 : 0);
-		stats.nblocks = 0;
-
-		populate_fs(NULL, dopt, didx, squash_uids, squash_perms, fs_timestamp, &stats);
-
+		// unless it's too small for any reserved blocks
+		lost_found = (nbblocks == -1) ? reserved_frac != 0 : nbresrvd != 0;
+
+		// the root directory and lost+found, as init_fs makes them
+		stats.ninodes = EXT2_FIRST_INO - 1 + (lost_found ? 1 : 0);
+		stats.nblocks = 1 + (lost_found ? file_blocks(16) : 0);
+		stats.root_used = 24 + (lost_found ? sizeof(directory) + rndup(10, 4) : 0);
+		stats.links = NULL;
+		stats.nlinks = 0;
+
+		populate_fs(NULL, dopt, srcs, didx, squash_uids, squash_perms, fs_timestamp, &stats);
+		stats_links(&stats);
+
+		// the room asked for on top of what is added
+		stats.ninodes += percent_of(stats.ninodes - (EXT2_FIRST_INO - 1), headroom);
+		if(nbblocks == -1) {
+			stats.nblocks += percent_of(stats.nblocks, headroom);
+			nbblocks = auto_blocks(stats.nblocks, (nbinodes == -1) ?
+					       stats.ninodes : nbinodes, bytes_per_inode);
+			if(reserved_frac == -1)
+				nbresrvd = nbblocks * RESERVED_BLOCKS;
+			else
+				nbresrvd = nbblocks * reserved_frac;
+		}
 		if(nbinodes == -1)
 			nbinodes = stats.ninodes;
 		else
@@ -3376,25 +9124,32 @@ main(int argc, char **argv)
 		strncpy((char *)fs->sb->s_volume_name, volumelabel,
 			sizeof(fs->sb->s_volume_name));
 	
-	populate_fs(fs, dopt, didx, squash_uids, squash_perms, fs_timestamp, NULL);
-
-	if(emptyval) {
-		uint32 b;
-		for(b = 1; b < fs->sb->s_blocks_count; b++) {
-			blk_info *bi;
-			gd_info *gi;
-			if(!allocated(GRP_GET_BLOCK_BITMAP(fs,b,&bi,&gi),
-				      GRP_BBM_OFFSET(fs,b))) {
-				blk_info *bi2;
-				memset(get_blk(fs, b, &bi2), emptyval,
-				       BLOCKSIZE);
-				put_blk(bi2);
-			}
-			GRP_PUT_BLOCK_BITMAP(bi,gi);
-		}
-	}
+	if(align % BLOCKSIZE)
+		error_msg_and_die("--align must be a multiple of the block size.");
+	if(align / BLOCKSIZE > fs->sb->s_blocks_per_group)
+		error_msg_and_die("--align can't be more than the %u blocks of a group.",
+				  fs->sb->s_blocks_per_group);
+	if(align_threshold == -1)
+		align_threshold = align;
+	if(layout_from)
+		layout_open(fs, layout_from);
+	populate_fs(fs, dopt, srcs, didx, squash_uids, squash_perms, fs_timestamp, NULL);
+	for(i = 0; i < didx; i++)
+		src_free(srcs[i]);
+	if(layout_from)
+		layout_close(fs);
+	if(shrink)
+		shrink_fs(fs, headroom);
+
+	// a sparse image describes the fill instead
+	fill_free_blks(fs, output_format == FMT_SIMG ? 0 : emptyval);
 	if(verbose)
 		print_fs(fs);
+	// keep stdout for the image
+	if(layout_report)
+		report_layout(fs, (fsout && !strcmp(fsout, "-")) ? stderr : stdout);
+	if(align > BLOCKSIZE)
+		report_align(fs, (fsout && !strcmp(fsout, "-")) ? stderr : stdout);
 	for(i = 0; i < gidx; i++)
 	{
 		uint32 nod;
@@ -3414,8 +9169,29 @@ main(int argc, char **argv)
 		fclose(fh);
 	}
 	finish_fs(fs);
-	if(strcmp(fsout, "-") == 0)
-		copy_file(fs, stdout, fs->f, fs->sb->s_blocks_count);
+	if(patchfile) {
+		FILE *fh = xfopen(patchfile, "wb");
+		if(delta_from)
+			delta_patch(fs, fh);
+		else
+			overlay_patch(fs->io, fh);
+		if(fclose(fh))
+			perror_msg_and_die("writing patch");
+	}
+	if(verity)
+		vt = verity_build(fs);
+	write_output(fs, fsout, emptyval, vt);
+	if(vt) {
+		if(verity_file) {
+			FILE *fh = xfopen(verity_file, "wb");
+			if(fwrite(vt->buf, vt->len, 1, fh) != 1 || fclose(fh))
+				perror_msg_and_die("writing verity tree");
+		}
+		// keep stdout for the image
+		verity_report(vt, (fsout && !strcmp(fsout, "-")) ? stderr : stdout,
+			      ((off_t) fs->sb->s_blocks_count) * BLOCKSIZE);
+		verity_free(vt);
+	}
 
 	free_fs(fs);
 	return 0;
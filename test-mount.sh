@@ -89,6 +89,18 @@ ltest_mount () {
 	pass ltest $@
 }
 
+# shtest_mount - Exercise the --shrink option of genext2fs.
+shtest_mount () {
+	shgen $@
+	test_common
+	awk 'BEGIN { for (i = 0; i < 40000; i++) print "line " i }' > fout
+	cmp fout $test_mnt/a/big || fail
+	test -f $test_mnt/a/b/file || fail
+	test $test_mnt/c/file -ef $test_mnt/d/link || fail
+	test 2 = "`ls -l $test_mnt/c/file | awk '{print $2}'`" || fail
+	pass shtest $@
+}
+
 dtest_mount 4096 1024 0
 dtest_mount 2048 2048 0
 dtest_mount 1024 4096 0
@@ -105,7 +117,12 @@ dtest_mount 4500 2048 8388608
 dtest_mount 2250 4096 8388608
 dtest_mount 20000 1024 16777216
 dtest_mount 10000 2048 16777216
+dtest_mount auto 1024 8388608
+dtest_mount auto 4096 274432
 ftest_mount 4096 default device_table.txt
 ltest_mount 200 1024 123456789
 ltest_mount 200 1024 1234567890
 ltest_mount 200 4096 12345678901
+shtest_mount 65536 1024 4096
+shtest_mount 32768 2048 8192
+shtest_mount 1100000 2048 1024
@@ -31,6 +31,14 @@ dtest () {
 	gen_cleanup
 }
 
+shtest () {
+	expected_digest=$1
+	shift
+	shgen $@
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
 ftest () {
 	expected_digest=$1
 	shift
@@ -39,6 +47,363 @@ ftest () {
 	gen_cleanup
 }
 
+# otest - like dtest, with extra genext2fs options that must not change
+# the resulting image: the image made without them is checked against
+# the same digest.
+otest () {
+	gen_opts=$1
+	shift
+	dtest $@
+	gen_opts=
+	dtest $@
+}
+
+# optest - like dtest, with extra genext2fs options that do change the
+# image, so the digest is that of the image made with them
+optest () {
+	gen_opts=$1
+	shift
+	dtest $@
+	gen_opts=
+}
+
+# swtest - like optest, also checking that --layout-report finds the
+# file read in one forward sweep, each indirect block before the blocks
+# it maps
+swtest () {
+	gen_opts="$1 --layout-report"
+	shift
+	expected_digest=$1
+	shift
+	dgen $@ > t_tmp_report
+	gen_opts=
+	if ! grep -q "^layout: 0 of 1 files not read in one forward sweep" t_tmp_report ; then
+		echo FAIL
+		exit 1
+	fi
+	rm t_tmp_report
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# sotest - like dtest, then writing the image to stdout, a file and a
+# pipe, from a temporary file and planned with --streaming: all must
+# give the same image
+sotest () {
+	expected_digest=$1
+	shift
+	dgen $@
+	md5cmp $expected_digest
+	for opts in "" --streaming ; do
+		./genext2fs -B $2 -N 17 -b $1 -d $test_dir -f -o Linux -q $opts - > $test_img
+		md5cmp $expected_digest
+		./genext2fs -B $2 -N 17 -b $1 -d $test_dir -f -o Linux -q $opts - | cat > $test_img
+		md5cmp $expected_digest
+	done
+	gen_cleanup
+}
+
+# ctest - like dtest, with the image compressed by --compress=$1 and
+# checked after decompressing it with the usual tool of that name
+ctest () {
+	method=$1
+	expected_digest=$2
+	shift 2
+	gen_opts="--compress=$method"
+	dgen $@
+	gen_opts=
+	$method -dc $test_img > t_tmp_plain.img
+	mv t_tmp_plain.img $test_img
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# abtest - the contents of dgen, that -b auto fits in the fewest blocks,
+# must not fit in one block less
+abtest () {
+	dgen auto $@
+	blocks=`wc -c < $test_img`
+	blocks=`expr $blocks / $1 - 1`
+	rm $test_img
+	if ./genext2fs -B $1 -N 17 -b $blocks -d $test_dir -f -o Linux -q $test_img 2>/dev/null ; then
+		echo FAIL
+		exit 1
+	fi
+	echo PASS
+	rm -rf $test_dir $test_img
+}
+
+# bdtest - dgen must fail with the extra genext2fs options given
+bdtest () {
+	gen_opts=$1
+	shift
+	if dgen $@ 2>/dev/null ; then
+		echo FAIL
+		exit 1
+	fi
+	gen_opts=
+	echo PASS
+	rm -rf $test_dir $test_img
+}
+
+# dgtest - like dtest, also checking the checksum file from --digest=$1
+# against $2
+dgtest () {
+	method=$1
+	expected_sum=$2
+	expected_digest=$3
+	shift 3
+	gen_opts="--digest=$method --digest-file=$test_dir/sum"
+	dgen $@
+	gen_opts=
+	if [ x`cut -f 1 -d " " $test_dir/sum` != x$expected_sum ] ; then
+		echo FAIL
+		exit 1
+	fi
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# dgptest - like dgtest with md5, the image written to a pipe with the
+# extra options $1: the checksum must be that of the data written, which
+# is the image once decompressed if $1 is a --compress
+dgptest () {
+	opts=$1
+	expected_digest=$2
+	shift 2
+	dgen $@
+	./genext2fs -B $2 -N 17 -b $1 -d $test_dir -f -o Linux -q $opts --digest=md5 --digest-file=t_tmp_sum - | cat > $test_img
+	md5cmp `cut -f 1 -d " " t_tmp_sum`
+	case $opts in
+	--compress=*)
+		${opts#--compress=} -dc $test_img > t_tmp_plain.img
+		mv t_tmp_plain.img $test_img ;;
+	esac
+	md5cmp $expected_digest
+	gen_cleanup
+	rm t_tmp_sum
+}
+
+# vtest - like dtest, also checking the dm-verity tree from --verity-file
+vtest () {
+	expected_tree=$1
+	expected_digest=$2
+	shift 2
+	gen_opts="--verity-file=$test_dir/verity --verity-salt=00"
+	dgen $@
+	gen_opts=
+	img=$test_img
+	test_img=$test_dir/verity
+	md5cmp $expected_tree
+	test_img=$img
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# ptest - checks the --patch made with --delta-from, from the image of
+# an empty file to that of the given size
+ptest () {
+	expected_patch=$1
+	shift
+	dgen $1 $2 0
+	mv $test_img t_tmp_old.img
+	rm -r $test_dir
+	gen_opts="--delta-from=t_tmp_old.img --patch=t_tmp_patch"
+	dgen $@
+	gen_opts=
+	img=$test_img
+	test_img=t_tmp_patch
+	md5cmp $expected_patch
+	test_img=$img
+	gen_cleanup
+	rm t_tmp_old.img t_tmp_patch
+}
+
+# gtest - grows the image of an empty file, of oldblocks blocks, to
+# blocks blocks with -x, adding the file of the given size; a last
+# group too small for its own metadata is left out
+gtest () {
+	expected_digest=$1
+	oldblocks=$2
+	shift 2
+	dgen $oldblocks $2 0
+	mv $test_img t_tmp_old.img
+	rm -r $test_dir
+	gen_opts="-x t_tmp_old.img"
+	dgen $@
+	gen_opts=
+	md5cmp $expected_digest
+	gen_cleanup
+	rm t_tmp_old.img
+}
+
+# the little endian 32-bit value at offset $2 of file $1
+le32 () {
+	set -- `od -An -tu1 -j $2 -N 4 $1`
+	echo $(($1 + $2 * 256 + $3 * 65536 + $4 * 16777216))
+}
+
+# apply the --patch $1 to the image $2
+patch_apply () {
+	bs=`le32 $1 12`
+	off=24
+	while : ; do
+		type=`le32 $1 $off`
+		blk=`le32 $1 $(($off + 4))`
+		cnt=`le32 $1 $(($off + 8))`
+		off=$(($off + 12))
+		case $type in
+		0)	break ;;
+		1)	tail -c +$(($off + 1)) $1 | head -c $(($cnt * $bs)) |
+			dd of=$2 bs=$bs seek=$blk conv=notrunc 2>/dev/null
+			off=$(($off + $cnt * $bs)) ;;
+		2)	dd if=/dev/zero of=$2 bs=$bs seek=$blk count=$cnt conv=notrunc 2>/dev/null ;;
+		esac
+	done
+	dd if=/dev/null of=$2 bs=$bs seek=`le32 $1 16` 2>/dev/null
+}
+
+# xtest - adds the file of dgen with -x to the image of an empty file,
+# with and without --overlay, to a file and to stdout, and as a --patch
+# applied to that image: all must give the same image
+xtest () {
+	expected_digest=$1
+	shift
+	dgen $1 $2 0
+	mv $test_img t_tmp_base.img
+	rm -r $test_dir
+	gen_opts="-x t_tmp_base.img"
+	dgen $@
+	md5cmp $expected_digest
+	for opts in "" --overlay ; do
+		./genext2fs -B $2 -N 17 -b $1 -d $test_dir -f -o Linux -q -x t_tmp_base.img $opts - > $test_img
+		md5cmp $expected_digest
+	done
+	gen_opts="-x t_tmp_base.img --overlay"
+	rm -r $test_dir
+	dgen $@
+	gen_opts=
+	md5cmp $expected_digest
+	./genext2fs -B $2 -N 17 -b $1 -d $test_dir -f -o Linux -q -x t_tmp_base.img --patch=t_tmp_patch
+	mv t_tmp_base.img $test_img
+	patch_apply t_tmp_patch $test_img
+	md5cmp $expected_digest
+	gen_cleanup
+	rm t_tmp_patch
+}
+
+# htest - like dtest, building over an output file full of random
+# data, then again in place with -x over the image made with -e 255:
+# the free blocks must be punched out, so the image reads back the same
+# and takes less room than its size
+htest () {
+	expected_digest=$1
+	shift
+	dd if=/dev/urandom of=$test_img bs=$2 count=$1 2>/dev/null
+	dgen $@
+	md5cmp $expected_digest
+	rm -r $test_dir
+	gen_opts="-e 255"
+	dgen $@
+	gen_opts=
+	./genext2fs -x $test_img -B $2 $test_img
+	md5cmp $expected_digest
+	if [ `du -k $test_img | cut -f 1` -ge `expr $1 \* $2 / 1024` ] ; then
+		echo FAIL
+		exit 1
+	fi
+	gen_cleanup
+}
+
+# lotest - rebuilds the image of dgen with a directory made before the
+# file, following the first image with --layout-from: the file must keep
+# its blocks
+lotest () {
+	expected_digest=$1
+	shift
+	gen_opts="-g file.$3"
+	dgen $@
+	gen_opts=
+	mv $test_img t_tmp_old.img
+	mv file.$3.blk t_tmp_old.blk
+	echo "/dev d 755 0 0 - - - - -" > t_tmp_dev
+	TZ=UTC-11 touch -t 200502070321.43 t_tmp_dev
+	./genext2fs -B $2 -N 17 -b $1 -D t_tmp_dev -d $test_dir -f -o Linux -q -g file.$3 --layout-from=t_tmp_old.img $test_img
+	if ! cmp -s t_tmp_old.blk file.$3.blk ; then
+		echo FAIL
+		exit 1
+	fi
+	md5cmp $expected_digest
+	gen_cleanup
+	rm t_tmp_old.img t_tmp_old.blk t_tmp_dev file.$3.blk
+}
+
+# stest - builds an image of a few files made out of order, sorted by
+# name or after the paths given in a --sort-file list
+stest () {
+	expected_digest=$1
+	shift
+	echo Testing sorted directory entries $@
+	mkdir $test_dir
+	for f in c a d b ; do
+		echo $f > $test_dir/$f
+		TZ=UTC-11 touch -t 200502070321.43 $test_dir/$f
+	done
+	TZ=UTC-11 touch -t 200502070321.43 $test_dir
+	if [ $# -gt 0 ] ; then
+		printf '%s\n' $@ > t_tmp_sort
+		./genext2fs -N 17 -b 1024 -d $test_dir -f -o Linux -q --sort-file=t_tmp_sort $test_img
+		rm t_tmp_sort
+	else
+		./genext2fs -N 17 -b 1024 -d $test_dir -f -o Linux -q --sort=name $test_img
+	fi
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# ortest - like stest, with the files listed in an --order-file added
+# first and the others sorted by name
+ortest () {
+	expected_digest=$1
+	shift
+	echo Testing ordered files $@
+	mkdir $test_dir
+	for f in c a d b ; do
+		dd if=/dev/zero of=$test_dir/$f bs=1024 count=20 2>/dev/null
+		TZ=UTC-11 touch -t 200502070321.43 $test_dir/$f
+	done
+	TZ=UTC-11 touch -t 200502070321.43 $test_dir
+	printf '%s\n' $@ > t_tmp_order
+	./genext2fs -N 17 -b 1024 -d $test_dir -f -o Linux -q --sort=name --order-file=t_tmp_order $test_img
+	rm t_tmp_order
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
+# atest - builds an image of a few directories spread over the block
+# groups by --alloc-policy=orlov, with a file each, and checks the
+# blocks read, seeks and seek distance --layout-report finds in it
+atest () {
+	expected_digest=$1
+	echo Testing the orlov allocation policy
+	mkdir $test_dir
+	for d in a b c ; do
+		mkdir $test_dir/$d
+		dd if=/dev/zero of=$test_dir/$d/f bs=1024 count=20 2>/dev/null
+		TZ=UTC-11 touch -t 200502070321.43 $test_dir/$d/f $test_dir/$d
+	done
+	TZ=UTC-11 touch -t 200502070321.43 $test_dir
+	./genext2fs -N 48 -b 20000 -d $test_dir -f -o Linux -q --sort=name --alloc-policy=orlov --layout-report $test_img > t_tmp_report
+	if ! grep -q "^layout: $2 blocks read, $3 seeks, $4 blocks of seek distance" t_tmp_report ||
+	   ! grep -q "^layout: 0 of 3 files not read in one forward sweep" t_tmp_report ; then
+		echo FAIL
+		exit 1
+	fi
+	rm t_tmp_report
+	md5cmp $expected_digest
+	gen_cleanup
+}
+
 ltest () {
 	expected_digest=$1
 	shift
@@ -47,6 +412,57 @@ ltest () {
 	gen_cleanup
 }
 
+# test-mount.sh has no counterpart for these, so they are kept out of
+# the lines it regenerates below
+
+abtest 1024 8388608
+abtest 4096 274432
+abtest 2048 16777216
+otest --io-backend=direct 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+otest --io-backend=count 63f60f06d4a4858404a09d071b688a7d 8193 4096 0
+otest --threads=3 84dbb9949b3c1c9d7f3237d3cdaa86b5 20000 1024 16777216
+otest --writeback=threads 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+otest --writeback=sync 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+otest --streaming 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+otest --streaming 84dbb9949b3c1c9d7f3237d3cdaa86b5 20000 1024 16777216
+sotest 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+sotest 63f60f06d4a4858404a09d071b688a7d 8193 4096 0
+optest --output-format=simg e5c3d95dbce8ac38bdf9874111232460 9000 1024 8388608
+if grep -q 'define HAVE_LIBZ 1' config.h 2>/dev/null ; then
+	ctest gzip 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+	dgptest --compress=gzip 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+fi
+if grep -q 'define HAVE_LIBZSTD 1' config.h 2>/dev/null &&
+   grep -q 'define HAVE_ZSTD_H 1' config.h ; then
+	ctest zstd 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+fi
+dgtest md5 2dcd1c07084e616433b43043c1309cc6 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+dgtest sha256 5f56b32c0a809caeb4dcb4825f725f3ac5d189213154cfd9c5c66f290cb3d4e6 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+dgtest sha256-tree 90f7522c0752982088ac0603a468298bfa4a4be85c837b51d920b0401fa14daa 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+dgptest --streaming 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+vtest 1ea2f4ccae0c8788a6b1e7144e96aee1 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+ptest d3d90d19ae0165c7b3cd62602d24d01b 9000 1024 8388608
+htest 2dcd1c07084e616433b43043c1309cc6 9000 1024 8388608
+xtest 778cd212ba8c7ab475380e9800bb52b1 9000 1024 8388608
+lotest 48a6e06cce26e533c4b37261aaabea39 9000 1024 8388608
+stest 0161820412626960370b19450384cdfa
+stest ef03195191956c14dd8c2e2370c86cdb /d b
+ortest 160bfeff44be3addf4afdc250fcb9fb8 /d b
+atest 8bb52f5691e21a42a69f9928d6e56230 91 16 60096
+optest --align=1Mi d25bfe0dc582bb43bcb684557a821e0a 4500 2048 8388608
+optest --align=64Ki aa001ad93bb97e86e16fc3712cbea4c4 2250 4096 8388608
+bdtest --align=-4Ki 2250 4096 8388608
+bdtest --align=0 2250 4096 8388608
+bdtest --align=6Ki 2250 4096 8388608
+bdtest --align=1Gi 2250 4096 8388608
+bdtest --align-threshold=0 2250 4096 8388608
+bdtest --align-threshold=1.5 2250 4096 8388608
+swtest --inline-indirect 804e5a1ddd513fd4a64c6b7820ad8b20 20000 1024 8388608
+optest --shrink 109b3e0257716481b56f7737a85dd27b 20000 1024 16777216
+gtest 1fd88661807b1a6a9bcc17be14f027de 4096 20000 1024 16777216
+gtest 61e9fa17b707f3ff15243abd93cfd183 1100 2250 4096 8388608
+gtest 4bef3a8b143c2199958f8333710e45d9 1100 2210 4096 8388608
+
 # NB: always use test-mount.sh to regenerate these digests, that is,
 # replace the following lines with the output of
 # sudo sh test-mount.sh|grep test
@@ -67,7 +483,12 @@ dtest 227d38c05d5860dc039812eed603f20f 4500 2048 8388608
 dtest 627c09439a5ed6194900f12f5591d28e 2250 4096 8388608
 dtest 84dbb9949b3c1c9d7f3237d3cdaa86b5 20000 1024 16777216
 dtest a4ab80a62c0fd09a3be023c77e0307b1 10000 2048 16777216
+dtest 6fe3be6caf0abea4d1a7a0bb38aa4887 auto 1024 8388608
+dtest cca01dac4e87abc2175f92e2a9fbcd17 auto 4096 274432
 ftest 9108433a817035cb5306e8217d5e634b 4096 default device_table.txt
 ltest 25a6bbe241965e71c077b47dab4172db 200 1024 123456789
 ltest fcf5cd1344bbe3787418fb857f66b131 200 1024 1234567890
 ltest 9b70d483ee1b3447c63a32096154fa05 200 4096 12345678901
+shtest 7a43219b3cadcb99dfea7e508440ee23 65536 1024 4096
+shtest 844cccc11edf533d439fc24ec29b01a8 32768 2048 8192
+shtest 08e2938801119e530c5b8bf73a935a5d 1100000 2048 1024